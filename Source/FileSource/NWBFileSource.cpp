@@ -29,6 +29,34 @@ using namespace H5;
 
 #define PROCESS_ERROR std::cerr << "NWBFilesource exception: " << error.getCDetailMsg() << std::endl
 
+/* In follow mode, readData waits up to FOLLOW_WAIT_MS for new samples, polling every FOLLOW_POLL_MS */
+#define FOLLOW_WAIT_MS 1000
+#define FOLLOW_POLL_MS 10
+
+/* Files with paged file space are read through a page buffer of PAGE_BUFFER_PAGES pages */
+#define PAGE_BUFFER_PAGES 64
+
+/* Returns true if the file was created with paged file space, and its page size */
+static bool usesPagedFileSpace (hid_t fileId, hsize_t& pageSize)
+{
+    const hid_t fcpl = H5Fget_create_plist (fileId);
+
+    if (fcpl < 0)
+        return false;
+
+    H5F_fspace_strategy_t strategy;
+    hbool_t persist;
+    hsize_t threshold;
+
+    const bool paged = H5Pget_file_space_strategy (fcpl, &strategy, &persist, &threshold) >= 0
+                       && strategy == H5F_FSPACE_STRATEGY_PAGE
+                       && H5Pget_file_space_page_size (fcpl, &pageSize) >= 0;
+
+    H5Pclose (fcpl);
+
+    return paged;
+}
+
 NWBFileSource::NWBFileSource() : samplePos (0), skipRecordEngineCheck (false)
 {
 }
@@ -44,7 +72,32 @@ bool NWBFileSource::open (File file)
     uint16 vernum;
     try
     {
-        tmpFile = new H5File (file.getFullPathName().toUTF8(), H5F_ACC_RDONLY);
+        following = false;
+
+        try
+        {
+            tmpFile = new H5File (file.getFullPathName().toUTF8(), H5F_ACC_RDONLY);
+        }
+        catch (FileIException)
+        {
+            // a file that is being written in SWMR mode can only be opened by an SWMR reader
+            tmpFile = new H5File (file.getFullPathName().toUTF8(), H5F_ACC_RDONLY | H5F_ACC_SWMR_READ);
+            following = true;
+        }
+
+        sourcePath = file;
+
+        // the page buffer can only be set when opening, and opening a file without paged file space fails with it
+        hsize_t pageSize = 0;
+
+        if (! following && usesPagedFileSpace (tmpFile->getId(), pageSize))
+        {
+            FileAccPropList props;
+            H5Pset_page_buffer_size (props.getId(), size_t (pageSize * PAGE_BUFFER_PAGES), 0, 0);
+
+            tmpFile = nullptr;
+            tmpFile = new H5File (file.getFullPathName().toUTF8(), H5F_ACC_RDONLY, FileCreatPropList::DEFAULT, props);
+        }
 
         //TODO: Verify NWBVersion
 
@@ -76,7 +129,7 @@ void NWBFileSource::fillRecordInfo()
 
         int dataSources = (int) acquisition.getNumObjs();
 
-        std::map<String, int64> startSampleNumbers;
+        startSampleNumbers.clear();
 
         for (int i = 0; i < dataSources; i++)
         {
@@ -148,7 +201,9 @@ void NWBFileSource::fillRecordInfo()
                         HeapBlock<int> syncArray (dims[0]);
                         data.read (syncArray.getData(), PredType::NATIVE_INT);
 
-                        startSampleNumbers[dataSourceName] = syncArray[0];
+                        // a file being written may not have any samples yet
+                        if (dims[0] > 0)
+                            startSampleNumbers[dataSourceName] = syncArray[0];
 
                         HeapBlock<float> ccArray (dims[1]);
                         data = dataSource.openDataSet ("channel_conversion");
@@ -185,33 +240,13 @@ void NWBFileSource::fillRecordInfo()
                     else if (! type_str.compare ("TimeSeries"))
                     {
                         // Load TTL events
+                        String path = "/acquisition/" + String (dataSourceName);
                         dataSourceName.erase (dataSourceName.find_last_not_of (".TTL") + 1);
 
-                        EventInfo info;
-
-                        data = dataSource.openDataSet ("data");
-
-                        dSpace = data.getSpace();
-                        dSpace.getSimpleExtentDims (dims);
-
-                        int numEvents = dims[0];
-
-                        HeapBlock<int> stateArray (dims[0]);
-                        data.read (stateArray.getData(), PredType::NATIVE_INT);
-
-                        data = dataSource.openDataSet ("sync");
-
-                        HeapBlock<double> tsArray (dims[0]);
-                        data.read (tsArray.getData(), PredType::NATIVE_DOUBLE);
+                        EventInfo& events = eventInfoMap[dataSourceName];
+                        events = EventInfo();
 
-                        for (int k = 0; k < numEvents; k++)
-                        {
-                            info.channels.push_back (abs (stateArray[k]));
-                            info.channelStates.push_back (stateArray[k] > 0);
-                            info.sampleNumbers.push_back (tsArray[k] - startSampleNumbers[dataSourceName]);
-                        }
-
-                        eventInfoMap[dataSourceName] = info;
+                        finalEvents[dataSourceName] = readEvents (path, "/acquisition/" + String (dataSourceName), startSampleNumbers[dataSourceName], events, 0);
                     }
                 }
             }
@@ -231,6 +266,10 @@ void NWBFileSource::fillRecordInfo()
             {
                 std::cout << "!!!DataSpaceIException!!!" << std::endl;
             }
+            catch (FileIException)
+            {
+                std::cout << "!!!FileIException!!!" << std::endl;
+            }
         }
     }
     catch (FileIException error)
@@ -252,7 +291,19 @@ void NWBFileSource::updateActiveRecord (int index)
     try
     {
         String path = "/acquisition/" + dataPaths[index] + "/data";
-        dataSet = new DataSet (sourceFile->openDataSet (path.toUTF8()));
+
+        // data written to raw files is stored next to the NWB file
+        DSetAccPropList access;
+        H5Pset_efile_prefix (access.getId(), "${ORIGIN}");
+
+        dataSet = new DataSet (sourceFile->openDataSet (path.toUTF8(), access));
+
+        // the last chunk of a file being written is filled one channel at a time, so it is held back
+        if (following)
+        {
+            hsize_t chunk[2] = { 0, 0 };
+            followLag = dataSet->getCreatePlist().getChunk (2, chunk) > 0 ? (int64) chunk[0] : 0;
+        }
     }
     catch (FileIException error)
     {
@@ -264,11 +315,215 @@ void NWBFileSource::updateActiveRecord (int index)
     }
 
     currentStream = dataPaths[index];
+
+    if (following)
+        refreshActiveRecord();
+}
+
+int64 NWBFileSource::refreshActiveRecord()
+{
+    try
+    {
+        H5Drefresh (dataSet->getId());
+
+        hsize_t dims[2];
+        dataSet->getSpace().getSimpleExtentDims (dims);
+
+        const int64 numSamples = jmax<int64> (0, (int64) dims[0] - followLag);
+        RecordInfo& info = infoArray.getReference (activeRecord.get());
+
+        if (numSamples == info.numSamples)
+            return numSamples;
+
+        info.numSamples = numSamples;
+
+        // the first sample number is known once the stream has samples
+        if (startSampleNumbers.find (currentStream) == startSampleNumbers.end())
+        {
+            DataSet sync = sourceFile->openDataSet (("/acquisition/" + currentStream + "/sync").toUTF8());
+            DataSpace fSpace = sync.getSpace();
+            hsize_t count = 1;
+            hsize_t offset = 0;
+            int64 firstSample;
+
+            fSpace.selectHyperslab (H5S_SELECT_SET, &count, &offset);
+            sync.read (&firstSample, PredType::NATIVE_INT64, DataSpace (1, &count), fSpace);
+
+            startSampleNumbers[currentStream] = firstSample;
+
+            // events read before were placed relative to an unknown first sample
+            finalEvents[currentStream] = 0;
+        }
+
+        /* Only the events past those already final are read: the others keep the sample numbers they were given.
+           Events whose row was not written yet are dropped and read again, now that it may have been */
+        EventInfo& events = eventInfoMap[currentStream];
+        const int64 firstEvent = jmin ((int64) events.sampleNumbers.size(), finalEvents[currentStream]);
+
+        events.channels.resize ((size_t) firstEvent);
+        events.channelStates.resize ((size_t) firstEvent);
+        events.sampleNumbers.resize ((size_t) firstEvent);
+
+        finalEvents[currentStream] = readEvents ("/acquisition/" + currentStream + ".TTL", "/acquisition/" + currentStream, startSampleNumbers[currentStream], events, firstEvent);
+
+        return numSamples;
+    }
+    catch (DataSetIException error)
+    {
+        PROCESS_ERROR;
+    }
+    catch (DataSpaceIException error)
+    {
+        PROCESS_ERROR;
+    }
+    catch (FileIException)
+    {
+        // streams without TTL events
+    }
+
+    return getActiveNumSamples();
+}
+
+int64 NWBFileSource::readEvents (const String& path, const String& streamPath, int64 startSampleNumber, EventInfo& info, int64 firstEvent)
+{
+    DataSet data = sourceFile->openDataSet ((path + "/data").toUTF8());
+    DataSet sync = sourceFile->openDataSet ((path + "/sync").toUTF8());
+
+    DataSpace dataSpace = data.getSpace();
+    DataSpace syncSpace = sync.getSpace();
+
+    hsize_t dataDims[1], syncDims[1];
+    dataSpace.getSimpleExtentDims (dataDims);
+    syncSpace.getSimpleExtentDims (syncDims);
+
+    // in a file being written, one dataset may already hold the next event
+    const int64 numEvents = (int64) jmin (dataDims[0], syncDims[0]);
+
+    if (numEvents <= firstEvent)
+        return numEvents;
+
+    hsize_t count = (hsize_t) (numEvents - firstEvent);
+    hsize_t offset = (hsize_t) firstEvent;
+    DataSpace mSpace (1, &count);
+
+    dataSpace.selectHyperslab (H5S_SELECT_SET, &count, &offset);
+    syncSpace.selectHyperslab (H5S_SELECT_SET, &count, &offset);
+
+    HeapBlock<int> stateArray (count);
+    data.read (stateArray.getData(), PredType::NATIVE_INT, mSpace, dataSpace);
+
+    HeapBlock<double> tsArray (count);
+    sync.read (tsArray.getData(), PredType::NATIVE_DOUBLE, mSpace, syncSpace);
+
+    // the rows of the continuous data the events are aligned to, where the record engine wrote them
+    Array<int64> rows;
+    const bool aligned = readContinuousRows (path, streamPath, rows, firstEvent);
+
+    for (int k = 0; k < (int) count; k++)
+    {
+        info.channels.push_back (abs (stateArray[k]));
+        info.channelStates.push_back (stateArray[k] > 0);
+
+        // rows are -1 for events outside of the continuous data, or not aligned yet in a file being written
+        if (k < rows.size() && rows[k] >= 0)
+            info.sampleNumbers.push_back (rows[k]);
+        else
+            info.sampleNumbers.push_back (tsArray[k] - startSampleNumber);
+    }
+
+    // rows are appended once final, so events past the last row written are placed again by the next read
+    return aligned ? firstEvent + jmin ((int64) count, (int64) rows.size()) : numEvents;
+}
+
+bool NWBFileSource::readContinuousRows (const String& eventPath, const String& streamPath, Array<int64>& rows, int64 firstRow)
+{
+    rows.clear();
+
+    if (! sourceFile->nameExists ((eventPath + "/continuous_row").toUTF8()))
+        return false;
+
+    try
+    {
+        DataSet data = sourceFile->openDataSet ((eventPath + "/continuous_row").toUTF8());
+
+        // the "series" attribute is an object reference to the ElectricalSeries the rows belong to
+        hobj_ref_t reference;
+        data.openAttribute ("series").read (PredType::STD_REF_OBJ, &reference);
+
+        Group series (*sourceFile, &reference);
+
+        char name[1024];
+        H5Iget_name (series.getId(), name, sizeof (name));
+
+        if (streamPath != name)
+            return false;
+
+        DataSpace fSpace = data.getSpace();
+
+        hsize_t dims[1];
+        fSpace.getSimpleExtentDims (dims);
+
+        if ((int64) dims[0] > firstRow)
+        {
+            hsize_t count = dims[0] - (hsize_t) firstRow;
+            hsize_t offset = (hsize_t) firstRow;
+
+            rows.resize ((int) count);
+            fSpace.selectHyperslab (H5S_SELECT_SET, &count, &offset);
+            data.read (rows.getRawDataPointer(), PredType::NATIVE_INT64, DataSpace (1, &count), fSpace);
+        }
+
+        return true;
+    }
+    catch (DataSetIException error)
+    {
+        PROCESS_ERROR;
+    }
+    catch (DataSpaceIException error)
+    {
+        PROCESS_ERROR;
+    }
+    catch (AttributeIException error)
+    {
+        PROCESS_ERROR;
+    }
+    catch (ReferenceException error)
+    {
+        PROCESS_ERROR;
+    }
+
+    rows.clear();
+    return false;
+}
+
+bool NWBFileSource::isBeingWritten (const File& file)
+{
+    /* Superblocks of version 2 and later hold file consistency flags after the signature, version and sizes of
+       offsets and lengths, which the writer sets while it has the file open and clears when it closes it */
+    FileInputStream input (file);
+    uint8 superblock[12];
+
+    if (input.failedToOpen() || input.read (superblock, sizeof (superblock)) != (int) sizeof (superblock))
+        return false;
+
+    return memcmp (superblock, "\x89HDF\r\n\x1a\n", 8) == 0 && superblock[8] >= 2 && superblock[11] != 0;
+}
+
+void NWBFileSource::stopFollowing()
+{
+    // the whole dataset is written, so the last chunk is no longer held back
+    followLag = 0;
+    refreshActiveRecord();
+    following = false;
 }
 
 void NWBFileSource::seekTo (int64 sample)
 {
-    samplePos = sample % getActiveNumSamples();
+    // a file being written does not loop
+    if (following)
+        samplePos = jmin (sample, getActiveNumSamples());
+    else
+        samplePos = sample % getActiveNumSamples();
 }
 
 int NWBFileSource::readData (float* buffer, int nSamples)
@@ -276,6 +531,21 @@ int NWBFileSource::readData (float* buffer, int nSamples)
     int64 samplesToRead;
     int nChannels = getActiveNumChannels();
 
+    if (following && refreshActiveRecord() <= samplePos && ! isBeingWritten (sourcePath))
+        stopFollowing();
+
+    if (following)
+    {
+        // wait until the writer has appended samples past the current position, then return what is available
+        const uint32 deadline = Time::getMillisecondCounter() + FOLLOW_WAIT_MS;
+
+        while (refreshActiveRecord() <= samplePos && Time::getMillisecondCounter() < deadline)
+            Thread::sleep (FOLLOW_POLL_MS);
+
+        if (samplePos >= getActiveNumSamples())
+            return 0;
+    }
+
     if (samplePos + nSamples > getActiveNumSamples())
     {
         samplesToRead = getActiveNumSamples() - samplePos;
@@ -75,9 +75,41 @@ public:
     bool isReady() override;
 
 private:
+    /** Appends the TTL events of the series at path from firstEvent on to info, with sample numbers relative to the first sample of the stream
+        at streamPath (whose first sample number is startSampleNumber). Returns the number of events whose sample numbers are final. */
+    int64 readEvents (const String& path, const String& streamPath, int64 startSampleNumber, EventInfo& info, int64 firstEvent);
+
+    /** Reads the rows from firstRow on of the stream at streamPath the events of the series at eventPath are aligned to.
+        Returns false, leaving rows empty, if they are aligned to another stream or were not written. */
+    bool readContinuousRows (const String& eventPath, const String& streamPath, Array<int64>& rows, int64 firstRow);
+
+    /** In follow mode, updates the number of samples of the active record and its events, and returns it */
+    int64 refreshActiveRecord();
+
+    /** Returns true while a writer has the file open (only files of the latest format, which following requires, record it) */
+    static bool isBeingWritten (const File& file);
+
+    /** Leaves follow mode once the writer has closed the file, making all of its samples available */
+    void stopFollowing();
+
     ScopedPointer<H5::H5File> sourceFile;
     ScopedPointer<H5::DataSet> dataSet;
 
+    /** True if the file is being written, and is read as it grows */
+    bool following = false;
+
+    /** The file being read */
+    File sourcePath;
+
+    /** Rows at the end of the active dataset that may not be written for all channels yet */
+    int64 followLag = 0;
+
+    /** First sample number of each continuous stream */
+    std::map<String, int64> startSampleNumbers;
+
+    /** Number of events of each stream read with their final sample numbers, which are not read again in follow mode */
+    std::map<String, int64> finalEvents;
+
     Array<String> dataPaths;
 
     int64 samplePos;
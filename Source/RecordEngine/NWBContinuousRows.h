@@ -0,0 +1,118 @@
+/*
+    ------------------------------------------------------------------
+
+    This file is part of the Open Ephys GUI
+    Copyright (C) 2024 Open Ephys
+
+    ------------------------------------------------------------------
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef NWBCONTINUOUSROWS_H
+#define NWBCONTINUOUSROWS_H
+
+#include <cmath>
+#include <cstdint>
+
+namespace NWBRecording
+{
+
+/**
+        Maps the sample numbers (and synchronized timestamps) of a continuous
+        series to the rows it has written, to align events with its data (the
+        continuous_row of event series, and the rows of trials).
+
+        Rows are mapped within the current run of contiguous sample numbers: a
+        jump in sample numbers (e.g. a new recording within the same file)
+        starts a new run, and events before it have no row.
+
+        Header-only, so that it can be tested without the plugin.
+     */
+class ContinuousRowMap
+{
+public:
+    /** Adds a block of rows with consecutive sample numbers, whose first row has the given timestamp */
+    void addRows (int64_t firstSampleNumber, int64_t numRows, double firstTimestamp)
+    {
+        if (numRows <= 0)
+            return;
+
+        if (firstSampleNumber != nextSampleNumber)
+        {
+            runStartRow = totalRows;
+            runStartSample = firstSampleNumber;
+            runStartTime = firstTimestamp;
+        }
+
+        totalRows += numRows;
+        nextSampleNumber = firstSampleNumber + numRows;
+    }
+
+    /** Returns the number of rows added */
+    int64_t getNumRows() const { return totalRows; }
+
+    /** Returns true if rows have been added up to sampleNumber, so that the row of an event at sampleNumber is known */
+    bool covers (int64_t sampleNumber) const
+    {
+        return nextSampleNumber >= 0 && sampleNumber < nextSampleNumber;
+    }
+
+    /** Returns the row of sampleNumber in the current run, or -1 if it was not written: before the first sample of
+        the run, or after the last row added */
+    int64_t getRow (int64_t sampleNumber) const
+    {
+        if (nextSampleNumber < 0 || sampleNumber < runStartSample || sampleNumber >= nextSampleNumber)
+            return -1;
+
+        return runStartRow + (sampleNumber - runStartSample);
+    }
+
+    /** Returns the row sampleNumber has or will have in the current run, or -1 if it is before the run */
+    int64_t extrapolateRow (int64_t sampleNumber) const
+    {
+        if (nextSampleNumber < 0 || sampleNumber < runStartSample)
+            return -1;
+
+        return runStartRow + (sampleNumber - runStartSample);
+    }
+
+    /** Returns the row a synchronized timestamp has or will have in the current run, at sampleRate, or -1 if it
+        is before the run. Sample numbers are only comparable within a stream, timestamps across streams. */
+    int64_t extrapolateRow (double timestamp, double sampleRate) const
+    {
+        if (nextSampleNumber < 0)
+            return -1;
+
+        const int64_t offset = int64_t (std::round ((timestamp - runStartTime) * sampleRate));
+
+        return offset < 0 ? -1 : runStartRow + offset;
+    }
+
+private:
+    int64_t totalRows = 0;
+
+    /** Sample number expected for the next row (-1 before any row is added) */
+    int64_t nextSampleNumber = -1;
+
+    /** First row, sample number and timestamp of the current run of contiguous sample numbers */
+    int64_t runStartRow = 0;
+    int64_t runStartSample = 0;
+    double runStartTime = 0;
+};
+
+} // namespace NWBRecording
+
+#endif
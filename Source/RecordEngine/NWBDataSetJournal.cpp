@@ -0,0 +1,180 @@
+/*
+    ------------------------------------------------------------------
+
+    This file is part of the Open Ephys GUI
+    Copyright (C) 2024 Open Ephys
+
+    ------------------------------------------------------------------
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include "NWBDataSetJournal.h"
+
+using namespace NWBRecording;
+
+/** Converts a data type to the element type of journal records */
+static JournalRecord::ElementType getJournalType (const HDF5FileBase::BaseDataType& type)
+{
+    switch (type.type)
+    {
+        case HDF5FileBase::BaseDataType::T_U8: return JournalRecord::U8;
+        case HDF5FileBase::BaseDataType::T_U16: return JournalRecord::U16;
+        case HDF5FileBase::BaseDataType::T_U32: return JournalRecord::U32;
+        case HDF5FileBase::BaseDataType::T_U64: return JournalRecord::U64;
+        case HDF5FileBase::BaseDataType::T_I8: return JournalRecord::I8;
+        case HDF5FileBase::BaseDataType::T_I16: return JournalRecord::I16;
+        case HDF5FileBase::BaseDataType::T_I32: return JournalRecord::I32;
+        case HDF5FileBase::BaseDataType::T_I64: return JournalRecord::I64;
+        case HDF5FileBase::BaseDataType::T_F32: return JournalRecord::F32;
+        case HDF5FileBase::BaseDataType::T_F64: return JournalRecord::F64;
+        default: return JournalRecord::STR;
+    }
+}
+
+bool DataSetJournal::open (const String& filePath)
+{
+    dataSets.clear();
+    targets.clear();
+
+    return writer.open (JournalWriter::journalPath (filePath.toStdString()));
+}
+
+bool DataSetJournal::isOpen() const
+{
+    return writer.isOpen();
+}
+
+HDF5RecordingData* DataSetJournal::declare (HDF5RecordingData* dataSet, const String& path, int rowElements)
+{
+    if (dataSet == nullptr || ! writer.isOpen())
+        return dataSet;
+
+    auto entry = dataSets.find (path);
+
+    if (entry == dataSets.end())
+    {
+        JournaledDataSet declared;
+        declared.id = (uint32) dataSets.size();
+        declared.rowElements = rowElements;
+
+        entry = dataSets.emplace (path, declared).first;
+
+        JournalRecord record;
+        record.kind = JournalRecord::DATASET;
+        record.dataSet = declared.id;
+        record.payloadSize = (uint32) path.getNumBytesAsUTF8();
+
+        writer.write (record, path.toRawUTF8());
+    }
+
+    // an object allocated at the address of a deleted one replaces its entry, see forget
+    targets[dataSet] = &entry->second;
+
+    return dataSet;
+}
+
+void DataSetJournal::transfer (const HDF5RecordingData* previous, HDF5RecordingData* dataSet)
+{
+    auto target = targets.find (previous);
+
+    if (target == targets.end())
+        return;
+
+    JournaledDataSet* journaled = target->second;
+    targets.erase (target);
+
+    if (dataSet != nullptr)
+        targets[dataSet] = journaled;
+}
+
+void DataSetJournal::forget (const HDF5RecordingData* dataSet)
+{
+    if (dataSet != nullptr)
+        targets.erase (dataSet);
+}
+
+int DataSetJournal::writeDataBlock (HDF5RecordingData* dataSet, int numRows, BaseDataType type, const void* data)
+{
+    auto target = targets.find (dataSet);
+
+    if (target != targets.end() && numRows > 0)
+    {
+        JournaledDataSet* journaled = target->second;
+
+        JournalRecord record;
+        record.kind = JournalRecord::ROWS;
+        record.dataSet = journaled->id;
+        record.firstRow = journaled->numRows;
+        record.numRows = (uint32) numRows;
+        record.elementType = getJournalType (type);
+        record.elementSize = (uint32) type.typeSize;
+        record.payloadSize = (uint32) (type.typeSize * numRows * journaled->rowElements);
+
+        writer.write (record, data);
+        journaled->numRows += numRows;
+    }
+
+    return dataSet->writeDataBlock (numRows, type, data);
+}
+
+int DataSetJournal::writeDataRow (HDF5RecordingData* dataSet, int column, int numRows, BaseDataType type, const void* data)
+{
+    auto target = targets.find (dataSet);
+
+    if (target != targets.end() && numRows > 0)
+    {
+        JournaledDataSet* journaled = target->second;
+
+        if ((int) journaled->columnRows.size() <= column)
+            journaled->columnRows.resize (column + 1, 0);
+
+        JournalRecord record;
+        record.kind = JournalRecord::ROWS;
+        record.dataSet = journaled->id;
+        record.column = column;
+        record.firstRow = journaled->columnRows[column];
+        record.numRows = (uint32) numRows;
+        record.elementType = getJournalType (type);
+        record.elementSize = (uint32) type.typeSize;
+        record.payloadSize = (uint32) (type.typeSize * numRows);
+
+        writer.write (record, data);
+        journaled->columnRows[column] += numRows;
+    }
+
+    return dataSet->writeDataRow (column, numRows, type, data);
+}
+
+bool DataSetJournal::flush()
+{
+    return writer.flush();
+}
+
+int DataSetJournal::duplicate()
+{
+    return writer.duplicate();
+}
+
+bool DataSetJournal::moveTo (const String& filePath)
+{
+    return writer.moveTo (JournalWriter::journalPath (filePath.toStdString()));
+}
+
+void DataSetJournal::close (bool remove)
+{
+    writer.close (remove);
+    targets.clear();
+}
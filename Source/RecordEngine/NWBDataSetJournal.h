@@ -0,0 +1,107 @@
+/*
+    ------------------------------------------------------------------
+
+    This file is part of the Open Ephys GUI
+    Copyright (C) 2024 Open Ephys
+
+    ------------------------------------------------------------------
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef NWBDATASETJOURNAL_H
+#define NWBDATASETJOURNAL_H
+
+#include <HDF5FileFormat.h>
+
+#include "NWBJournal.h"
+
+#include <map>
+#include <vector>
+
+using namespace OpenEphysHDF5;
+
+namespace NWBRecording
+{
+
+/**
+        Journals the rows written to the datasets of an NWB file (see JournalWriter),
+        so that nwb-recover can replay them into the base image of the file.
+
+        Each dataset is declared once with its path, which the journal records, and
+        then written through writeDataBlock or writeDataRow. Rows written to datasets
+        that were not declared are only written to the file.
+     */
+class DataSetJournal
+{
+public:
+    typedef HDF5FileBase::BaseDataType BaseDataType;
+
+    /** Creates the journal of the file at filePath, replacing any existing one */
+    bool open (const String& filePath);
+
+    /** Returns true if the journal is open */
+    bool isOpen() const;
+
+    /** Records the path of a dataset written during recording, and returns the dataset. A dataset declared
+        again (e.g. in a later recording, or through another handle) goes on with the rows it had. */
+    HDF5RecordingData* declare (HDF5RecordingData* dataSet, const String& path, int rowElements);
+
+    /** Journals the rows of a new handle to a dataset under the path of the handle it replaces, which has been
+        deleted (it may have been allocated at the same address) */
+    void transfer (const HDF5RecordingData* previous, HDF5RecordingData* dataSet);
+
+    /** Drops the entry of a dataset about to be deleted, so that a dataset allocated at the same address
+        later on is not journaled under its path */
+    void forget (const HDF5RecordingData* dataSet);
+
+    /** Appends rows to a dataset, journaling them first */
+    int writeDataBlock (HDF5RecordingData* dataSet, int numRows, BaseDataType type, const void* data);
+
+    /** Appends values to a column (channel) of a dataset, journaling them first */
+    int writeDataRow (HDF5RecordingData* dataSet, int column, int numRows, BaseDataType type, const void* data);
+
+    /** Hands the journaled data over to the operating system */
+    bool flush();
+
+    /** See JournalWriter::duplicate */
+    int duplicate();
+
+    /** Renames the journal after its file was renamed to filePath */
+    bool moveTo (const String& filePath);
+
+    /** Closes the journal, and deletes it if it is no longer needed */
+    void close (bool remove);
+
+private:
+    /** Journaled dataset, with the rows written so far to it and to each of its columns */
+    struct JournaledDataSet
+    {
+        uint32 id;
+        int rowElements;
+        int64 numRows = 0;
+        std::vector<int64> columnRows;
+    };
+
+    JournalWriter writer;
+
+    /** Journaled datasets by path, and the path of each dataset object */
+    std::map<String, JournaledDataSet> dataSets;
+    std::map<const HDF5RecordingData*, JournaledDataSet*> targets;
+};
+
+} // namespace NWBRecording
+
+#endif
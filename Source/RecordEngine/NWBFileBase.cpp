@@ -0,0 +1,380 @@
+/*
+    ------------------------------------------------------------------
+
+    This file is part of the Open Ephys GUI
+    Copyright (C) 2024 Open Ephys
+
+    ------------------------------------------------------------------
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include "NWBFileBase.h"
+
+#include <H5Cpp.h>
+
+#include <vector>
+
+using namespace NWBRecording;
+
+NWBFileBase::NWBFileBase()
+{
+}
+
+NWBFileBase::~NWBFileBase()
+{
+    NWBFileBase::close();
+}
+
+int NWBFileBase::open (hid_t fapl, hid_t fcpl)
+{
+    if (isOpen())
+        return -1;
+
+    const String name = getFileName();
+    const bool newFile = ! File (name).existsAsFile();
+
+    if (newFile)
+        fileId = H5Fcreate (name.toRawUTF8(), H5F_ACC_TRUNC, fcpl, fapl);
+    else
+        fileId = H5Fopen (name.toRawUTF8(), H5F_ACC_RDWR, fapl);
+
+    if (fileId < 0)
+    {
+        std::cerr << "Error opening " << name << std::endl;
+        return -1;
+    }
+
+    return newFile ? createFileStructure() : 0;
+}
+
+bool NWBFileBase::close()
+{
+    const bool ok = fileId < 0 || H5Fclose (fileId) >= 0;
+
+    fileId = -1;
+
+    return ok;
+}
+
+bool NWBFileBase::isOpen() const
+{
+    return fileId >= 0;
+}
+
+hid_t NWBFileBase::getFileId() const
+{
+    return fileId;
+}
+
+int NWBFileBase::setAttribute (BaseDataType type, const void* data, String path, String name)
+{
+    if (! isOpen())
+        return -1;
+
+    const hid_t object = H5Oopen (fileId, path.toRawUTF8(), H5P_DEFAULT);
+
+    if (object < 0)
+        return -1;
+
+    const hid_t fileType = H5Tcopy (HDF5FileBase::getH5Type (type).getId());
+    const hid_t memType = H5Tcopy (HDF5FileBase::getNativeType (type).getId());
+
+    hid_t attribute;
+
+    if (H5Aexists (object, name.toRawUTF8()) > 0)
+        attribute = H5Aopen (object, name.toRawUTF8(), H5P_DEFAULT);
+    else
+    {
+        const hid_t space = H5Screate (H5S_SCALAR);
+        attribute = H5Acreate2 (object, name.toRawUTF8(), fileType, space, H5P_DEFAULT, H5P_DEFAULT);
+        H5Sclose (space);
+    }
+
+    const herr_t status = attribute >= 0 ? H5Awrite (attribute, memType, data) : -1;
+
+    if (attribute >= 0)
+        H5Aclose (attribute);
+
+    H5Tclose (memType);
+    H5Tclose (fileType);
+    H5Oclose (object);
+
+    return status < 0 ? -1 : 0;
+}
+
+int NWBFileBase::setAttributeStr (const String& value, String path, String name)
+{
+    if (! isOpen())
+        return -1;
+
+    const hid_t object = H5Oopen (fileId, path.toRawUTF8(), H5P_DEFAULT);
+
+    if (object < 0)
+        return -1;
+
+    const int status = writeStringAttribute (object, value, name);
+
+    H5Oclose (object);
+
+    return status;
+}
+
+int NWBFileBase::writeStringAttribute (hid_t object, const String& value, const String& name)
+{
+    const hid_t type = H5Tcopy (H5T_C_S1);
+    H5Tset_size (type, jmax ((size_t) 1, strlen (value.toRawUTF8())));
+
+    // a string of a different length does not fit the type of the existing attribute
+    if (H5Aexists (object, name.toRawUTF8()) > 0)
+        H5Adelete (object, name.toRawUTF8());
+
+    const hid_t space = H5Screate (H5S_SCALAR);
+    const hid_t attribute = H5Acreate2 (object, name.toRawUTF8(), type, space, H5P_DEFAULT, H5P_DEFAULT);
+
+    const herr_t status = attribute >= 0 ? H5Awrite (attribute, type, value.toRawUTF8()) : -1;
+
+    if (attribute >= 0)
+        H5Aclose (attribute);
+
+    H5Sclose (space);
+    H5Tclose (type);
+
+    return status < 0 ? -1 : 0;
+}
+
+int NWBFileBase::setAttributeStrArray (const StringArray& values, String path, String name)
+{
+    if (! isOpen())
+        return -1;
+
+    const hid_t object = H5Oopen (fileId, path.toRawUTF8(), H5P_DEFAULT);
+
+    if (object < 0)
+        return -1;
+
+    size_t length = 1;
+
+    for (auto& value : values)
+        length = jmax (length, strlen (value.toRawUTF8()) + 1);
+
+    std::vector<char> buffer (length * values.size(), 0);
+
+    for (int i = 0; i < values.size(); i++)
+        memcpy (buffer.data() + i * length, values[i].toRawUTF8(), strlen (values[i].toRawUTF8()));
+
+    const hid_t type = H5Tcopy (H5T_C_S1);
+    H5Tset_size (type, length);
+
+    const hsize_t dims = (hsize_t) values.size();
+    const hid_t space = H5Screate_simple (1, &dims, nullptr);
+
+    if (H5Aexists (object, name.toRawUTF8()) > 0)
+        H5Adelete (object, name.toRawUTF8());
+
+    const hid_t attribute = H5Acreate2 (object, name.toRawUTF8(), type, space, H5P_DEFAULT, H5P_DEFAULT);
+
+    const herr_t status = attribute >= 0 ? H5Awrite (attribute, type, buffer.data()) : -1;
+
+    if (attribute >= 0)
+        H5Aclose (attribute);
+
+    H5Sclose (space);
+    H5Tclose (type);
+    H5Oclose (object);
+
+    return status < 0 ? -1 : 0;
+}
+
+int NWBFileBase::setAttributeRef (String referencePath, String attributePath, String attributeName)
+{
+    if (! isOpen())
+        return -1;
+
+    hobj_ref_t reference;
+
+    if (H5Rcreate (&reference, fileId, referencePath.toRawUTF8(), H5R_OBJECT, -1) < 0)
+        return -1;
+
+    const hid_t object = H5Oopen (fileId, attributePath.toRawUTF8(), H5P_DEFAULT);
+
+    if (object < 0)
+        return -1;
+
+    hid_t attribute;
+
+    if (H5Aexists (object, attributeName.toRawUTF8()) > 0)
+        attribute = H5Aopen (object, attributeName.toRawUTF8(), H5P_DEFAULT);
+    else
+    {
+        const hid_t space = H5Screate (H5S_SCALAR);
+        attribute = H5Acreate2 (object, attributeName.toRawUTF8(), H5T_STD_REF_OBJ, space, H5P_DEFAULT, H5P_DEFAULT);
+        H5Sclose (space);
+    }
+
+    const herr_t status = attribute >= 0 ? H5Awrite (attribute, H5T_STD_REF_OBJ, &reference) : -1;
+
+    if (attribute >= 0)
+        H5Aclose (attribute);
+
+    H5Oclose (object);
+
+    return status < 0 ? -1 : 0;
+}
+
+int NWBFileBase::createGroup (String path)
+{
+    if (! isOpen())
+        return -1;
+
+    const hid_t group = H5Gcreate2 (fileId, path.toRawUTF8(), H5P_DEFAULT, H5P_DEFAULT, H5P_DEFAULT);
+
+    if (group < 0)
+        return -1;
+
+    H5Gclose (group);
+
+    return 0;
+}
+
+int NWBFileBase::createReference (String path, String reference)
+{
+    if (! isOpen())
+        return -1;
+
+    return H5Lcreate_soft (reference.toRawUTF8(), fileId, path.toRawUTF8(), H5P_DEFAULT, H5P_DEFAULT) < 0 ? -1 : 0;
+}
+
+HDF5RecordingData* NWBFileBase::getDataSet (String path)
+{
+    if (! isOpen())
+        return nullptr;
+
+    const hid_t dataSet = H5Dopen2 (fileId, path.toRawUTF8(), H5P_DEFAULT);
+
+    if (dataSet < 0)
+    {
+        std::cerr << "Error opening dataset " << path << std::endl;
+        return nullptr;
+    }
+
+    return wrapDataSet (dataSet);
+}
+
+HDF5RecordingData* NWBFileBase::createDataSet (BaseDataType type, int sizeX, int chunkX, String path)
+{
+    const int size[1] = { sizeX };
+    const int chunking[1] = { chunkX };
+
+    return createChunkedDataSet (type, 1, size, chunking, path);
+}
+
+HDF5RecordingData* NWBFileBase::createDataSet (BaseDataType type, int sizeX, int sizeY, int chunkX, String path)
+{
+    const int size[2] = { sizeX, sizeY };
+    const int chunking[2] = { chunkX, 0 };
+
+    return createChunkedDataSet (type, 2, size, chunking, path);
+}
+
+HDF5RecordingData* NWBFileBase::createDataSet (BaseDataType type, int sizeX, int sizeY, int sizeZ, int chunkX, String path)
+{
+    const int size[3] = { sizeX, sizeY, sizeZ };
+    const int chunking[3] = { chunkX, 0, 0 };
+
+    return createChunkedDataSet (type, 3, size, chunking, path);
+}
+
+HDF5RecordingData* NWBFileBase::createDataSet (BaseDataType type, int sizeX, int sizeY, int sizeZ, int chunkX, int chunkY, String path)
+{
+    const int size[3] = { sizeX, sizeY, sizeZ };
+    const int chunking[3] = { chunkX, chunkY, 0 };
+
+    return createChunkedDataSet (type, 3, size, chunking, path);
+}
+
+HDF5RecordingData* NWBFileBase::createChunkedDataSet (BaseDataType type, int dimension, const int* size, const int* chunking, const String& path)
+{
+    if (! isOpen() || dimension < 1 || dimension > 3)
+        return nullptr;
+
+    hsize_t dims[3], maxDims[3], chunkDims[3];
+
+    for (int i = 0; i < dimension; i++)
+    {
+        dims[i] = (hsize_t) size[i];
+
+        if (chunking[i] > 0)
+        {
+            chunkDims[i] = (hsize_t) chunking[i];
+            maxDims[i] = H5S_UNLIMITED;
+        }
+        else
+        {
+            chunkDims[i] = (hsize_t) jmax (1, size[i]);
+            maxDims[i] = (hsize_t) size[i];
+        }
+    }
+
+    const hid_t space = H5Screate_simple (dimension, dims, maxDims);
+    const hid_t dcpl = H5Pcreate (H5P_DATASET_CREATE);
+    H5Pset_chunk (dcpl, dimension, chunkDims);
+
+    const hid_t fileType = H5Tcopy (HDF5FileBase::getH5Type (type).getId());
+    const hid_t dataSet = H5Dcreate2 (fileId, path.toRawUTF8(), fileType, space, H5P_DEFAULT, dcpl, H5P_DEFAULT);
+
+    H5Tclose (fileType);
+    H5Pclose (dcpl);
+    H5Sclose (space);
+
+    if (dataSet < 0)
+    {
+        std::cerr << "Error creating dataset " << path << std::endl;
+        return nullptr;
+    }
+
+    return wrapDataSet (dataSet);
+}
+
+void NWBFileBase::createStringDataSet (String path, String value)
+{
+    if (! isOpen())
+        return;
+
+    const hid_t type = H5Tcopy (H5T_C_S1);
+    H5Tset_size (type, jmax ((size_t) 1, strlen (value.toRawUTF8())));
+
+    const hid_t space = H5Screate (H5S_SCALAR);
+    const hid_t dataSet = H5Dcreate2 (fileId, path.toRawUTF8(), type, space, H5P_DEFAULT, H5P_DEFAULT, H5P_DEFAULT);
+
+    if (dataSet < 0 || H5Dwrite (dataSet, type, H5S_ALL, H5S_ALL, H5P_DEFAULT, value.toRawUTF8()) < 0)
+        std::cerr << "Error writing " << path << std::endl;
+
+    if (dataSet >= 0)
+        H5Dclose (dataSet);
+
+    H5Sclose (space);
+    H5Tclose (type);
+}
+
+HDF5RecordingData* NWBFileBase::wrapDataSet (hid_t dataSet)
+{
+    // the C++ object takes its own reference to the identifier
+    HDF5RecordingData* data = new HDF5RecordingData (new H5::DataSet (dataSet));
+
+    H5Dclose (dataSet);
+
+    return data;
+}
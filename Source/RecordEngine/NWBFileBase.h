@@ -0,0 +1,125 @@
+/*
+    ------------------------------------------------------------------
+
+    This file is part of the Open Ephys GUI
+    Copyright (C) 2024 Open Ephys
+
+    ------------------------------------------------------------------
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef NWBFILEBASE_H
+#define NWBFILEBASE_H
+
+#include <HDF5FileFormat.h>
+
+using namespace OpenEphysHDF5;
+
+namespace NWBRecording
+{
+
+/**
+        HDF5 file opened with its own file access and creation property lists.
+
+        HDF5FileBase only opens files with the process-wide default property lists
+        and keeps the identifier of the file private, so the same dataset, group and
+        attribute helpers are provided here on a file this class opens itself. The
+        datasets it creates are written through HDF5RecordingData, as before.
+     */
+class NWBFileBase
+{
+public:
+    typedef HDF5FileBase::BaseDataType BaseDataType;
+
+    /** Constructor */
+    NWBFileBase();
+
+    /** Destructor, closes the file if it is still open */
+    virtual ~NWBFileBase();
+
+    /** Opens the file with the given property lists, which stay owned by the caller. A file that does not exist
+        is created, and its structure written by createFileStructure; an existing one is opened as it is.
+        Returns 0 on success. */
+    int open (hid_t fapl, hid_t fcpl);
+
+    /** Closes the file. Objects still open keep it open until they are closed. Returns false if HDF5 could not
+        close it (e.g. failed to write its metadata). */
+    virtual bool close();
+
+    /** Returns true while the file is open */
+    bool isOpen() const;
+
+    /** Returns the HDF5 identifier of the file, or -1 if it is not open */
+    hid_t getFileId() const;
+
+    /** Returns the name of the file */
+    virtual String getFileName() = 0;
+
+protected:
+    /** Writes the structure of a file that has just been created */
+    virtual int createFileStructure() = 0;
+
+    /* The helpers that create objects and write attributes are virtual, so that a file can write
+       them differently (e.g. into an existing copy of the file) for every caller */
+
+    /** Writes a scalar numeric attribute */
+    virtual int setAttribute (BaseDataType type, const void* data, String path, String name);
+
+    /** Writes a fixed length string attribute, replacing an existing one */
+    virtual int setAttributeStr (const String& value, String path, String name);
+
+    /** Writes an attribute holding an array of fixed length strings */
+    virtual int setAttributeStrArray (const StringArray& values, String path, String name);
+
+    /** Writes an attribute holding an object reference to referencePath */
+    virtual int setAttributeRef (String referencePath, String attributePath, String attributeName);
+
+    /** Creates a group */
+    virtual int createGroup (String path);
+
+    /** Creates a soft link at path pointing to reference */
+    virtual int createReference (String path, String reference);
+
+    /** Opens an existing dataset */
+    HDF5RecordingData* getDataSet (String path);
+
+    /** Creates datasets that can be extended along the chunked dimensions */
+    virtual HDF5RecordingData* createDataSet (BaseDataType type, int sizeX, int chunkX, String path);
+    virtual HDF5RecordingData* createDataSet (BaseDataType type, int sizeX, int sizeY, int chunkX, String path);
+    virtual HDF5RecordingData* createDataSet (BaseDataType type, int sizeX, int sizeY, int sizeZ, int chunkX, String path);
+    virtual HDF5RecordingData* createDataSet (BaseDataType type, int sizeX, int sizeY, int sizeZ, int chunkX, int chunkY, String path);
+
+    /** Creates a scalar fixed length string dataset */
+    void createStringDataSet (String path, String value);
+
+    /** Writes a fixed length string attribute of an open object */
+    static int writeStringAttribute (hid_t object, const String& value, const String& name);
+
+private:
+    /** Creates a dataset of up to three dimensions, unlimited along those with a chunk size */
+    HDF5RecordingData* createChunkedDataSet (BaseDataType type, int dimension, const int* size, const int* chunking, const String& path);
+
+    /** Wraps an open dataset, whose identifier is released */
+    static HDF5RecordingData* wrapDataSet (hid_t dataSet);
+
+    hid_t fileId = -1;
+
+    JUCE_DECLARE_NON_COPYABLE (NWBFileBase);
+};
+
+} // namespace NWBRecording
+
+#endif
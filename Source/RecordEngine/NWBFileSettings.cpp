@@ -0,0 +1,129 @@
+/*
+    ------------------------------------------------------------------
+
+    This file is part of the Open Ephys GUI
+    Copyright (C) 2024 Open Ephys
+
+    ------------------------------------------------------------------
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include "NWBFileSettings.h"
+#include "NWBUringDriver.h"
+
+using namespace NWBRecording;
+
+int FileSettings::open (NWBFileBase* file, int nChans) const
+{
+    const String fileName = file->getFileName();
+
+    const hid_t fapl = H5Pcreate (H5P_FILE_ACCESS);
+    const hid_t fcpl = H5Pcreate (H5P_FILE_CREATE);
+
+    // raw data chunk cache large enough for a chunk of every channel, as HDF5FileBase sets it
+    if (nChans > 0)
+        H5Pset_cache (fapl, 0, 809, 8 * 2 * CHUNK_XSIZE * nChans, 1);
+
+    bool driverSet = false;
+
+    const bool customDriver = ioDriver == IO_URING || directIO || stripeDirectories.isNotEmpty();
+
+    // SWMR readers rely on writes reaching the file in order, which only the default driver guarantees
+    if (customDriver && swmr)
+        std::cout << "Reading while recording requires the default file driver, writing " << fileName << " with it" << std::endl;
+    else if (customDriver)
+    {
+        UringDriver::Options options;
+        options.useRing = ioDriver == IO_URING;
+        options.directIO = directIO;
+
+        if (stripeDirectories.isNotEmpty())
+        {
+            for (auto directory : StringArray::fromTokens (stripeDirectories, ";", ""))
+            {
+                if (directory.trim().isNotEmpty() && ! File (directory.trim()).createDirectory())
+                    std::cerr << "Could not create stripe directory " << directory << std::endl;
+            }
+
+            const std::string directories = stripeDirectories.toStdString();
+
+            if (directories.size() < sizeof (options.stripeDirs))
+            {
+                strcpy (options.stripeDirs, directories.c_str());
+                options.stripeSize = uint64 (jmax (1, stripeSizeMB)) << 20;
+            }
+            else
+                std::cerr << "Stripe directory list is too long, writing a single file" << std::endl;
+        }
+
+        driverSet = UringDriver::setDriver (fapl, options);
+
+        if (! driverSet)
+            std::cout << "Selected file driver is not available, writing " << fileName << " with the default driver" << std::endl;
+    }
+
+    /* Direct writes need block-aligned offsets: align every allocation of at least one block,
+       so whole chunks (CHUNK_XSIZE rows of 2-byte samples or 8-byte timestamps) start and end on block boundaries */
+    if (driverSet && directIO)
+        H5Pset_alignment (fapl, UringDriver::directAlignment, UringDriver::directAlignment);
+
+    const bool paged = formatProfile == LATEST_PAGED;
+
+    // SWMR needs the latest file format
+    const bool latestFormat = swmr || paged;
+
+    if (latestFormat)
+        H5Pset_libver_bounds (fapl, H5F_LIBVER_LATEST, H5F_LIBVER_LATEST);
+
+    /* Paged file space keeps metadata and small raw data in whole pages, so readers load the
+       structure of the file with a few page-sized reads (see H5Pset_page_buffer_size) */
+    if (paged)
+    {
+        const hsize_t pageSize = hsize_t (jlimit (4, 16384, pageSizeKB)) << 10;
+
+        H5Pset_file_space_strategy (fcpl, H5F_FSPACE_STRATEGY_PAGE, false, 1);
+        H5Pset_file_space_page_size (fcpl, pageSize);
+        H5Pset_meta_block_size (fapl, pageSize);
+    }
+
+    /* The adaptive cache resizes itself every epoch of cache accesses, evicting and writing entries as it
+       shrinks, which shows as write latency spikes on the recording thread. A fixed size cache only evicts
+       when full, and the entries it evicts are mostly clean if the file is flushed periodically */
+    if (metadataCacheMB > 0)
+    {
+        H5AC_cache_config_t cacheConfig;
+        cacheConfig.version = H5AC__CURR_CACHE_CONFIG_VERSION;
+        H5Pget_mdc_config (fapl, &cacheConfig);
+        const size_t cacheSize = size_t (jlimit (1, 1024, metadataCacheMB)) << 20;
+
+        cacheConfig.set_initial_size = true;
+        cacheConfig.initial_size = cacheSize;
+        cacheConfig.min_size = cacheSize;
+        cacheConfig.max_size = cacheSize;
+        cacheConfig.incr_mode = H5C_incr__off;
+        cacheConfig.flash_incr_mode = H5C_flash_incr__off;
+        cacheConfig.decr_mode = H5C_decr__off;
+
+        H5Pset_mdc_config (fapl, &cacheConfig);
+    }
+
+    const int ret = file->NWBFileBase::open (fapl, fcpl);
+
+    H5Pclose (fcpl);
+    H5Pclose (fapl);
+
+    return ret;
+}
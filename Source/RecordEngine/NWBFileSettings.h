@@ -0,0 +1,98 @@
+/*
+    ------------------------------------------------------------------
+
+    This file is part of the Open Ephys GUI
+    Copyright (C) 2024 Open Ephys
+
+    ------------------------------------------------------------------
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef NWBFILESETTINGS_H
+#define NWBFILESETTINGS_H
+
+#include "NWBFileBase.h"
+
+namespace NWBRecording
+{
+
+/**
+        File driver, file format and layout settings of the files of a recording
+        (the NWB file and its shards).
+
+        Each file is opened through property lists of its own, which carry these
+        settings: the default ones are shared by every file the process opens,
+        file sources included.
+     */
+class FileSettings
+{
+public:
+    /** HDF5 file drivers that can be used to write the file */
+    enum IODriver
+    {
+        SEC2,
+        IO_URING
+    };
+
+    /** HDF5 file format settings */
+    enum FormatProfile
+    {
+        /** Earliest format that can hold the file, readable by all HDF5 versions */
+        COMPATIBLE,
+
+        /** Latest format (extensible array chunk indexes for the growing datasets) with paged file space,
+            so metadata is grouped into pages that readers fetch whole. Requires HDF5 1.10 to read. */
+        LATEST_PAGED
+    };
+
+    /** File driver */
+    IODriver ioDriver = SEC2;
+
+    /** Writes block-aligned data with O_DIRECT, bypassing the page cache (Linux only) */
+    bool directIO = false;
+
+    /** Directories (separated by ';') that the file is striped across, in regions of stripeSizeMB (Linux only) */
+    String stripeDirectories;
+    int stripeSizeMB = 1;
+
+    /** Writes the file in single-writer/multiple-reader (SWMR) mode, which requires the default driver */
+    bool swmr = false;
+
+    /** File format, and the size of file space pages for LATEST_PAGED */
+    FormatProfile formatProfile = COMPATIBLE;
+    int pageSizeKB = 64;
+
+    /** Fixed size of the metadata cache (0 for HDF5's adaptive cache). Entries are then only evicted
+        when the cache is full, and never by a resize. */
+    int metadataCacheMB = 0;
+
+    /** Writes the data, timestamps and sync datasets of each stream into a separate shard file */
+    bool shardStreams = false;
+
+    /** Writes the continuous data of each stream to a flat .dat file of interleaved samples, declared as external storage of its dataset */
+    bool rawContinuousData = false;
+
+    /** Appends all data written during recording to a journal (<file>.journal), which nwb-recover replays
+        into the file after a crash. The journal is deleted when the file is closed successfully. */
+    bool journal = false;
+
+    /** Opens a file with these settings, sizing its chunk cache for nChans channels. Returns 0 on success. */
+    int open (NWBFileBase* file, int nChans) const;
+};
+
+} // namespace NWBRecording
+
+#endif
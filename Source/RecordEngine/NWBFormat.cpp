@@ -22,6 +22,13 @@
 */
 
 #include "NWBFormat.h"
+#include "NWBUringDriver.h"
+
+#include <H5Cpp.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <limits>
 
 using namespace NWBRecording;
 
@@ -37,17 +44,26 @@ using namespace NWBRecording;
 #define SPIKE_CHUNK_YSIZE 40
 #endif
 
+#ifndef SPIKE_INDEX_BLOCK_SIZE
+#define SPIKE_INDEX_BLOCK_SIZE 256
+#endif
+
 #define MAX_BUFFER_SIZE 40960
 
-NWBFile::NWBFile (String fName, String ver, String idText) : HDF5FileBase(),
+// largest dataset stored in its object header (HDF5 allows up to 64 KB)
+#define COMPACT_DATASET_SIZE 16384
+
+// checkpoints longer than this are reported as they happen, the others only in the summary written on close
+#define SLOW_CHECKPOINT_SECONDS 0.1
+
+NWBFile::NWBFile (String fName, String ver, String idText) : NWBFileBase(),
                                                              filename (fName),
                                                              identifierText (idText),
                                                              GUIVersion (ver)
 {
-    readyToOpen = true; //In KWIK this is in initFile, but the new recordEngine methods make it safe for it to be here
-
     scaledBuffer.malloc (MAX_BUFFER_SIZE);
     intBuffer.malloc (MAX_BUFFER_SIZE);
+    featureBuffer.malloc (MAX_BUFFER_SIZE);
     bufferSize = MAX_BUFFER_SIZE;
 }
 
@@ -59,8 +75,40 @@ NWBFile::~NWBFile()
     syncMsgDataSet.reset();
 }
 
+void NWBFile::setFileSettings (const FileSettings& settings_)
+{
+    settings = settings_;
+}
+
+void NWBFile::setLiveTaps (const Array<LiveTap*>& taps)
+{
+    liveTaps = taps;
+}
+
+void NWBFile::setTemplate (const String& path)
+{
+    templatePath = path;
+}
+
+int NWBFile::open (int nChans)
+{
+    numOpenChannels = nChans;
+
+    // an existing file is opened as it is, so the copy of the template is only made for a new one
+    attaching = templatePath.isNotEmpty() && ! File (filename).exists() && File (templatePath).copyFileTo (File (filename));
+
+    const int ret = settings.open (this, nChans);
+
+    if (ret == 0 && attaching && ! restampTemplate())
+        std::cerr << "Error updating the identifiers of " << filename << std::endl;
+
+    return ret;
+}
+
 int NWBFile::createFileStructure()
 {
+    AttributeTargetCache cache (*this);
+
     setAttributeStr ("core", "/", "namespace");
     setAttributeStr ("NWBFile", "/", "neurodata_type");
     setAttributeStr ("2.5.0", "/", "nwb_version");
@@ -72,7 +120,7 @@ int NWBFile::createFileStructure()
     if (createGroup ("/analysis"))
         return -1;
 
-    String time = Time::getCurrentTime().formatted ("%Y-%m-%dT%H:%M:%S") + Time::getCurrentTime().getUTCOffsetString (true);
+    String time = getTimeString();
 
     createTextDataSet ("", "file_create_date", time);
 
@@ -141,6 +189,31 @@ AnnotationSeries::AnnotationSeries (String rootPath, String name, String descrip
 {
 }
 
+TimeIntervals::TimeIntervals (String path, String description_, int eventSeries_, int ttlLine_)
+    : eventSeries (eventSeries_), ttlLine (ttlLine_), basePath (path), description (description_)
+{
+}
+
+Units::Units (String path, String description_)
+    : basePath (path), description (description_)
+{
+}
+
+void Units::addSpikeChannel (int spikeChannel, const Array<int>& electrodeInds)
+{
+    electrodes.set (spikeChannel, electrodeInds);
+}
+
+void Units::closeDataSets()
+{
+    idDataSet = nullptr;
+    sortedIdDataSet = nullptr;
+    electrodesDataSet = nullptr;
+    electrodesIndexDataSet = nullptr;
+    arrivalTimesDataSet = nullptr;
+    arrivalUnitsDataSet = nullptr;
+}
+
 bool NWBFile::startNewRecording (
     int recordingNumber,
     const Array<ContinuousGroup>& continuousArray,
@@ -148,9 +221,27 @@ bool NWBFile::startNewRecording (
     const Array<const EventChannel*>& eventArray,
     const Array<const SpikeChannel*>& electrodeArray)
 {
+    AttributeTargetCache cache (*this);
+
+    // the journal covers the whole file, as later recordings append to the messages of the first one
+    if (settings.journal && recordingNumber == 0 && ! journal.isOpen())
+    {
+        if (! journal.open (filename))
+            std::cerr << "Could not create the journal of " << filename << std::endl;
+    }
+
     // all recorded data is stored in the "acquisition" group
     String rootPath = "/acquisition/";
 
+    for (auto series : continuousDataSets)
+        forgetDataSets (series);
+
+    for (auto series : spikeDataSets)
+        forgetDataSets (series);
+
+    for (auto series : eventDataSets)
+        forgetDataSets (series);
+
     continuousDataSets.clearQuick (true);
     spikeDataSets.clearQuick (true);
     eventDataSets.clearQuick (true);
@@ -158,6 +249,7 @@ bool NWBFile::startNewRecording (
     Array<int> all_electrode_inds;
     StringArray groupNames;
     StringArray groupReferences;
+    Array<uint16> continuousStreamIds;
 
     // 0. put global inds into electrode table
     for (auto ch : continuousChannels)
@@ -227,17 +319,42 @@ bool NWBFile::startNewRecording (
                                            channel_conversion,
                                            channel_type);
 
+        electricalSeries->sampleRate = group[0]->getSampleRate();
+
         if (recordingNumber == 0)
             if (! createTimeSeriesBase (electricalSeries))
                 return false;
 
-        electricalSeries->baseDataSet = createDataSet (BaseDataType::I16,
-                                                       0,
-                                                       electricalSeries->channel_count,
-                                                       CHUNK_XSIZE,
-                                                       electricalSeries->basePath + "/data");
+        NWBShardFile* shard = nullptr;
+
+        if (settings.shardStreams)
+        {
+            shard = shards.add (new NWBShardFile (NWBShardFile::getShardPath (filename, groupName)));
+
+            if (settings.open (shard, group.size() + 2) != 0)
+            {
+                std::cerr << "Error creating shard " << shard->getFileName() << std::endl;
+                return false;
+            }
+        }
+
+        const String dataPath = electricalSeries->basePath + "/data";
+
+        if (settings.rawContinuousData)
+        {
+            // samples are written to the raw file directly, so the dataset has no handle
+            if (! createRawDataSet (electricalSeries, groupName, dataPath))
+            {
+                std::cerr << "Error creating raw data file for " << groupName << std::endl;
+                return false;
+            }
+        }
+        else if (shard != nullptr)
+            electricalSeries->baseDataSet = createLinkedDataSet (shard, BaseDataType::I16, electricalSeries->channel_count, CHUNK_XSIZE, dataPath);
+        else
+            electricalSeries->baseDataSet = createDataSet (BaseDataType::I16, 0, electricalSeries->channel_count, CHUNK_XSIZE, dataPath);
 
-        if (electricalSeries->baseDataSet == nullptr)
+        if (electricalSeries->baseDataSet == nullptr && electricalSeries->rawFile == nullptr)
         {
             std::cerr << "Error creating dataset for " << groupName << std::endl;
             return false;
@@ -248,37 +365,32 @@ bool NWBFile::startNewRecording (
         }
 
         electricalSeries->timestampDataSet =
-            createTimestampDataSet (electricalSeries->basePath + "/timestamps", CHUNK_XSIZE, 1 / group[0]->getSampleRate());
+            createTimestampDataSet (electricalSeries->basePath + "/timestamps", CHUNK_XSIZE, 1 / group[0]->getSampleRate(), shard);
         if (electricalSeries->timestampDataSet == nullptr)
             return false;
 
         electricalSeries->sampleNumberDataSet =
-            createSampleNumberDataSet (electricalSeries->basePath + "/sync", CHUNK_XSIZE);
+            createSampleNumberDataSet (electricalSeries->basePath + "/sync", CHUNK_XSIZE, shard);
         if (electricalSeries->sampleNumberDataSet == nullptr)
             return false;
 
-        electricalSeries->channelConversionDataSet = createChannelConversionDataSet (electricalSeries->basePath + "/channel_conversion", "Bit volts values for all channels", CHUNK_XSIZE);
-
-        if (electricalSeries->channelConversionDataSet == nullptr)
+        if (! createChannelConversionDataSet (electricalSeries->basePath + "/channel_conversion", "Bit volts values for all channels", electricalSeries->channel_conversion))
             return false;
-        writeChannelConversions (electricalSeries);
 
-        electricalSeries->channelTypesDataSet = createChannelTypesDataSet (electricalSeries->basePath + "/channel_type", "Channel types for all channels", CHUNK_XSIZE);
-
-        if (electricalSeries->channelTypesDataSet == nullptr)
+        if (! createChannelTypesDataSet (electricalSeries->basePath + "/channel_type", "Channel types for all channels", electricalSeries->channel_type))
             return false;
-        writeChannelTypes (electricalSeries);
-
-        electricalSeries->electrodeDataSet = createElectrodeDataSet (electricalSeries->basePath + "/electrodes", "Electrode index for each channel", CHUNK_XSIZE);
 
-        if (electricalSeries->electrodeDataSet == nullptr)
+        if (! createElectrodeDataSet (electricalSeries->basePath + "/electrodes", "Electrode index for each channel", electrode_inds))
             return false;
-        writeElectrodes (electricalSeries, electrode_inds);
 
         continuousDataSets.add (electricalSeries);
+        continuousStreamIds.add (group[0]->getStreamId());
     }
 
     // 2. create spike datasets
+    forgetDataSets (units.get());
+    units.reset (new Units ("/units", "Units detected by the Open Ephys GUI, keyed by spike channel and sorted ID"));
+
     for (int i = 0; i < electrodeArray.size(); i++)
     {
         const SpikeChannel* sourceInfo = electrodeArray[i];
@@ -303,6 +415,8 @@ bool NWBFile::startNewRecording (
             electrode_inds.add (globalIndex);
         }
 
+        units->addSpikeChannel (i, electrode_inds);
+
         ecephys::SpikeEventSeries* spikeEventSeries =
             new ecephys::SpikeEventSeries (rootPath, sourceName, "Stores spike waveforms from an extracellular ephys recording", sourceInfo->getNumChannels(), channel_conversion);
 
@@ -332,21 +446,29 @@ bool NWBFile::startNewRecording (
         if (spikeEventSeries->sampleNumberDataSet == nullptr)
             return false;
 
-        spikeEventSeries->channelConversionDataSet = createChannelConversionDataSet (spikeEventSeries->basePath + "/channel_conversion", "Bit volts values for all channels", CHUNK_XSIZE);
+        if (! createChannelConversionDataSet (spikeEventSeries->basePath + "/channel_conversion", "Bit volts values for all channels", spikeEventSeries->channel_conversion))
+            return false;
 
-        if (spikeEventSeries->channelConversionDataSet == nullptr)
+        if (! createElectrodeDataSet (spikeEventSeries->basePath + "/electrodes", "Electrode index for each channel", electrode_inds))
             return false;
-        writeChannelConversions (spikeEventSeries);
 
-        spikeEventSeries->electrodeDataSet = createElectrodeDataSet (spikeEventSeries->basePath + "/electrodes", "Electrode index for each channel", CHUNK_XSIZE);
+        if (! createSpikeIndex (spikeEventSeries))
+            return false;
 
-        if (spikeEventSeries->electrodeDataSet == nullptr)
+        if (! createSpikeFeatures (spikeEventSeries))
             return false;
-        writeElectrodes (spikeEventSeries, electrode_inds);
 
         spikeDataSets.add (spikeEventSeries);
     }
 
+    if (electrodeArray.size() == 0)
+    {
+        forgetDataSets (units.get());
+        units.reset();
+    }
+    else if (! createUnitsTable())
+        return false;
+
     // 3. Create event channel datasets
     for (int i = 0; i < eventArray.size(); i++)
     {
@@ -387,6 +509,9 @@ bool NWBFile::startNewRecording (
             if (ttlEventSeries->ttlWordDataSet == nullptr)
                 return false;
 
+            if (! createContinuousRowDataSet (ttlEventSeries, continuousStreamIds.indexOf (info->getStreamId())))
+                return false;
+
             eventDataSets.add (ttlEventSeries);
         }
         else if (info->getType() == EventChannel::TEXT)
@@ -413,6 +538,10 @@ bool NWBFile::startNewRecording (
             if (annotationSeries->sampleNumberDataSet == nullptr)
                 return false;
 
+            if (! createContinuousRowDataSet (annotationSeries, continuousStreamIds.indexOf (info->getStreamId())))
+                return false;
+
+            forgetDataSets (messagesDataSet.get());
             messagesDataSet.reset (annotationSeries);
         }
     }
@@ -437,7 +566,7 @@ bool NWBFile::startNewRecording (
     }
     else
     {
-        annotationSeries->baseDataSet = getDataSet (annotationSeries->basePath + "/data");
+        annotationSeries->baseDataSet = journal.declare (getDataSet (annotationSeries->basePath + "/data"), annotationSeries->basePath + "/data", 1);
     }
 
     if (recordingNumber == 0)
@@ -448,7 +577,7 @@ bool NWBFile::startNewRecording (
     }
     else
     {
-        annotationSeries->sampleNumberDataSet = getDataSet (annotationSeries->basePath + "/sync");
+        annotationSeries->sampleNumberDataSet = journal.declare (getDataSet (annotationSeries->basePath + "/sync"), annotationSeries->basePath + "/sync", 1);
     }
 
     if (recordingNumber == 0)
@@ -459,55 +588,101 @@ bool NWBFile::startNewRecording (
     }
     else
     {
-        annotationSeries->timestampDataSet = getDataSet (annotationSeries->basePath + "/timestamps");
+        annotationSeries->timestampDataSet = journal.declare (getDataSet (annotationSeries->basePath + "/timestamps"), annotationSeries->basePath + "/timestamps", 1);
     }
 
+    forgetDataSets (syncMsgDataSet.get());
     syncMsgDataSet.reset (annotationSeries);
 
-    // 5. Create electrode table
-    ScopedPointer<HDF5RecordingData> elSet = createDataSet (BaseDataType::I32, 1, 1, "general/extracellular_ephys/electrodes/id");
-
-    std::vector<int> electrodeNumbers;
-    for (auto i : all_electrode_inds)
-        electrodeNumbers.push_back (i);
+    if (! createTrialsTable (eventArray))
+        return false;
 
-    CHECK_ERROR (elSet->writeDataBlock (electrodeNumbers.size(), BaseDataType::I32, &electrodeNumbers[0]));
+    // 5. Create electrode table
+    if (! writeColumn ("general/extracellular_ephys/electrodes/id", H5T_NATIVE_INT32, all_electrode_inds.size(), all_electrode_inds.getRawDataPointer()))
+        return false;
 
     setAttributeStr ("hdmf-common", "general/extracellular_ephys/electrodes/id", "namespace");
     setAttributeStr ("ElementIdentifiers", "general/extracellular_ephys/electrodes/id", "neurodata_type");
     setAttributeStr (generateUuid(), "general/extracellular_ephys/electrodes/id", "object_id");
 
-    ScopedPointer<HDF5RecordingData> groupNamesDataset = createDataSet (BaseDataType::STR (250), 0, 1, "general/extracellular_ephys/electrodes/group_name");
-
-    for (int i = 0; i < groupNames.size(); i++)
-        groupNamesDataset->writeDataBlock (1, BaseDataType::STR (groupNames[i].length()), groupNames[i].toUTF8());
+    // each column is written with a single call, which matters with thousands of channels
+    if (! createStringColumn ("general/extracellular_ephys/electrodes/group_name", groupNames))
+        return false;
 
     setAttributeStr ("the name of the ElectrodeGroup this electrode is a part of", "general/extracellular_ephys/electrodes/group_name", "description");
     setAttributeStr ("hdmf-common", "general/extracellular_ephys/electrodes/group_name", "namespace");
     setAttributeStr ("VectorData", "general/extracellular_ephys/electrodes/group_name", "neurodata_type");
     setAttributeStr (generateUuid(), "general/extracellular_ephys/electrodes/group_name", "object_id");
 
-    ScopedPointer<HDF5RecordingData> locationsDataset = createDataSet (BaseDataType::STR (250), 0, 1, "general/extracellular_ephys/electrodes/location");
+    StringArray locations;
 
     for (int i = 0; i < groupNames.size(); i++)
-        locationsDataset->writeDataBlock (1, BaseDataType::STR (7), String ("unknown").toUTF8());
+        locations.add ("unknown");
+
+    if (! createStringColumn ("general/extracellular_ephys/electrodes/location", locations))
+        return false;
 
     setAttributeStr ("the location of channel within the subject e.g. brain region", "general/extracellular_ephys/electrodes/location", "description");
     setAttributeStr ("hdmf-common", "general/extracellular_ephys/electrodes/location", "namespace");
     setAttributeStr ("VectorData", "general/extracellular_ephys/electrodes/location", "neurodata_type");
     setAttributeStr (generateUuid(), "general/extracellular_ephys/electrodes/location", "object_id");
 
-    createReferenceDataSet ("general/extracellular_ephys/electrodes/group", groupReferences);
+    if (! createReferenceColumn ("general/extracellular_ephys/electrodes/group", groupReferences))
+        return false;
 
     setAttributeStr ("a reference to the ElectrodeGroup this electrode is a part of", "general/extracellular_ephys/electrodes/group", "description");
     setAttributeStr ("hdmf-common", "general/extracellular_ephys/electrodes/group", "namespace");
     setAttributeStr ("VectorData", "general/extracellular_ephys/electrodes/group", "neurodata_type");
     setAttributeStr (generateUuid(), "general/extracellular_ephys/electrodes/group", "object_id");
 
+    closeAttributeTargets();
+    attaching = false;
+
+    // the journal is replayed into a copy of the file as it is now, which holds the datasets it refers to
+    if (journal.isOpen() && ! writeBaseImages())
+        std::cerr << "Error writing the base image of " << filename << ", it will be recovered from the file itself" << std::endl;
+
+    // no objects can be created from now on, until the file is reopened in close()
+    if (settings.swmr && ! startSWMRWrite())
+    {
+        std::cerr << "Error starting SWMR mode for " << filename << std::endl;
+        return false;
+    }
+
     return true;
 }
 
+void NWBFile::setTrialRule (int ttlLine, String streamName)
+{
+    trialTTLLine = ttlLine;
+    trialStreamName = streamName;
+}
+
 void NWBFile::stopRecording()
+{
+    // a trial still open when the recording stops is written without a stop
+    if (trials != nullptr && trials->inInterval)
+    {
+        Array<int64> stopRows;
+        stopRows.insertMultiple (0, -1, trials->startRows.size());
+
+        writeTrial (std::numeric_limits<double>::quiet_NaN(), stopRows);
+        std::cout << "Trial " << trials->numIntervals << " was still open when recording stopped, its stop_time is NaN" << std::endl;
+    }
+
+    writeSampleCounts();
+
+    for (int i = 0; i < spikeDataSets.size(); i++)
+        writeSpikeIndexBlock (spikeDataSets[i]);
+
+    for (int i = 0; i < eventDataSets.size(); i++)
+        flushContinuousRows (eventDataSets[i], true);
+
+    if (messagesDataSet != nullptr)
+        flushContinuousRows (messagesDataSet.get(), true);
+}
+
+void NWBFile::writeSampleCounts()
 {
     const TimeSeries* tsStruct;
 
@@ -515,6 +690,23 @@ void NWBFile::stopRecording()
     {
         tsStruct = continuousDataSets[i];
         CHECK_ERROR (setAttribute (BaseDataType::U64, &(tsStruct->numSamples), tsStruct->basePath, "num_samples"));
+
+        ecephys::ElectricalSeries* series = continuousDataSets[i];
+
+        // the extent of a dataset stored in a raw file only covers the samples written so far
+        if (series->rawFile != nullptr)
+        {
+            series->rawFile->flush();
+
+            const hid_t dataSet = H5Dopen2 (getFileId(), (series->basePath + "/data").toRawUTF8(), H5P_DEFAULT);
+            hsize_t dims[2] = { jmin (series->numSamples, series->rawRowsWritten), (hsize_t) series->channel_count };
+
+            if (dataSet < 0 || H5Dset_extent (dataSet, dims) < 0)
+                std::cerr << "Error setting the size of " << series->basePath << "/data" << std::endl;
+
+            if (dataSet >= 0)
+                H5Dclose (dataSet);
+        }
     }
 
     for (int i = 0; i < spikeDataSets.size(); i++)
@@ -529,7 +721,281 @@ void NWBFile::stopRecording()
         CHECK_ERROR (setAttribute (BaseDataType::U64, &(tsStruct->numSamples), tsStruct->basePath, "num_samples"));
     }
 
-    CHECK_ERROR (setAttribute (BaseDataType::U64, &(syncMsgDataSet->numSamples), syncMsgDataSet->basePath, "num_samples"));
+    if (syncMsgDataSet != nullptr)
+    {
+        CHECK_ERROR (setAttribute (BaseDataType::U64, &(syncMsgDataSet->numSamples), syncMsgDataSet->basePath, "num_samples"));
+    }
+}
+
+bool NWBFile::close()
+{
+    /* The file may be closed by a background thread while another file is recorded, so
+       the HDF5 lock is taken for each step rather than for the whole close, letting
+       the writes of the recording thread through in between */
+    bool ok = true;
+
+    {
+        const ScopedLock lock (getHDF5Lock());
+
+        // a recording that failed to start in a copy of a template may have left this set
+        attaching = false;
+        forgetDataSets (trials.get());
+        trials.reset();
+    }
+
+    // datasets are released one at a time, each of them may write its cached chunks
+    while (continuousDataSets.size() > 0)
+    {
+        const ScopedLock lock (getHDF5Lock());
+        forgetDataSets (continuousDataSets.getLast());
+        continuousDataSets.removeLast();
+    }
+
+    while (spikeDataSets.size() > 0)
+    {
+        const ScopedLock lock (getHDF5Lock());
+        forgetDataSets (spikeDataSets.getLast());
+        spikeDataSets.removeLast();
+    }
+
+    while (eventDataSets.size() > 0)
+    {
+        const ScopedLock lock (getHDF5Lock());
+        forgetDataSets (eventDataSets.getLast());
+        eventDataSets.removeLast();
+    }
+
+    {
+        const ScopedLock lock (getHDF5Lock());
+
+        forgetDataSets (messagesDataSet.get());
+        forgetDataSets (syncMsgDataSet.get());
+        messagesDataSet.reset();
+        syncMsgDataSet.reset();
+    }
+
+    // objects cannot be deleted in SWMR mode, so the file is reopened normally to group the spike times of the units table
+    if (swmrWriting && units != nullptr)
+    {
+        {
+            const ScopedLock lock (getHDF5Lock());
+
+            forgetDataSets (units.get());
+            units->closeDataSets();
+
+            NWBFileBase::close();
+            swmrWriting = false;
+        }
+
+        const ScopedLock lock (getHDF5Lock());
+
+        if (open (numOpenChannels) != 0)
+        {
+            std::cerr << "Error reopening " << filename << std::endl;
+            ok = false;
+        }
+    }
+
+    /* The spike times of all recordings within this file were written in the order they arrived,
+       and are now grouped so that each unit's spike times end up in one contiguous block */
+    if (ok && units != nullptr && ! groupUnitSpikeTimes())
+    {
+        std::cerr << "Error grouping the spike times of the units table of " << filename << std::endl;
+        ok = false;
+    }
+
+    {
+        const ScopedLock lock (getHDF5Lock());
+
+        forgetDataSets (units.get());
+        units.reset();
+
+        // an object still open would keep the file open past close(), so the metadata is flushed first
+        if (isOpen() && H5Fflush (getFileId(), H5F_SCOPE_LOCAL) < 0)
+        {
+            std::cerr << "Error flushing " << filename << std::endl;
+            ok = false;
+        }
+
+        if (! NWBFileBase::close())
+        {
+            std::cerr << "Error closing " << filename << std::endl;
+            ok = false;
+        }
+
+        swmrWriting = false;
+    }
+
+    for (auto shard : shards)
+    {
+        const ScopedLock lock (getHDF5Lock());
+
+        if (! shard->close())
+        {
+            std::cerr << "Error closing " << shard->getFileName() << std::endl;
+            ok = false;
+        }
+    }
+
+    // a complete file no longer needs its journal
+    if (journal.isOpen() && ok)
+        removeBaseImages();
+
+    journal.close (ok);
+
+    if (numCheckpoints > 0)
+        std::cout << "Checkpointed " << filename << " " << numCheckpoints << " times during recording, "
+                  << String (checkpointSeconds / numCheckpoints * 1000, 1) << " ms on average, "
+                  << String (longestCheckpoint * 1000, 1) << " ms at most, holding the HDF5 lock for up to "
+                  << String (longestCheckpointHold * 1000, 1) << " ms at once" << std::endl;
+
+    return ok;
+}
+
+bool NWBFile::flushFiles()
+{
+    bool ok = H5Fflush (getFileId(), H5F_SCOPE_LOCAL) >= 0;
+
+    for (auto shard : shards)
+        ok = H5Fflush (shard->getFileId(), H5F_SCOPE_LOCAL) >= 0 && ok;
+
+    return ok;
+}
+
+bool NWBFile::writeBaseImages()
+{
+    if (! flushFiles())
+        return false;
+
+    StringArray files;
+    files.add (filename);
+
+    for (auto shard : shards)
+        files.add (shard->getFileName());
+
+    bool ok = true;
+
+    // each copy replaces its base image at once, so that a crash while copying leaves the previous one
+    for (auto& path : files)
+    {
+        const File base (JournalWriter::basePath (path.toStdString()));
+        const File copy = base.getSiblingFile (base.getFileName() + ".tmp");
+
+        ok = File (path).copyFileTo (copy) && copy.moveFileTo (base) && ok;
+    }
+
+    return ok;
+}
+
+void NWBFile::removeBaseImages()
+{
+    File (JournalWriter::basePath (filename.toStdString())).deleteFile();
+
+    for (auto shard : shards)
+        File (JournalWriter::basePath (shard->getFileName().toStdString())).deleteFile();
+}
+
+void NWBFile::flushJournal()
+{
+    if (! journal.flush())
+        std::cerr << "Error writing the journal of " << filename << std::endl;
+}
+
+void NWBFile::beginCheckpoint()
+{
+    flushFileIndex = 0;
+    lastFlushedDataSet = -1;
+    flushFailed = false;
+
+    if (! isOpen())
+        return;
+
+    // readers of the flushed file see the number of samples of each series so far
+    writeSampleCounts();
+}
+
+bool NWBFile::flushNextStep()
+{
+    if (! isOpen())
+        return false;
+
+    std::vector<hid_t> files { getFileId() };
+
+    for (auto shard : shards)
+        files.push_back (shard->getFileId());
+
+    if (flushFileIndex >= files.size())
+        return false;
+
+    const hid_t file = files[flushFileIndex];
+
+    // the open datasets are listed again at each step, as the recording thread may close or create some in between
+    for (hid_t dataSet : getOpenDataSetIds (file))
+    {
+        if (dataSet <= lastFlushedDataSet)
+            continue;
+
+        lastFlushedDataSet = dataSet;
+
+        if (H5Dflush (dataSet) < 0)
+            flushFailed = true;
+
+        return true;
+    }
+
+    // what is left is the metadata of the groups and of the file itself
+    if (H5Fflush (file, H5F_SCOPE_LOCAL) < 0)
+        flushFailed = true;
+
+    flushFileIndex++;
+    lastFlushedDataSet = -1;
+
+    return flushFileIndex < files.size();
+}
+
+int NWBFile::duplicateJournal()
+{
+    if (! journal.isOpen())
+        return -1;
+
+    const int descriptor = journal.duplicate();
+
+    if (descriptor < 0)
+        flushFailed = true;
+
+    return descriptor;
+}
+
+bool NWBFile::endCheckpoint (double seconds, double longestHold)
+{
+    numCheckpoints++;
+    checkpointSeconds += seconds;
+    longestCheckpoint = jmax (longestCheckpoint, seconds);
+    longestCheckpointHold = jmax (longestCheckpointHold, longestHold);
+
+    if (flushFailed)
+        std::cerr << "Error flushing " << filename << std::endl;
+    else if (longestHold > SLOW_CHECKPOINT_SECONDS)
+        std::cout << "Checkpointing " << filename << " took " << String (seconds * 1000, 1) << " ms, holding the HDF5 lock for up to "
+                  << String (longestHold * 1000, 1) << " ms at once" << std::endl;
+
+    return ! flushFailed;
+}
+
+bool NWBFile::closeAsTemplate()
+{
+    forgetDataSets (units.get());
+    forgetDataSets (trials.get());
+    units.reset();
+    trials.reset();
+
+    return close();
+}
+
+CriticalSection& NWBFile::getHDF5Lock()
+{
+    static CriticalSection lock;
+    return lock;
 }
 
 void NWBFile::writeData (int datasetID, int channel, int nSamples, const float* data, float bitVolts)
@@ -549,7 +1015,13 @@ void NWBFile::writeData (int datasetID, int channel, int nSamples, const float*
     FloatVectorOperations::copyWithMultiply (scaledBuffer.getData(), data, multFactor, nSamples);
     AudioDataConverters::convertFloatToInt16LE (scaledBuffer.getData(), intBuffer.getData(), nSamples);
 
-    continuousDataSets[datasetID]->baseDataSet->writeDataRow (channel, nSamples, BaseDataType::I16, intBuffer);
+    if (LiveTap* tap = liveTaps[datasetID])
+        tap->writeChannel (channel, intBuffer, nSamples);
+
+    if (continuousDataSets[datasetID]->rawFile != nullptr)
+        writeRawData (continuousDataSets[datasetID], channel, nSamples);
+    else
+        journal.writeDataRow (continuousDataSets[datasetID]->baseDataSet, channel, nSamples, BaseDataType::I16, intBuffer);
     //CHECK_ERROR();
 
     /* Since channels are filled asynchronouysly by the Record Thread, there is no guarantee
@@ -567,42 +1039,38 @@ void NWBFile::writeSampleNumbers (int datasetID, int nSamples, const int64* data
     if (! continuousDataSets[datasetID])
         return;
 
-    CHECK_ERROR (continuousDataSets[datasetID]->sampleNumberDataSet->writeDataBlock (nSamples, BaseDataType::I64, data));
-}
+    ecephys::ElectricalSeries* series = continuousDataSets[datasetID];
 
-void NWBFile::writeTimestamps (int datasetID, int nSamples, const double* data)
-{
-    if (! continuousDataSets[datasetID])
-        return;
+    CHECK_ERROR (journal.writeDataBlock (series->sampleNumberDataSet, nSamples, BaseDataType::I64, data));
 
-    CHECK_ERROR (continuousDataSets[datasetID]->timestampDataSet->writeDataBlock (nSamples, BaseDataType::F64, data));
-}
+    if (nSamples == 0)
+        return;
 
-void NWBFile::writeChannelConversions (ecephys::ElectricalSeries* electricalSeries)
-{
-    std::vector<float> conversions;
-    for (auto c : electricalSeries->channel_conversion)
-        conversions.push_back (c);
+    if (LiveTap* tap = liveTaps[datasetID])
+        tap->setBlockStart (data[0], series->blockStartTime);
 
-    CHECK_ERROR (electricalSeries->channelConversionDataSet->writeDataBlock (conversions.size(), BaseDataType::F32, &conversions[0]));
-}
+    // sample numbers are consecutive within a block
+    series->rows.addRows (data[0], nSamples, series->blockStartTime);
 
-void NWBFile::writeChannelTypes (ecephys::ElectricalSeries* electricalSeries)
-{
-    std::vector<uint8> channel_type;
-    for (auto i : electricalSeries->channel_type)
-        channel_type.push_back (i);
+    for (auto eventSeries : eventDataSets)
+    {
+        if (eventSeries->alignedSeries == datasetID)
+            flushContinuousRows (eventSeries);
+    }
 
-    CHECK_ERROR (electricalSeries->channelTypesDataSet->writeDataBlock (channel_type.size(), BaseDataType::U8, &channel_type[0]));
+    if (messagesDataSet != nullptr && messagesDataSet->alignedSeries == datasetID)
+        flushContinuousRows (messagesDataSet.get());
 }
 
-void NWBFile::writeElectrodes (ecephys::ElectricalSeries* electricalSeries, Array<int> electrodeInds)
+void NWBFile::writeTimestamps (int datasetID, int nSamples, const double* data)
 {
-    std::vector<int> electrodeNumbers;
-    for (auto i : electrodeInds)
-        electrodeNumbers.push_back (i);
+    if (! continuousDataSets[datasetID])
+        return;
 
-    CHECK_ERROR (electricalSeries->electrodeDataSet->writeDataBlock (electricalSeries->channel_count, BaseDataType::I32, &electrodeNumbers[0]));
+    CHECK_ERROR (journal.writeDataBlock (continuousDataSets[datasetID]->timestampDataSet, nSamples, BaseDataType::F64, data));
+
+    if (nSamples > 0)
+        continuousDataSets[datasetID]->blockStartTime = data[0];
 }
 
 void NWBFile::writeSpike (int electrodeId, const SpikeChannel* channel, const Spike* event)
@@ -625,15 +1093,20 @@ void NWBFile::writeSpike (int electrodeId, const SpikeChannel* channel, const Sp
 
     double timestampSec = event->getTimestampInSeconds();
 
-    CHECK_ERROR (spikeDataSets[electrodeId]->baseDataSet->writeDataBlock (1, BaseDataType::I16, intBuffer));
-    CHECK_ERROR (spikeDataSets[electrodeId]->timestampDataSet->writeDataBlock (1, BaseDataType::F64, &timestampSec));
+    CHECK_ERROR (journal.writeDataBlock (spikeDataSets[electrodeId]->baseDataSet, 1, BaseDataType::I16, intBuffer));
+    CHECK_ERROR (journal.writeDataBlock (spikeDataSets[electrodeId]->timestampDataSet, 1, BaseDataType::F64, &timestampSec));
     writeEventMetadata (spikeDataSets[electrodeId], channel, event);
+    writeSpikeFeatures (spikeDataSets[electrodeId], channel, event);
 
     const int64 sampleNumber = event->getSampleNumber();
 
-    CHECK_ERROR (spikeDataSets[electrodeId]->sampleNumberDataSet->writeDataBlock (1, BaseDataType::I64, &sampleNumber));
+    CHECK_ERROR (journal.writeDataBlock (spikeDataSets[electrodeId]->sampleNumberDataSet, 1, BaseDataType::I64, &sampleNumber));
 
     spikeDataSets[electrodeId]->numSamples += 1;
+
+    updateSpikeIndex (spikeDataSets[electrodeId], timestampSec);
+
+    writeUnitSpike (electrodeId, event->getSortedId(), timestampSec);
 }
 
 void NWBFile::writeEvent (int eventID, const EventChannel* channel, const Event* event)
@@ -663,34 +1136,40 @@ void NWBFile::writeEvent (int eventID, const EventChannel* channel, const Event*
 
     if (eventID == eventDataSets.size()) //MessageCenter event
     {
-        CHECK_ERROR (messagesDataSet->baseDataSet->writeDataBlock (1, BaseDataType::STR (text.length()), text.toUTF8()));
+        CHECK_ERROR (journal.writeDataBlock (messagesDataSet->baseDataSet, 1, BaseDataType::STR (text.length()), text.toUTF8()));
 
         const int64 sampleNumber = event->getSampleNumber();
 
-        CHECK_ERROR (messagesDataSet->sampleNumberDataSet->writeDataBlock (1, BaseDataType::I64, &sampleNumber));
+        CHECK_ERROR (journal.writeDataBlock (messagesDataSet->sampleNumberDataSet, 1, BaseDataType::I64, &sampleNumber));
 
         const double timeSec = event->getTimestampInSeconds();
 
-        CHECK_ERROR (messagesDataSet->timestampDataSet->writeDataBlock (1, BaseDataType::F64, &timeSec));
+        CHECK_ERROR (journal.writeDataBlock (messagesDataSet->timestampDataSet, 1, BaseDataType::F64, &timeSec));
+
+        writeContinuousRow (messagesDataSet.get(), sampleNumber);
 
         messagesDataSet->numSamples += 1;
     }
     else if (eventDataSets[eventID])
     {
-        CHECK_ERROR (eventDataSets[eventID]->baseDataSet->writeDataBlock (1, type, dataSrc));
+        CHECK_ERROR (journal.writeDataBlock (eventDataSets[eventID]->baseDataSet, 1, type, dataSrc));
 
         const double timeSec = event->getTimestampInSeconds();
 
-        CHECK_ERROR (eventDataSets[eventID]->timestampDataSet->writeDataBlock (1, BaseDataType::F64, &timeSec));
+        CHECK_ERROR (journal.writeDataBlock (eventDataSets[eventID]->timestampDataSet, 1, BaseDataType::F64, &timeSec));
 
         const int64 sampleNumber = event->getSampleNumber();
 
-        CHECK_ERROR (eventDataSets[eventID]->sampleNumberDataSet->writeDataBlock (1, BaseDataType::I64, &sampleNumber));
+        CHECK_ERROR (journal.writeDataBlock (eventDataSets[eventID]->sampleNumberDataSet, 1, BaseDataType::I64, &sampleNumber));
+
+        writeContinuousRow (eventDataSets[eventID], sampleNumber);
 
         if (event->getEventType() == EventChannel::TTL)
         {
             const uint64 ttlWord = static_cast<const TTLEvent*> (event)->getWord();
-            CHECK_ERROR (eventDataSets[eventID]->ttlWordDataSet->writeDataBlock (1, BaseDataType::U64, &ttlWord));
+            CHECK_ERROR (journal.writeDataBlock (eventDataSets[eventID]->ttlWordDataSet, 1, BaseDataType::U64, &ttlWord));
+
+            updateTrials (eventID, static_cast<const TTLEvent*> (event));
         }
 
         eventDataSets[eventID]->numSamples += 1;
@@ -703,13 +1182,13 @@ void NWBFile::writeEvent (int eventID, const EventChannel* channel, const Event*
 
 void NWBFile::writeTimestampSyncText (uint16 sourceID, int64 sampleNumber, float sourceSampleRate, String text)
 {
-    CHECK_ERROR (syncMsgDataSet->baseDataSet->writeDataBlock (1, BaseDataType::STR (text.length()), text.toUTF8()));
+    CHECK_ERROR (journal.writeDataBlock (syncMsgDataSet->baseDataSet, 1, BaseDataType::STR (text.length()), text.toUTF8()));
 
-    CHECK_ERROR (syncMsgDataSet->sampleNumberDataSet->writeDataBlock (1, BaseDataType::I64, &sampleNumber));
+    CHECK_ERROR (journal.writeDataBlock (syncMsgDataSet->sampleNumberDataSet, 1, BaseDataType::I64, &sampleNumber));
 
     double timestamp = (double) sampleNumber;
 
-    CHECK_ERROR (syncMsgDataSet->timestampDataSet->writeDataBlock (1, BaseDataType::F64, &timestamp));
+    CHECK_ERROR (journal.writeDataBlock (syncMsgDataSet->timestampDataSet, 1, BaseDataType::F64, &timestamp));
 
     syncMsgDataSet->numSamples += 1;
 }
@@ -723,6 +1202,14 @@ bool NWBFile::createTimeSeriesBase (TimeSeries* timeSeries)
 {
     if (createGroup (timeSeries->basePath))
         return false;
+
+    // num_samples is written when recording stops, and attributes cannot be created in SWMR mode
+    if (settings.swmr)
+    {
+        const uint64 noSamples = 0;
+        CHECK_ERROR (setAttribute (BaseDataType::U64, &noSamples, timeSeries->basePath, "num_samples"));
+    }
+
     CHECK_ERROR (setAttributeStr (" ", timeSeries->basePath, "comments"));
     CHECK_ERROR (setAttributeStr (timeSeries->description, timeSeries->basePath, "description"));
     CHECK_ERROR (setAttributeStr ("core", timeSeries->basePath, "namespace"));
@@ -738,9 +1225,10 @@ void NWBFile::createDataAttributes (String basePath, float conversion, float res
     CHECK_ERROR (setAttributeStr (unit, basePath + "/data", "unit"));
 }
 
-HDF5RecordingData* NWBFile::createTimestampDataSet (String path, int chunk_size, float interval)
+HDF5RecordingData* NWBFile::createTimestampDataSet (String path, int chunk_size, float interval, NWBShardFile* shard)
 {
-    HDF5RecordingData* tsSet = createDataSet (BaseDataType::F64, 0, chunk_size, path);
+    HDF5RecordingData* tsSet = shard != nullptr ? createLinkedDataSet (shard, BaseDataType::F64, 0, chunk_size, path)
+                                                : createDataSet (BaseDataType::F64, 0, chunk_size, path);
 
     if (! tsSet)
         std::cerr << "Error creating timestamp dataset in " << path << std::endl;
@@ -753,9 +1241,10 @@ HDF5RecordingData* NWBFile::createTimestampDataSet (String path, int chunk_size,
     return tsSet;
 }
 
-HDF5RecordingData* NWBFile::createSampleNumberDataSet (String path, int chunk_size)
+HDF5RecordingData* NWBFile::createSampleNumberDataSet (String path, int chunk_size, NWBShardFile* shard)
 {
-    HDF5RecordingData* tsSet = createDataSet (BaseDataType::I64, 0, chunk_size, path);
+    HDF5RecordingData* tsSet = shard != nullptr ? createLinkedDataSet (shard, BaseDataType::I64, 0, chunk_size, path)
+                                                : createDataSet (BaseDataType::I64, 0, chunk_size, path);
     if (! tsSet)
         std::cerr << "Error creating sample number dataset in " << path << std::endl;
     else
@@ -767,45 +1256,462 @@ HDF5RecordingData* NWBFile::createSampleNumberDataSet (String path, int chunk_si
     return tsSet;
 }
 
-HDF5RecordingData* NWBFile::createChannelConversionDataSet (String path, String description, int chunk_size)
+HDF5RecordingData* NWBFile::createLinkedDataSet (NWBShardFile* shard, BaseDataType type, int sizeY, int chunkX, String path)
 {
-    HDF5RecordingData* elSet = createDataSet (BaseDataType::F32, 1, chunk_size, path);
+    // attributes set through path are written to the shard's dataset, and the journal replays data through the link
+    return journal.declare (shard->createLinkedDataSet (getFileId(), type, sizeY, chunkX, path), path, jmax (1, sizeY));
+}
 
-    if (! elSet)
-        std::cerr << "Error creating electrode dataset in " << path << std::endl;
-    else
+bool NWBFile::createRawDataSet (ecephys::ElectricalSeries* series, const String& groupName, const String& path)
+{
+    const File rawFile = File (filename).getSiblingFile (File (filename).getFileNameWithoutExtension() + "." + File::createLegalFileName (groupName) + ".dat");
+
+    rawFile.deleteFile();
+    series->rawFile = std::make_unique<FileOutputStream> (rawFile, 1 << 20);
+
+    if (series->rawFile->failedToOpen())
+    {
+        series->rawFile.reset();
+        return false;
+    }
+
+    hsize_t dims[2] = { 0, (hsize_t) series->channel_count };
+    hsize_t maxDims[2] = { H5S_UNLIMITED, (hsize_t) series->channel_count };
+    const hid_t space = H5Screate_simple (2, dims, maxDims);
+    const hid_t dcpl = H5Pcreate (H5P_DATASET_CREATE);
+
+    /* The relative name lets the files be moved together, but HDF5 looks it up in the working directory
+       unless the reader sets the external file prefix to "${ORIGIN}" (H5Pset_efile_prefix, or the
+       HDF5_EXTFILE_PREFIX environment variable): pynwb and h5py do not, see the README */
+    H5Pset_external (dcpl, rawFile.getFileName().toRawUTF8(), 0, H5F_UNLIMITED);
+
+    const hid_t dataSet = H5Dcreate2 (getFileId(), path.toRawUTF8(), H5T_STD_I16LE, space, H5P_DEFAULT, dcpl, H5P_DEFAULT);
+
+    H5Pclose (dcpl);
+    H5Sclose (space);
+
+    if (dataSet < 0)
     {
-        CHECK_ERROR (setAttributeStr (description, path, "description"));
-        CHECK_ERROR (setAttributeStr ("hdmf-common", path, "namespace"));
-        CHECK_ERROR (setAttributeStr (generateUuid(), path, "object_id"));
+        series->rawFile.reset();
+        return false;
     }
-    return elSet;
+
+    H5Dclose (dataSet);
+
+    // the file states the requirement itself, for readers that open it without the README
+    CHECK_ERROR (setAttributeStr ("Samples stored in the external file " + rawFile.getFileName() + " next to this file. "
+                                  "HDF5 looks it up in the working directory unless the external file prefix is set to "
+                                  "${ORIGIN}, e.g. with the environment variable HDF5_EXTFILE_PREFIX='${ORIGIN}'",
+                                  path, "description"));
+
+    return true;
 }
 
-HDF5RecordingData* NWBFile::createChannelTypesDataSet (String path, String description, int chunk_size)
+void NWBFile::writeRawData (ecephys::ElectricalSeries* series, int channel, int nSamples)
 {
-    HDF5RecordingData* elSet = createDataSet (BaseDataType::U8, 1, chunk_size, path);
-    if (! elSet)
-        std::cerr << "Error creating electrode dataset in " << path << std::endl;
-    else
-        CHECK_ERROR (setAttributeStr (description, path, "description"));
-    return elSet;
+    const int numChannels = series->channel_count;
+
+    if ((int) series->rawChannels.size() != numChannels)
+        series->rawChannels.resize (numChannels);
+
+    std::vector<int16>& pending = series->rawChannels[channel];
+    pending.insert (pending.end(), intBuffer.getData(), intBuffer.getData() + nSamples);
+
+    /* Channels are written one at a time and may not all have the same number of samples
+       in a block, so only the rows that every channel has filled are written */
+    size_t numRows = pending.size();
+
+    for (auto& samples : series->rawChannels)
+        numRows = std::min (numRows, samples.size());
+
+    if (numRows == 0)
+        return;
+
+    if (numRows * numChannels > series->rawBuffer.size())
+        series->rawBuffer.resize (numRows * numChannels);
+
+    for (int ch = 0; ch < numChannels; ch++)
+    {
+        std::vector<int16>& samples = series->rawChannels[ch];
+
+        for (size_t i = 0; i < numRows; i++)
+            series->rawBuffer[i * numChannels + ch] = samples[i];
+
+        samples.erase (samples.begin(), samples.begin() + numRows);
+    }
+
+    if (! series->rawFile->write (series->rawBuffer.data(), sizeof (int16) * numRows * numChannels))
+    {
+        // the rows stay missing from the end of the dataset, whose extent only covers the rows written
+        if (! series->rawWriteFailed)
+            std::cerr << "Error writing to the raw data file of " << series->basePath << ", samples are being lost" << std::endl;
+
+        series->rawWriteFailed = true;
+        return;
+    }
+
+    series->rawRowsWritten += numRows;
+}
+
+bool NWBFile::startSWMRWrite()
+{
+    /* Datasets that grow during recording are flushed each time they grow by a chunk, which
+       bounds the delay before readers see new data. Their extents are the live sample counts. */
+    bool ok = true;
+
+    for (int i = 0; i < continuousDataSets.size(); i++)
+    {
+        ecephys::ElectricalSeries* series = continuousDataSets[i];
+
+        // with sharding, these datasets are at the root of the shard of their stream
+        const hid_t location = settings.shardStreams ? shards[i]->getFileId() : getFileId();
+        const String path = settings.shardStreams ? String() : series->basePath;
+
+        ok = ok && setAppendFlush (series->baseDataSet, location, path + "/data");
+        ok = ok && setAppendFlush (series->timestampDataSet, location, path + "/timestamps");
+        ok = ok && setAppendFlush (series->sampleNumberDataSet, location, path + "/sync");
+    }
+
+    for (auto series : eventDataSets)
+    {
+        ok = ok && setAppendFlush (series->baseDataSet, getFileId(), series->basePath + "/data");
+        ok = ok && setAppendFlush (series->timestampDataSet, getFileId(), series->basePath + "/timestamps");
+        ok = ok && setAppendFlush (series->sampleNumberDataSet, getFileId(), series->basePath + "/sync");
+        ok = ok && setAppendFlush (series->ttlWordDataSet, getFileId(), series->basePath + "/full_word");
+    }
+
+    if (messagesDataSet != nullptr)
+    {
+        ok = ok && setAppendFlush (messagesDataSet->baseDataSet, getFileId(), messagesDataSet->basePath + "/data");
+        ok = ok && setAppendFlush (messagesDataSet->timestampDataSet, getFileId(), messagesDataSet->basePath + "/timestamps");
+        ok = ok && setAppendFlush (messagesDataSet->sampleNumberDataSet, getFileId(), messagesDataSet->basePath + "/sync");
+    }
+
+    if (! ok || H5Fstart_swmr_write (getFileId()) < 0)
+        return false;
+
+    for (auto shard : shards)
+    {
+        if (H5Fstart_swmr_write (shard->getFileId()) < 0)
+            return false;
+    }
+
+    swmrWriting = true;
+    return true;
+}
+
+bool NWBFile::setAppendFlush (ScopedPointer<HDF5RecordingData>& dataSet, hid_t location, const String& path)
+{
+    // data written to raw files has no dataset handle
+    if (dataSet == nullptr)
+        return true;
+
+    // the flush settings are only applied when the dataset is first opened, so the handle is closed first
+    const HDF5RecordingData* previous = dataSet;
+    dataSet = nullptr;
+
+    hid_t id = H5Dopen2 (location, path.toRawUTF8(), H5P_DEFAULT);
+
+    if (id < 0)
+        return false;
+
+    const hid_t dcpl = H5Dget_create_plist (id);
+    hsize_t boundary[2] = { 0, 0 };
+    const int rank = H5Pget_chunk (dcpl, 2, boundary);
+
+    H5Pclose (dcpl);
+    H5Dclose (id);
+
+    // only the first dimension grows
+    boundary[1] = 0;
+
+    const hid_t dapl = H5Pcreate (H5P_DATASET_ACCESS);
+
+    if (rank > 0)
+        H5Pset_append_flush (dapl, (unsigned) rank, boundary, nullptr, nullptr);
+
+    id = H5Dopen2 (location, path.toRawUTF8(), dapl);
+    H5Pclose (dapl);
+
+    if (id < 0)
+        return false;
+
+    // H5::DataSet takes its own reference to the identifier
+    dataSet = new HDF5RecordingData (new H5::DataSet (id));
+    H5Dclose (id);
+
+    // the new handle goes on writing to the journal under the same path
+    journal.transfer (previous, dataSet);
+
+    return true;
+}
+
+String NWBFile::getTimeString()
+{
+    return Time::getCurrentTime().formatted ("%Y-%m-%dT%H:%M:%S") + Time::getCurrentTime().getUTCOffsetString (true);
+}
+
+bool NWBFile::moveTo (const String& newName)
+{
+    // the file stays open while it is renamed, which only fails on Windows or across volumes
+    if (std::rename (filename.toRawUTF8(), newName.toRawUTF8()) != 0)
+    {
+        std::cerr << "Could not move " << filename << " to " << newName << std::endl;
+        return false;
+    }
+
+    const String oldName = filename;
+    filename = newName;
+
+    if (journal.isOpen() && ! journal.moveTo (newName))
+        std::cerr << "Could not move the journal of " << newName << std::endl;
+
+    // the base image is taken again once the file is restamped, under its new name
+    if (journal.isOpen())
+        std::rename (JournalWriter::basePath (oldName.toStdString()).c_str(), JournalWriter::basePath (newName.toStdString()).c_str());
+
+    return restamp();
+}
+
+bool NWBFile::restamp()
+{
+    // the times have the same format, and so the same length, as the ones written when the file was created
+    const String time = getTimeString();
+
+    const bool ok = rewriteText ("/file_create_date", time)
+                    && rewriteText ("/session_start_time", time)
+                    && rewriteText ("/timestamps_reference_time", time);
+
+    // the rewritten times are not journaled, so a recovered file gets them from the base image
+    if (ok && journal.isOpen() && ! writeBaseImages())
+        std::cerr << "Error writing the base image of " << filename << std::endl;
+
+    return ok;
 }
 
-HDF5RecordingData* NWBFile::createElectrodeDataSet (String path, String description, int chunk_size)
+bool NWBFile::rewriteText (const String& path, const String& text)
 {
-    HDF5RecordingData* elSet = createDataSet (BaseDataType::I32, 1, chunk_size, path);
-    if (! elSet)
-        std::cerr << "Error creating electrode dataset in " << path << std::endl;
+    const hid_t dataSet = H5Dopen2 (getFileId(), path.toRawUTF8(), H5P_DEFAULT);
+
+    if (dataSet < 0)
+        return false;
+
+    const hid_t type = H5Dget_type (dataSet);
+    herr_t status;
+
+    if (H5Tis_variable_str (type) > 0)
+    {
+        const char* value = text.toRawUTF8();
+        status = H5Dwrite (dataSet, type, H5S_ALL, H5S_ALL, H5P_DEFAULT, &value);
+    }
     else
     {
-        CHECK_ERROR (setAttributeStr (description, path, "description"));
-        CHECK_ERROR (setAttributeStr ("hdmf-common", path, "namespace"));
-        CHECK_ERROR (setAttributeStr ("DynamicTableRegion", path, "neurodata_type"));
-        CHECK_ERROR (setAttributeStr (generateUuid(), path, "object_id"));
-        CHECK_ERROR (setAttributeRef ("general/extracellular_ephys/electrodes", path, "table"));
+        std::vector<char> value (H5Tget_size (type), 0);
+        memcpy (value.data(), text.toRawUTF8(), jmin (value.size(), strlen (text.toRawUTF8())));
+        status = H5Dwrite (dataSet, type, H5S_ALL, H5S_ALL, H5P_DEFAULT, value.data());
+    }
+
+    H5Tclose (type);
+    H5Dclose (dataSet);
+
+    return status >= 0;
+}
+
+std::vector<hid_t> NWBFile::getOpenDataSetIds (hid_t fileId)
+{
+    std::vector<hid_t> ids;
+    const ssize_t numDataSets = H5Fget_obj_count (fileId, H5F_OBJ_DATASET);
+
+    if (numDataSets > 0)
+    {
+        ids.resize ((size_t) numDataSets);
+        ids.resize ((size_t) jmax (ssize_t (0), H5Fget_obj_ids (fileId, H5F_OBJ_DATASET, (size_t) numDataSets, ids.data())));
+    }
+
+    std::sort (ids.begin(), ids.end());
+
+    return ids;
+}
+
+int64 NWBFile::getFileSize()
+{
+    int64 total = 0;
+    hsize_t size;
+
+    if (H5Fget_filesize (getFileId(), &size) >= 0)
+        total += size;
+
+    for (auto shard : shards)
+    {
+        if (H5Fget_filesize (shard->getFileId(), &size) >= 0)
+            total += size;
+    }
+
+    for (auto series : continuousDataSets)
+    {
+        if (series->rawFile != nullptr)
+            total += series->rawFile->getPosition();
+    }
+
+    return total;
+}
+
+VirtualSegment NWBFile::getVirtualSegment()
+{
+    VirtualSegment segment;
+    segment.fileName = File (filename).getFileName();
+
+    for (auto series : continuousDataSets)
+    {
+        segment.rows[series->basePath + "/data"] = series->numSamples;
+        segment.rows[series->basePath + "/timestamps"] = series->numSamples;
+        segment.rows[series->basePath + "/sync"] = (uint64) series->rows.getNumRows();
+    }
+
+    for (auto series : eventDataSets)
+    {
+        for (auto name : { "/data", "/timestamps", "/sync", "/full_word" })
+            segment.rows[series->basePath + name] = series->numSamples;
+    }
+
+    for (auto series : spikeDataSets)
+    {
+        for (auto name : { "/data", "/timestamps", "/sync" })
+            segment.rows[series->basePath + name] = series->numSamples;
+    }
+
+    if (messagesDataSet != nullptr)
+    {
+        for (auto name : { "/data", "/timestamps", "/sync" })
+            segment.rows[messagesDataSet->basePath + name] = messagesDataSet->numSamples;
+    }
+
+    return segment;
+}
+
+bool NWBFile::makeVirtual (const Array<VirtualSegment>& segments, const String& currentSegment)
+{
+    const VirtualSegment layout = getVirtualSegment();
+
+    // the datasets are replaced, so their handles are released first
+    for (auto series : continuousDataSets)
+    {
+        forgetDataSets (series);
+        series->baseDataSet = nullptr;
+        series->timestampDataSet = nullptr;
+        series->sampleNumberDataSet = nullptr;
+    }
+
+    for (auto series : eventDataSets)
+    {
+        forgetDataSets (series);
+        series->baseDataSet = nullptr;
+        series->timestampDataSet = nullptr;
+        series->sampleNumberDataSet = nullptr;
+        series->ttlWordDataSet = nullptr;
+        series->continuousRowDataSet = nullptr;
+    }
+
+    for (auto series : spikeDataSets)
+    {
+        forgetDataSets (series);
+        series->baseDataSet = nullptr;
+        series->timestampDataSet = nullptr;
+        series->sampleNumberDataSet = nullptr;
+        series->blockStartDataSet = nullptr;
+        series->blockMinTimeDataSet = nullptr;
+        series->blockMaxTimeDataSet = nullptr;
+        series->peakAmplitudeDataSet = nullptr;
+        series->peakChannelDataSet = nullptr;
+        series->troughToPeakDataSet = nullptr;
+    }
+
+    if (messagesDataSet != nullptr)
+    {
+        forgetDataSets (messagesDataSet.get());
+        messagesDataSet->baseDataSet = nullptr;
+        messagesDataSet->timestampDataSet = nullptr;
+        messagesDataSet->sampleNumberDataSet = nullptr;
+        messagesDataSet->continuousRowDataSet = nullptr;
+    }
+
+    forgetDataSets (units.get());
+    forgetDataSets (trials.get());
+    units.reset();
+    trials.reset();
+
+    /* Objects derived from the rows of one file (the units table, trials, spike indexes, spike features
+       and continuous rows) would be empty here, and are read from the segments instead */
+    StringArray derived;
+    derived.add ("/units");
+    derived.add ("/intervals/trials");
+
+    for (auto series : spikeDataSets)
+    {
+        derived.add (series->basePath + "/spike_index");
+        derived.add (series->basePath + "/features");
+    }
+
+    for (auto series : eventDataSets)
+        derived.add (series->basePath + "/continuous_row");
+
+    if (messagesDataSet != nullptr)
+        derived.add (messagesDataSet->basePath + "/continuous_row");
+
+    const hid_t file = getFileId();
+
+    for (auto path : derived)
+    {
+        if (H5Lexists (file, path.toRawUTF8(), H5P_DEFAULT) > 0 && H5Ldelete (file, path.toRawUTF8(), H5P_DEFAULT) < 0)
+            std::cerr << "Error removing " << path << " from " << filename << std::endl;
+    }
+
+    for (auto& entry : layout.rows)
+    {
+        if (! VirtualSegments::map (file, entry.first, segments, currentSegment))
+        {
+            std::cerr << "Error creating virtual dataset " << entry.first << std::endl;
+            return false;
+        }
     }
-    return elSet;
+
+    return true;
+}
+
+bool NWBFile::createChannelConversionDataSet (String path, String description, const Array<float>& conversions)
+{
+    if (! writeColumn (path, H5T_NATIVE_FLOAT, conversions.size(), conversions.getRawDataPointer()))
+        return false;
+
+    CHECK_ERROR (setAttributeStr (description, path, "description"));
+    CHECK_ERROR (setAttributeStr ("hdmf-common", path, "namespace"));
+    CHECK_ERROR (setAttributeStr (generateUuid(), path, "object_id"));
+
+    return true;
+}
+
+bool NWBFile::createChannelTypesDataSet (String path, String description, const Array<uint8>& types)
+{
+    if (! writeColumn (path, H5T_NATIVE_UINT8, types.size(), types.getRawDataPointer()))
+        return false;
+
+    CHECK_ERROR (setAttributeStr (description, path, "description"));
+
+    return true;
+}
+
+bool NWBFile::createElectrodeDataSet (String path, String description, const Array<int>& electrodes)
+{
+    if (! writeColumn (path, H5T_NATIVE_INT32, electrodes.size(), electrodes.getRawDataPointer()))
+        return false;
+
+    CHECK_ERROR (setAttributeStr (description, path, "description"));
+    CHECK_ERROR (setAttributeStr ("hdmf-common", path, "namespace"));
+    CHECK_ERROR (setAttributeStr ("DynamicTableRegion", path, "neurodata_type"));
+    CHECK_ERROR (setAttributeStr (generateUuid(), path, "object_id"));
+    CHECK_ERROR (setAttributeRef ("general/extracellular_ephys/electrodes", path, "table"));
+
+    return true;
 }
 
 bool NWBFile::createExtraInfo (String basePath, String name, String desc, String id, uint16 index, uint16 typeIndex)
@@ -892,26 +1798,752 @@ void NWBFile::writeEventMetadata (TimeSeries* timeSeries, const MetadataEventObj
     for (int i = 0; i < nMetadata; i++)
     {
         BaseDataType type = getMetadataH5Type (info->getEventMetadataDescriptor (i)->getType(), info->getEventMetadataDescriptor (i)->getLength());
-        timeSeries->metaDataSet[i]->writeDataBlock (1, type, event->getMetadataValue (i)->getRawValuePointer());
+        journal.writeDataBlock (timeSeries->metaDataSet[i], 1, type, event->getMetadataValue (i)->getRawValuePointer());
     }
 }
 
-void NWBFile::createTextDataSet (String path, String name, String text)
+bool NWBFile::createSpikeIndex (ecephys::SpikeEventSeries* series)
 {
-    ScopedPointer<HDF5RecordingData> dSet;
+    String path = series->basePath + "/spike_index";
 
-    if (text.isEmpty())
-        text = " "; //to avoid 0-length strings, which cause errors
-    BaseDataType type = BaseDataType::STR (text.length());
+    if (createGroup (path))
+        return false;
 
-    dSet = createDataSet (type, 1, 0, path + "/" + name);
-    if (! dSet)
+    const int32 blockSize = SPIKE_INDEX_BLOCK_SIZE;
+    // not part of the NWB schema: NWB readers ignore the group, other readers may use it to skip blocks of spikes
+    CHECK_ERROR (setAttributeStr ("Open Ephys extension (not part of the NWB schema): earliest and latest spike time of each block of rows, to locate spikes within a time range without reading all timestamps", path, "description"));
+    CHECK_ERROR (setAttribute (BaseDataType::I32, &blockSize, path, "block_size"));
+
+    series->blockStartDataSet = createDataSet (BaseDataType::U64, 0, EVENT_CHUNK_SIZE, path + "/block_start");
+    series->blockMinTimeDataSet = createDataSet (BaseDataType::F64, 0, EVENT_CHUNK_SIZE, path + "/block_min_time");
+    series->blockMaxTimeDataSet = createDataSet (BaseDataType::F64, 0, EVENT_CHUNK_SIZE, path + "/block_max_time");
+
+    if (series->blockStartDataSet == nullptr || series->blockMinTimeDataSet == nullptr || series->blockMaxTimeDataSet == nullptr)
+    {
+        std::cerr << "Error creating spike index in " << path << std::endl;
+        return false;
+    }
+
+    series->blockStart = 0;
+
+    return true;
+}
+
+void NWBFile::updateSpikeIndex (ecephys::SpikeEventSeries* series, double timestamp)
+{
+    // numSamples already includes this spike
+    if (series->numSamples - series->blockStart == 1)
+    {
+        series->blockMinTime = timestamp;
+        series->blockMaxTime = timestamp;
+    }
+    else
+    {
+        series->blockMinTime = jmin (series->blockMinTime, timestamp);
+        series->blockMaxTime = jmax (series->blockMaxTime, timestamp);
+    }
+
+    if (series->numSamples - series->blockStart >= SPIKE_INDEX_BLOCK_SIZE)
+        writeSpikeIndexBlock (series);
+}
+
+void NWBFile::writeSpikeIndexBlock (ecephys::SpikeEventSeries* series)
+{
+    if (series->numSamples == series->blockStart)
         return;
-    dSet->writeDataBlock (1, type, text.toUTF8());
+
+    CHECK_ERROR (journal.writeDataBlock (series->blockStartDataSet, 1, BaseDataType::U64, &series->blockStart));
+    CHECK_ERROR (journal.writeDataBlock (series->blockMinTimeDataSet, 1, BaseDataType::F64, &series->blockMinTime));
+    CHECK_ERROR (journal.writeDataBlock (series->blockMaxTimeDataSet, 1, BaseDataType::F64, &series->blockMaxTime));
+
+    series->blockStart = series->numSamples;
 }
 
-void NWBFile::createBinaryDataSet (String path, String name, BaseDataType type, int length, void* data)
+bool NWBFile::createSpikeFeatures (ecephys::SpikeEventSeries* series)
+{
+    String path = series->basePath + "/features";
+
+    if (createGroup (path))
+        return false;
+
+    CHECK_ERROR (setAttributeStr ("Waveform features computed for each spike at acquisition time", path, "description"));
+
+    series->peakAmplitudeDataSet = createDataSet (BaseDataType::F32, 0, series->channel_count, SPIKE_CHUNK_XSIZE, path + "/peak_amplitude");
+    series->peakChannelDataSet = createDataSet (BaseDataType::U16, 0, SPIKE_CHUNK_XSIZE, path + "/peak_channel");
+    series->troughToPeakDataSet = createDataSet (BaseDataType::F32, 0, SPIKE_CHUNK_XSIZE, path + "/trough_to_peak");
+
+    if (series->peakAmplitudeDataSet == nullptr || series->peakChannelDataSet == nullptr || series->troughToPeakDataSet == nullptr)
+    {
+        std::cerr << "Error creating spike features in " << path << std::endl;
+        return false;
+    }
+
+    CHECK_ERROR (setAttributeStr ("Signed amplitude of the largest deflection of each channel", path + "/peak_amplitude", "description"));
+    CHECK_ERROR (setAttributeStr ("volts", path + "/peak_amplitude", "unit"));
+    CHECK_ERROR (setAttributeStr ("Index of the channel with the largest absolute peak amplitude", path + "/peak_channel", "description"));
+    CHECK_ERROR (setAttributeStr ("Time from the waveform minimum to the following maximum on the peak channel", path + "/trough_to_peak", "description"));
+    CHECK_ERROR (setAttributeStr ("seconds", path + "/trough_to_peak", "unit"));
+
+    return true;
+}
+
+void NWBFile::writeSpikeFeatures (ecephys::SpikeEventSeries* series, const SpikeChannel* channel, const Spike* event)
 {
+    const int nChannels = channel->getNumChannels();
+    const int nSamples = channel->getTotalSamples();
+
+    // waveforms are stored channel by channel, in microvolts
+    const float* waveform = event->getDataPointer();
+
+    uint16 peakChannel = 0;
+    float largestPeak = -1.0f;
+
+    for (int ch = 0; ch < nChannels; ch++)
+    {
+        Range<float> extremes = FloatVectorOperations::findMinAndMax (waveform + ch * nSamples, nSamples);
+
+        float peak = std::abs (extremes.getStart()) >= std::abs (extremes.getEnd()) ? extremes.getStart() : extremes.getEnd();
+
+        featureBuffer[ch] = peak / 1e6;
+
+        if (std::abs (peak) > largestPeak)
+        {
+            largestPeak = std::abs (peak);
+            peakChannel = ch;
+        }
+    }
+
+    const float* peakWaveform = waveform + peakChannel * nSamples;
+    const float* trough = std::min_element (peakWaveform, peakWaveform + nSamples);
+    const float* peak = std::max_element (trough, peakWaveform + nSamples);
+
+    float troughToPeak = float (peak - trough) / channel->getSampleRate();
+
+    CHECK_ERROR (journal.writeDataBlock (series->peakAmplitudeDataSet, 1, BaseDataType::F32, featureBuffer));
+    CHECK_ERROR (journal.writeDataBlock (series->peakChannelDataSet, 1, BaseDataType::U16, &peakChannel));
+    CHECK_ERROR (journal.writeDataBlock (series->troughToPeakDataSet, 1, BaseDataType::F32, &troughToPeak));
+}
+
+bool NWBFile::createContinuousRowDataSet (TimeSeries* eventSeries, int continuousSeries)
+{
+    // events can only be aligned to continuous data sampled with the same clock
+    if (continuousSeries < 0)
+        return true;
+
+    String path = eventSeries->basePath + "/continuous_row";
+
+    eventSeries->continuousRowDataSet = createDataSet (BaseDataType::I64, 0, EVENT_CHUNK_SIZE, path);
+
+    if (eventSeries->continuousRowDataSet == nullptr)
+    {
+        std::cerr << "Error creating continuous row dataset in " << path << std::endl;
+        return false;
+    }
+
+    eventSeries->alignedSeries = continuousSeries;
+
+    CHECK_ERROR (setAttributeStr ("Row of the referenced ElectricalSeries at which each event occurred", path, "description"));
+    CHECK_ERROR (setAttributeRef (continuousDataSets[continuousSeries]->basePath, path, "series"));
+
+    return true;
+}
+
+void NWBFile::writeContinuousRow (TimeSeries* eventSeries, int64 sampleNumber)
+{
+    if (eventSeries->continuousRowDataSet == nullptr)
+        return;
+
+    eventSeries->pendingSampleNumbers.add (sampleNumber);
+
+    flushContinuousRows (eventSeries);
+}
+
+void NWBFile::flushContinuousRows (TimeSeries* eventSeries, bool force)
+{
+    if (eventSeries->continuousRowDataSet == nullptr)
+        return;
+
+    const ecephys::ElectricalSeries* series = continuousDataSets[eventSeries->alignedSeries];
+
+    /* Continuous data and events are written asynchronously, so an event's row is only
+       computed once the data block containing it has been written (events arrive in order) */
+    int n = 0;
+
+    while (n < eventSeries->pendingSampleNumbers.size())
+    {
+        const int64 sampleNumber = eventSeries->pendingSampleNumbers[n];
+
+        if (! force && ! series->rows.covers (sampleNumber))
+            break;
+
+        /* -1 marks events that occurred while no continuous data was written: before the first
+           sample of the current block of rows, or (when forced) after the last sample written */
+        const int64 row = series->rows.getRow (sampleNumber);
+
+        CHECK_ERROR (journal.writeDataBlock (eventSeries->continuousRowDataSet, 1, BaseDataType::I64, &row));
+        n++;
+    }
+
+    eventSeries->pendingSampleNumbers.removeRange (0, n);
+}
+
+bool NWBFile::createTrialsTable (const Array<const EventChannel*>& eventArray)
+{
+    forgetDataSets (trials.get());
+    trials.reset();
+
+    if (trialTTLLine <= 0)
+        return true;
+
+    // TTL channels are stored in eventDataSets in the same order as in eventArray
+    int eventSeries = -1;
+    int ttlIndex = 0;
+
+    for (auto info : eventArray)
+    {
+        if (info->getType() != EventChannel::TTL)
+            continue;
+
+        if (trialStreamName.isEmpty() || info->getStreamName() == trialStreamName)
+        {
+            eventSeries = ttlIndex;
+            break;
+        }
+
+        ttlIndex++;
+    }
+
+    if (eventSeries < 0)
+    {
+        std::cout << "No TTL stream matches the trial rule, trials will not be written" << std::endl;
+        return true;
+    }
+
+    const String path = "/intervals/trials";
+
+    trials.reset (new TimeIntervals (path, "Trials delimited by the pulses of TTL line " + String (trialTTLLine), eventSeries, trialTTLLine - 1));
+
+    if (createGroup ("/intervals") || createGroup (path))
+        return false;
+
+    StringArray colnames;
+    colnames.add ("start_time");
+    colnames.add ("stop_time");
+    colnames.add ("start_row");
+    colnames.add ("stop_row");
+    CHECK_ERROR (setAttributeStrArray (colnames, path, "colnames"));
+    CHECK_ERROR (setAttributeStr (trials->description, path, "description"));
+    CHECK_ERROR (setAttributeStr ("core", path, "namespace"));
+    CHECK_ERROR (setAttributeStr ("TimeIntervals", path, "neurodata_type"));
+    CHECK_ERROR (setAttributeStr (generateUuid(), path, "object_id"));
+
+    trials->idDataSet = createDataSet (BaseDataType::I32, 0, EVENT_CHUNK_SIZE, path + "/id");
+    trials->startTimeDataSet = createDataSet (BaseDataType::F64, 0, EVENT_CHUNK_SIZE, path + "/start_time");
+    trials->stopTimeDataSet = createDataSet (BaseDataType::F64, 0, EVENT_CHUNK_SIZE, path + "/stop_time");
+
+    const int numSeries = jmax (1, continuousDataSets.size());
+    trials->startRowDataSet = createDataSet (BaseDataType::I64, 0, numSeries, EVENT_CHUNK_SIZE, path + "/start_row");
+    trials->stopRowDataSet = createDataSet (BaseDataType::I64, 0, numSeries, EVENT_CHUNK_SIZE, path + "/stop_row");
+
+    if (trials->idDataSet == nullptr || trials->startTimeDataSet == nullptr || trials->stopTimeDataSet == nullptr
+        || trials->startRowDataSet == nullptr || trials->stopRowDataSet == nullptr)
+    {
+        std::cerr << "Error creating trials table" << std::endl;
+        return false;
+    }
+
+    CHECK_ERROR (setAttributeStr ("hdmf-common", path + "/id", "namespace"));
+    CHECK_ERROR (setAttributeStr ("ElementIdentifiers", path + "/id", "neurodata_type"));
+    CHECK_ERROR (setAttributeStr (generateUuid(), path + "/id", "object_id"));
+
+    StringArray seriesPaths;
+    for (auto series : continuousDataSets)
+        seriesPaths.add (series->basePath);
+
+    const StringArray columns = { "start_time", "stop_time", "start_row", "stop_row" };
+    // start_row and stop_row are an extension: two-dimensional, with one column per series listed in their "series" attribute
+    const StringArray descriptions = { "Start time of trial",
+                                       "Stop time of trial (NaN if the recording stopped during the trial)",
+                                       "Open Ephys extension (not part of the NWB schema): row of each ElectricalSeries listed in the series attribute at which the trial starts, one column per series, -1 if no data was written",
+                                       "Open Ephys extension (not part of the NWB schema): row of each ElectricalSeries listed in the series attribute at which the trial stops, one column per series, -1 if no data was written" };
+
+    for (int i = 0; i < columns.size(); i++)
+    {
+        CHECK_ERROR (setAttributeStr (descriptions[i], path + "/" + columns[i], "description"));
+        CHECK_ERROR (setAttributeStr ("hdmf-common", path + "/" + columns[i], "namespace"));
+        CHECK_ERROR (setAttributeStr ("VectorData", path + "/" + columns[i], "neurodata_type"));
+        CHECK_ERROR (setAttributeStr (generateUuid(), path + "/" + columns[i], "object_id"));
+
+        if (i >= 2 && seriesPaths.size() > 0)
+            CHECK_ERROR (setAttributeStrArray (seriesPaths, path + "/" + columns[i], "series"));
+    }
+
+    return true;
+}
+
+void NWBFile::updateTrials (int eventID, const TTLEvent* event)
+{
+    if (trials == nullptr || eventID != trials->eventSeries || event->getLine() != trials->ttlLine)
+        return;
+
+    const TimeSeries* eventSeries = eventDataSets[eventID];
+    const double timestamp = event->getTimestampInSeconds();
+    const int numSeries = jmax (1, continuousDataSets.size());
+
+    if (event->getState())
+    {
+        trials->inInterval = true;
+        trials->startTime = timestamp;
+        trials->startRows.clearQuick();
+
+        for (int i = 0; i < numSeries; i++)
+            trials->startRows.add (getContinuousRow (i, eventSeries, event->getSampleNumber(), timestamp));
+    }
+    else if (trials->inInterval)
+    {
+        Array<int64> stopRows;
+
+        for (int i = 0; i < numSeries; i++)
+            stopRows.add (getContinuousRow (i, eventSeries, event->getSampleNumber(), timestamp));
+
+        writeTrial (timestamp, stopRows);
+    }
+}
+
+void NWBFile::writeTrial (double stopTime, const Array<int64>& stopRows)
+{
+    const int id = trials->numIntervals;
+
+    CHECK_ERROR (journal.writeDataBlock (trials->idDataSet, 1, BaseDataType::I32, &id));
+    CHECK_ERROR (journal.writeDataBlock (trials->startTimeDataSet, 1, BaseDataType::F64, &trials->startTime));
+    CHECK_ERROR (journal.writeDataBlock (trials->stopTimeDataSet, 1, BaseDataType::F64, &stopTime));
+    CHECK_ERROR (journal.writeDataBlock (trials->startRowDataSet, 1, BaseDataType::I64, trials->startRows.getRawDataPointer()));
+    CHECK_ERROR (journal.writeDataBlock (trials->stopRowDataSet, 1, BaseDataType::I64, stopRows.getRawDataPointer()));
+
+    trials->numIntervals++;
+    trials->inInterval = false;
+}
+
+int64 NWBFile::getContinuousRow (int continuousSeries, const TimeSeries* eventSeries, int64 sampleNumber, double timestamp)
+{
+    const ecephys::ElectricalSeries* series = continuousDataSets[continuousSeries];
+
+    if (series == nullptr)
+        return -1;
+
+    // sample numbers are only comparable within a stream; other streams are aligned through synchronized timestamps
+    return eventSeries->alignedSeries == continuousSeries
+               ? series->rows.extrapolateRow (sampleNumber)
+               : series->rows.extrapolateRow (timestamp, series->sampleRate);
+}
+
+bool NWBFile::createUnitsTable()
+{
+    const String path = units->basePath;
+
+    if (createGroup (path))
+        return false;
+
+    StringArray colnames;
+    colnames.add ("spike_times");
+    colnames.add ("electrodes");
+    colnames.add ("sorted_id");
+    CHECK_ERROR (setAttributeStrArray (colnames, path, "colnames"));
+    CHECK_ERROR (setAttributeStr (units->description, path, "description"));
+    CHECK_ERROR (setAttributeStr ("core", path, "namespace"));
+    CHECK_ERROR (setAttributeStr ("Units", path, "neurodata_type"));
+    CHECK_ERROR (setAttributeStr (generateUuid(), path, "object_id"));
+
+    units->idDataSet = createDataSet (BaseDataType::I32, 0, EVENT_CHUNK_SIZE, path + "/id");
+    if (units->idDataSet == nullptr)
+        return false;
+    CHECK_ERROR (setAttributeStr ("hdmf-common", path + "/id", "namespace"));
+    CHECK_ERROR (setAttributeStr ("ElementIdentifiers", path + "/id", "neurodata_type"));
+    CHECK_ERROR (setAttributeStr (generateUuid(), path + "/id", "object_id"));
+
+    // filled from the spike times in arrival order when the file is closed
+    ScopedPointer<HDF5RecordingData> spikeTimesSet = createDataSet (BaseDataType::F64, 0, CHUNK_XSIZE, path + "/spike_times");
+    if (spikeTimesSet == nullptr)
+        return false;
+    setColumnAttributes (path + "/spike_times", "the spike times for each unit", "VectorData");
+
+    ScopedPointer<HDF5RecordingData> spikeTimesIndexSet = createVectorIndex (path + "/spike_times_index", path + "/spike_times", "Index for VectorData 'spike_times'");
+    if (spikeTimesIndexSet == nullptr)
+        return false;
+
+    // both are deleted when this returns, without being written to during recording
+    journal.forget (spikeTimesSet);
+    journal.forget (spikeTimesIndexSet);
+
+    units->electrodesDataSet = createDataSet (BaseDataType::I32, 0, EVENT_CHUNK_SIZE, path + "/electrodes");
+    if (units->electrodesDataSet == nullptr)
+        return false;
+    setColumnAttributes (path + "/electrodes", "the electrodes that each unit was detected on", "DynamicTableRegion");
+    CHECK_ERROR (setAttributeRef ("general/extracellular_ephys/electrodes", path + "/electrodes", "table"));
+
+    units->electrodesIndexDataSet = createVectorIndex (path + "/electrodes_index", path + "/electrodes", "Index for VectorData 'electrodes'");
+    if (units->electrodesIndexDataSet == nullptr)
+        return false;
+
+    units->sortedIdDataSet = createDataSet (BaseDataType::U16, 0, EVENT_CHUNK_SIZE, path + "/sorted_id");
+    if (units->sortedIdDataSet == nullptr)
+        return false;
+    setColumnAttributes (path + "/sorted_id", "the sorted ID of each unit (0 = unsorted spikes of an electrode)", "VectorData");
+
+    // not part of the table, so readers of a file whose recording was interrupted ignore them
+    units->arrivalTimesDataSet = createDataSet (BaseDataType::F64, 0, CHUNK_XSIZE, path + "/" + SpikeTimeGrouper::arrivalTimesName);
+    if (units->arrivalTimesDataSet == nullptr)
+        return false;
+    CHECK_ERROR (setAttributeStr ("spike times (in seconds) in the order they were recorded, grouped into spike_times when the file is closed", path + "/" + SpikeTimeGrouper::arrivalTimesName, "description"));
+
+    units->arrivalUnitsDataSet = createDataSet (BaseDataType::I32, 0, CHUNK_XSIZE, path + "/" + SpikeTimeGrouper::arrivalUnitsName);
+    if (units->arrivalUnitsDataSet == nullptr)
+        return false;
+    CHECK_ERROR (setAttributeStr ("row of the unit of each spike time in " + String (SpikeTimeGrouper::arrivalTimesName), path + "/" + SpikeTimeGrouper::arrivalUnitsName, "description"));
+
+    return true;
+}
+
+void NWBFile::writeUnitSpike (int spikeChannel, uint16 sortedId, double timestamp)
+{
+    if (units == nullptr)
+        return;
+
+    // keys sort by spike channel first, so each electrode's units stay together in the table
+    const int64 key = (int64 (spikeChannel) << 16) | sortedId;
+
+    auto row = units->rows.find (key);
+
+    if (row == units->rows.end())
+    {
+        const int32 id = (int32) units->rows.size();
+        const Array<int>& electrodes = units->getElectrodes (spikeChannel);
+
+        units->numElectrodes += electrodes.size();
+
+        CHECK_ERROR (journal.writeDataBlock (units->idDataSet, 1, BaseDataType::I32, &id));
+        CHECK_ERROR (journal.writeDataBlock (units->sortedIdDataSet, 1, BaseDataType::U16, &sortedId));
+
+        if (electrodes.size() > 0)
+            CHECK_ERROR (journal.writeDataBlock (units->electrodesDataSet, electrodes.size(), BaseDataType::I32, electrodes.getRawDataPointer()));
+
+        CHECK_ERROR (journal.writeDataBlock (units->electrodesIndexDataSet, 1, BaseDataType::U64, &units->numElectrodes));
+
+        row = units->rows.emplace (key, id).first;
+    }
+
+    CHECK_ERROR (journal.writeDataBlock (units->arrivalTimesDataSet, 1, BaseDataType::F64, &timestamp));
+    CHECK_ERROR (journal.writeDataBlock (units->arrivalUnitsDataSet, 1, BaseDataType::I32, &row->second));
+}
+
+bool NWBFile::groupUnitSpikeTimes()
+{
+    SpikeTimeGrouper grouper;
+    bool ok;
+
+    {
+        const ScopedLock lock (getHDF5Lock());
+
+        forgetDataSets (units.get());
+        units->closeDataSets();
+        ok = grouper.open (getFileId(), units->basePath.toStdString());
+    }
+
+    // each window reads the spikes in arrival order once, so the recording thread gets the lock back in between
+    while (ok && ! grouper.isDone())
+    {
+        const ScopedLock lock (getHDF5Lock());
+        ok = grouper.writeNextUnits();
+    }
+
+    const ScopedLock lock (getHDF5Lock());
+
+    // the spike times in arrival order are kept if grouping them failed, for nwb-recover to try again
+    return grouper.close (ok) && ok;
+}
+
+HDF5RecordingData* NWBFile::createVectorIndex (String path, String targetPath, String description)
+{
+    HDF5RecordingData* indexSet = createDataSet (BaseDataType::U64, 0, EVENT_CHUNK_SIZE, path);
+
+    if (indexSet == nullptr)
+    {
+        std::cerr << "Error creating vector index in " << path << std::endl;
+        return nullptr;
+    }
+
+    setColumnAttributes (path, description, "VectorIndex");
+    CHECK_ERROR (setAttributeRef (targetPath, path, "target"));
+
+    return indexSet;
+}
+
+void NWBFile::setColumnAttributes (const String& path, const String& description, const String& neurodataType)
+{
+    CHECK_ERROR (setAttributeStr (description, path, "description"));
+    CHECK_ERROR (setAttributeStr ("hdmf-common", path, "namespace"));
+    CHECK_ERROR (setAttributeStr (neurodataType, path, "neurodata_type"));
+    CHECK_ERROR (setAttributeStr (generateUuid(), path, "object_id"));
+}
+
+int NWBFile::setAttributeStr (const String& value, String path, String name)
+{
+    if (attaching && name != "object_id")
+        return 0;
+
+    if (! cachingAttributeTargets)
+        return NWBFileBase::setAttributeStr (value, path, name);
+
+    const String key = "/" + path.trimCharactersAtStart ("/");
+    auto target = attributeTargets.find (key);
+
+    if (target == attributeTargets.end())
+    {
+        const hid_t object = H5Oopen (getFileId(), key.toRawUTF8(), H5P_DEFAULT);
+
+        if (object < 0)
+            return -1;
+
+        target = attributeTargets.emplace (key, object).first;
+    }
+
+    return writeStringAttribute (target->second, value, name);
+}
+
+void NWBFile::closeAttributeTargets()
+{
+    for (auto& target : attributeTargets)
+        H5Oclose (target.second);
+
+    attributeTargets.clear();
+    cachingAttributeTargets = false;
+}
+
+HDF5RecordingData* NWBFile::createDataSet (BaseDataType type, int sizeX, int chunkX, String path)
+{
+    return journal.declare (attaching ? getDataSet (path) : NWBFileBase::createDataSet (type, sizeX, chunkX, path), path, 1);
+}
+
+HDF5RecordingData* NWBFile::createDataSet (BaseDataType type, int sizeX, int sizeY, int chunkX, String path)
+{
+    return journal.declare (attaching ? getDataSet (path) : NWBFileBase::createDataSet (type, sizeX, sizeY, chunkX, path), path, jmax (1, sizeY));
+}
+
+HDF5RecordingData* NWBFile::createDataSet (BaseDataType type, int sizeX, int sizeY, int sizeZ, int chunkX, String path)
+{
+    return journal.declare (attaching ? getDataSet (path) : NWBFileBase::createDataSet (type, sizeX, sizeY, sizeZ, chunkX, path), path, jmax (1, sizeY) * jmax (1, sizeZ));
+}
+
+HDF5RecordingData* NWBFile::createDataSet (BaseDataType type, int sizeX, int sizeY, int sizeZ, int chunkX, int chunkY, String path)
+{
+    return journal.declare (attaching ? getDataSet (path) : NWBFileBase::createDataSet (type, sizeX, sizeY, sizeZ, chunkX, chunkY, path), path, jmax (1, sizeY) * jmax (1, sizeZ));
+}
+
+void NWBFile::forgetDataSets (TimeSeries* series)
+{
+    if (series == nullptr)
+        return;
+
+    journal.forget (series->baseDataSet);
+    journal.forget (series->timestampDataSet);
+    journal.forget (series->sampleNumberDataSet);
+    journal.forget (series->continuousRowDataSet);
+
+    for (auto dataSet : series->metaDataSet)
+        journal.forget (dataSet);
+
+    if (auto spikes = dynamic_cast<ecephys::SpikeEventSeries*> (series))
+    {
+        journal.forget (spikes->blockStartDataSet);
+        journal.forget (spikes->blockMinTimeDataSet);
+        journal.forget (spikes->blockMaxTimeDataSet);
+        journal.forget (spikes->peakAmplitudeDataSet);
+        journal.forget (spikes->peakChannelDataSet);
+        journal.forget (spikes->troughToPeakDataSet);
+    }
+
+    if (auto ttl = dynamic_cast<TTLEventSeries*> (series))
+        journal.forget (ttl->ttlWordDataSet);
+}
+
+void NWBFile::forgetDataSets (Units* table)
+{
+    if (table == nullptr)
+        return;
+
+    journal.forget (table->idDataSet);
+    journal.forget (table->sortedIdDataSet);
+    journal.forget (table->electrodesDataSet);
+    journal.forget (table->electrodesIndexDataSet);
+    journal.forget (table->arrivalTimesDataSet);
+    journal.forget (table->arrivalUnitsDataSet);
+}
+
+void NWBFile::forgetDataSets (TimeIntervals* table)
+{
+    if (table == nullptr)
+        return;
+
+    journal.forget (table->idDataSet);
+    journal.forget (table->startTimeDataSet);
+    journal.forget (table->stopTimeDataSet);
+    journal.forget (table->startRowDataSet);
+    journal.forget (table->stopRowDataSet);
+}
+
+int NWBFile::createGroup (String path)
+{
+    return attaching ? 0 : NWBFileBase::createGroup (path);
+}
+
+int NWBFile::createReference (String path, String reference)
+{
+    return attaching ? 0 : NWBFileBase::createReference (path, reference);
+}
+
+int NWBFile::setAttribute (BaseDataType type, const void* data, String path, String name)
+{
+    return attaching ? 0 : NWBFileBase::setAttribute (type, data, path, name);
+}
+
+int NWBFile::setAttributeStrArray (const StringArray& values, String path, String name)
+{
+    return attaching ? 0 : NWBFileBase::setAttributeStrArray (values, path, name);
+}
+
+int NWBFile::setAttributeRef (String referencePath, String attributePath, String attributeName)
+{
+    return attaching ? 0 : NWBFileBase::setAttributeRef (referencePath, attributePath, attributeName);
+}
+
+bool NWBFile::restampTemplate()
+{
+    // createFileStructure does not run for an existing file, so its identifiers and times are set here
+    const String time = getTimeString();
+
+    return NWBFileBase::setAttributeStr (identifierText, "/", "object_id") == 0
+           && NWBFileBase::setAttributeStr (generateUuid(), "general/extracellular_ephys/electrodes", "object_id") == 0
+           && rewriteText ("/file_create_date", time)
+           && rewriteText ("/session_start_time", time)
+           && rewriteText ("/timestamps_reference_time", time);
+}
+
+bool NWBFile::createStringColumn (const String& path, const StringArray& values)
+{
+    if (attaching)
+        return true;
+
+    size_t length = 1;
+
+    for (auto& value : values)
+        length = jmax (length, strlen (value.toRawUTF8()) + 1);
+
+    // all values are packed into a single buffer of fixed length strings, as long as the longest one plus the terminator NULLTERM strings need
+    std::vector<char> buffer (length * values.size(), 0);
+
+    for (int i = 0; i < values.size(); i++)
+        memcpy (buffer.data() + i * length, values[i].toRawUTF8(), strlen (values[i].toRawUTF8()));
+
+    const hid_t type = H5Tcopy (H5T_C_S1);
+    H5Tset_size (type, length);
+
+    const bool ok = writeColumn (path, type, values.size(), buffer.data());
+
+    H5Tclose (type);
+
+    return ok;
+}
+
+bool NWBFile::createReferenceColumn (const String& path, const StringArray& targets)
+{
+    if (attaching)
+        return true;
+
+    std::vector<hobj_ref_t> references ((size_t) targets.size());
+    std::map<String, hobj_ref_t> resolved;
+
+    // channels of the same group point to the same object, which is only looked up once
+    for (int i = 0; i < targets.size(); i++)
+    {
+        auto found = resolved.find (targets[i]);
+
+        if (found == resolved.end())
+        {
+            hobj_ref_t reference;
+
+            if (H5Rcreate (&reference, getFileId(), targets[i].toRawUTF8(), H5R_OBJECT, -1) < 0)
+            {
+                std::cerr << "Error creating reference to " << targets[i] << std::endl;
+                return false;
+            }
+
+            found = resolved.emplace (targets[i], reference).first;
+        }
+
+        references[i] = found->second;
+    }
+
+    return writeColumn (path, H5T_STD_REF_OBJ, targets.size(), references.data());
+}
+
+bool NWBFile::writeColumn (const String& path, hid_t type, int numRows, const void* data)
+{
+    if (attaching)
+        return true;
+
+    const hsize_t dims = (hsize_t) numRows;
+    const hid_t space = H5Screate_simple (1, &dims, nullptr);
+
+    /* These datasets never grow, so they are not chunked. Small ones are stored in their
+       object header, and are read along with their attributes when the file is opened */
+    const hid_t dcpl = H5Pcreate (H5P_DATASET_CREATE);
+
+    if (numRows > 0 && H5Tget_size (type) * numRows <= COMPACT_DATASET_SIZE)
+        H5Pset_layout (dcpl, H5D_COMPACT);
+
+    const hid_t dataSet = H5Dcreate2 (getFileId(), path.toRawUTF8(), type, space, H5P_DEFAULT, dcpl, H5P_DEFAULT);
+
+    H5Pclose (dcpl);
+
+    bool ok = dataSet >= 0;
+
+    if (ok && numRows > 0)
+        ok = H5Dwrite (dataSet, type, H5S_ALL, H5S_ALL, H5P_DEFAULT, data) >= 0;
+
+    if (dataSet >= 0)
+        H5Dclose (dataSet);
+
+    H5Sclose (space);
+
+    if (! ok)
+        std::cerr << "Error writing " << path << std::endl;
+
+    return ok;
+}
+
+void NWBFile::createTextDataSet (String path, String name, String text)
+{
+    if (attaching)
+        return;
+
+    ScopedPointer<HDF5RecordingData> dSet;
+
+    if (text.isEmpty())
+        text = " "; //to avoid 0-length strings, which cause errors
+    BaseDataType type = BaseDataType::STR (text.length());
+
+    dSet = createDataSet (type, 1, 0, path + "/" + name);
+    if (! dSet)
+        return;
+    journal.forget (dSet);
+    dSet->writeDataBlock (1, type, text.toUTF8());
+}
+
+void NWBFile::createBinaryDataSet (String path, String name, BaseDataType type, int length, void* data)
+{
+    if (attaching)
+        return;
+
     ScopedPointer<HDF5RecordingData> dSet;
     if ((length < 1) || ! data)
         return;
@@ -919,6 +2551,7 @@ void NWBFile::createBinaryDataSet (String path, String name, BaseDataType type,
     dSet = createDataSet (type, 1, length, 1, path + "/" + name);
     if (! dSet)
         return;
+    journal.forget (dSet);
     dSet->writeDataBlock (1, type, data);
 }
 
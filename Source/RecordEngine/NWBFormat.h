@@ -24,11 +24,16 @@
 #ifndef NWBFORMAT_H
 #define NWBFORMAT_H
 
-#include <HDF5FileFormat.h>
 #include <RecordingLib.h>
 #include <ProcessorHeaders.h>
 
-using namespace OpenEphysHDF5;
+#include "NWBFileSettings.h"
+#include "NWBShardFile.h"
+#include "NWBVirtualSegments.h"
+#include "NWBContinuousRows.h"
+#include "NWBDataSetJournal.h"
+#include "NWBLiveTap.h"
+#include "NWBSpikeTimes.h"
 
 namespace NWBRecording
 {
@@ -65,6 +70,15 @@ public:
     /** Total number of samples written */
     uint64 numSamples = 0;
 
+    /** For event series: holds the row of the aligned continuous series at which each event occurred */
+    ScopedPointer<HDF5RecordingData> continuousRowDataSet;
+
+    /** For event series: index of the continuous series recorded with the same clock (-1 if none) */
+    int alignedSeries = -1;
+
+    /** For event series: sample numbers of events that are not covered by continuous data yet */
+    Array<int64> pendingSampleNumbers;
+
     /** Get neurodata_type */
     virtual String getNeurodataType() { return "TimeSeries"; }
 };
@@ -80,15 +94,6 @@ namespace ecephys
         /** Constructor */
         ElectricalSeries (String rootPath, String name, String description, int channel_count, Array<float> channel_conversion, Array<uint8> channel_type);
 
-        /** Holds the sample number for each sample (relative to the start of acquisition) */
-        ScopedPointer<HDF5RecordingData> channelConversionDataSet;
-
-        /** Holds the channel types */
-        ScopedPointer<HDF5RecordingData> channelTypesDataSet;
-
-        /** Holds the DynamicTableRegion index of each electrode  */
-        ScopedPointer<HDF5RecordingData> electrodeDataSet;
-
         /** Channel conversion values */
         Array<float> channel_conversion;
 
@@ -98,6 +103,30 @@ namespace ecephys
         /** Number of channels to write */
         int channel_count;
 
+        /** Sample rate of all channels */
+        float sampleRate = 0;
+
+        /** Rows of sample numbers written, to align events with them */
+        ContinuousRowMap rows;
+
+        /** Timestamp of the first row of the latest block (timestamps are written before sample numbers) */
+        double blockStartTime = 0;
+
+        /** Raw file the samples are written to, when the data is stored outside of the NWB file */
+        std::unique_ptr<FileOutputStream> rawFile;
+
+        /** Samples of each channel not written to the raw file yet, until every channel has filled their rows */
+        std::vector<std::vector<int16>> rawChannels;
+
+        /** Rows interleaved as they are written to the raw file */
+        std::vector<int16> rawBuffer;
+
+        /** Number of rows written to the raw file */
+        uint64 rawRowsWritten = 0;
+
+        /** True once a write to the raw file failed */
+        bool rawWriteFailed = false;
+
         /** Get neurodata_type */
         virtual String getNeurodataType() override { return "ElectricalSeries"; }
     };
@@ -111,6 +140,33 @@ namespace ecephys
         /** Constructor */
         SpikeEventSeries (String rootPath, String name, String description, int channel_count, Array<float> channel_conversion, Array<uint8> channel_type = {});
 
+        /** Holds the first row of each block of the spike index */
+        ScopedPointer<HDF5RecordingData> blockStartDataSet;
+
+        /** Holds the earliest spike time within each block of the spike index */
+        ScopedPointer<HDF5RecordingData> blockMinTimeDataSet;
+
+        /** Holds the latest spike time within each block of the spike index */
+        ScopedPointer<HDF5RecordingData> blockMaxTimeDataSet;
+
+        /** Holds the peak amplitude (in volts) of each channel for each spike */
+        ScopedPointer<HDF5RecordingData> peakAmplitudeDataSet;
+
+        /** Holds the index of the channel with the largest peak amplitude for each spike */
+        ScopedPointer<HDF5RecordingData> peakChannelDataSet;
+
+        /** Holds the time (in seconds) from trough to peak on the peak channel for each spike */
+        ScopedPointer<HDF5RecordingData> troughToPeakDataSet;
+
+        /** First row of the index block currently being filled */
+        uint64 blockStart = 0;
+
+        /** Earliest spike time within the current index block */
+        double blockMinTime = 0;
+
+        /** Latest spike time within the current index block */
+        double blockMaxTime = 0;
+
         /** Get neurodata_type */
         virtual String getNeurodataType() override { return "SpikeEventSeries"; }
     };
@@ -145,12 +201,114 @@ public:
     virtual String getNeurodataType() override { return "AnnotationSeries"; }
 };
 
+/**
+        Represents an NWB Units table, with a row for each unit (a sorted cluster, or
+        all unsorted spikes of an electrode) added when its first spike is written.
+        Spike times are written as they arrive and grouped by unit when the file is
+        closed (see SpikeTimeGrouper).
+     */
+class Units
+{
+public:
+    /** Constructor */
+    Units (String path, String description);
+
+    /** Holds the ID of each unit */
+    ScopedPointer<HDF5RecordingData> idDataSet;
+
+    /** Holds the sorted ID of each unit (0 if the spikes are unsorted) */
+    ScopedPointer<HDF5RecordingData> sortedIdDataSet;
+
+    /** Holds the electrodes of each unit, and the end of each unit's electrodes */
+    ScopedPointer<HDF5RecordingData> electrodesDataSet;
+    ScopedPointer<HDF5RecordingData> electrodesIndexDataSet;
+
+    /** Holds the time (in seconds) and the unit row of each spike, in the order they arrive */
+    ScopedPointer<HDF5RecordingData> arrivalTimesDataSet;
+    ScopedPointer<HDF5RecordingData> arrivalUnitsDataSet;
+
+    /** Registers the electrodes (global channel indices) of a spike channel */
+    void addSpikeChannel (int spikeChannel, const Array<int>& electrodeInds);
+
+    /** Returns the electrodes of a spike channel */
+    const Array<int>& getElectrodes (int spikeChannel) const { return electrodes.getReference (spikeChannel); }
+
+    /** Closes the datasets, before the spike times are grouped */
+    void closeDataSets();
+
+    /** Row of each unit, keyed by spike channel and sorted ID */
+    std::map<int64, int32> rows;
+
+    /** Number of electrodes written, the end of the last row of the electrodes index */
+    uint64 numElectrodes = 0;
+
+    /** The path to this table within the NWB file */
+    String basePath;
+
+    /** The description of this table */
+    String description;
+
+private:
+    /** Electrodes of each spike channel */
+    Array<Array<int>> electrodes;
+};
+
+/**
+        Represents an NWB TimeIntervals table (e.g. trials) whose rows are
+        delimited by the rising and falling edges of a TTL line
+     */
+class TimeIntervals
+{
+public:
+    /** Constructor */
+    TimeIntervals (String path, String description, int eventSeries, int ttlLine);
+
+    /** Holds the ID of each interval */
+    ScopedPointer<HDF5RecordingData> idDataSet;
+
+    /** Holds the start time (in seconds) of each interval */
+    ScopedPointer<HDF5RecordingData> startTimeDataSet;
+
+    /** Holds the stop time (in seconds) of each interval */
+    ScopedPointer<HDF5RecordingData> stopTimeDataSet;
+
+    /** Holds the row of each continuous series at which each interval starts */
+    ScopedPointer<HDF5RecordingData> startRowDataSet;
+
+    /** Holds the row of each continuous series at which each interval stops */
+    ScopedPointer<HDF5RecordingData> stopRowDataSet;
+
+    /** Index of the TTL event series that defines the intervals */
+    const int eventSeries;
+
+    /** TTL line (0-based) that defines the intervals */
+    const int ttlLine;
+
+    /** True between a rising edge and the next falling edge */
+    bool inInterval = false;
+
+    /** Start time of the current interval */
+    double startTime = 0;
+
+    /** Start row of the current interval in each continuous series */
+    Array<int64> startRows;
+
+    /** Number of intervals written */
+    int numIntervals = 0;
+
+    /** The path to this table within the NWB file */
+    String basePath;
+
+    /** The description of this table */
+    String description;
+};
+
 /**
         
         Represents an NWB 2.0 File (a specific type of HDF5 file)
             
      */
-class NWBFile : public HDF5FileBase
+class NWBFile : public NWBFileBase
 {
 public:
     /** Constructor */
@@ -159,6 +317,19 @@ public:
     /** Destructor */
     ~NWBFile();
 
+    /** Selects the file driver, format and layout used from the next call to open(), for this file and its shards */
+    void setFileSettings (const FileSettings& settings);
+
+    /** Publishes the converted samples of each continuous stream to a live tap (indexed like the streams, null for none) */
+    void setLiveTaps (const Array<LiveTap*>& taps);
+
+    /** Creates the file as a copy of a template (see closeAsTemplate) written with the same settings and channels.
+        startNewRecording then opens the datasets of the template instead of creating them. */
+    void setTemplate (const String& templatePath);
+
+    /** Opens the file with the selected file driver */
+    int open (int nChans);
+
     /** Creates the groups required for a new recording, given an array of continuous channels, event channels, and spike channels*/
     bool startNewRecording (int recordingNumber,
                             const Array<ContinuousGroup>& continuousArray,
@@ -166,9 +337,41 @@ public:
                             const Array<const EventChannel*>& eventArray,
                             const Array<const SpikeChannel*>& electrodeArray);
 
+    /** Sets the TTL line (1-based, 0 to disable) whose pulses define trials, and the stream it is taken from (empty for the first TTL stream) */
+    void setTrialRule (int ttlLine, String streamName);
+
     /** Writes the num_samples value and closes the relevent datasets */
     void stopRecording();
 
+    /** Writes the tables that are built during recording (e.g. units) and closes the file. Returns false if any of it failed */
+    bool close() override;
+
+    /** Closes a file that was never recorded into, without the tables that are written when recording ends, to be used as a template */
+    bool closeAsTemplate();
+
+    /** Starts a checkpoint: writes the number of samples of each series so far, and sets up a flush of this
+        file and its shards in short steps, so that the HDF5 lock can be released between them */
+    void beginCheckpoint();
+
+    /** Flushes the cached chunks and metadata of the next open dataset or, once a file has none left, the rest
+        of its metadata, so that the file on disk is readable up to this point and the recording thread finds
+        clean entries to evict. Called with the HDF5 lock held; returns false once the files are flushed */
+    bool flushNextStep();
+
+    /** Hands the journal over to the operating system, and returns a duplicate of its descriptor to sync it
+        without the HDF5 lock held (see JournalWriter::syncDuplicate), or -1 if there is no journal */
+    int duplicateJournal();
+
+    /** Adds the checkpoint, which took seconds with the HDF5 lock held for at most longestHold at once, to the
+        statistics reported when the file closes. Returns false if any step failed */
+    bool endCheckpoint (double seconds, double longestHold);
+
+    /** Hands the journaled data over to the operating system, once a block of data is written */
+    void flushJournal();
+
+    /** Lock that must be held around HDF5 calls when several files are open in different threads (HDF5 is not thread-safe) */
+    static CriticalSection& getHDF5Lock();
+
     /** Writes continuous data for a particular channel */
     void writeData (int datasetID, int channel, int nSamples, const float* data, float bitVolts);
 
@@ -178,15 +381,6 @@ public:
     /** Writes sample numbers for a particular continuous dataset */
     void writeSampleNumbers (int datasetID, int nSamples, const int64* data);
 
-    /** Writes electrode numbers for a continuous dataset */
-    void writeElectrodes (ecephys::ElectricalSeries* electricalSeries, Array<int> electrodeInds);
-
-    /** Writes channel conversion values */
-    void writeChannelConversions (ecephys::ElectricalSeries* series);
-
-    /** Writes channel types */
-    void writeChannelTypes (ecephys::ElectricalSeries* series);
-
     /** Writes a spike event*/
     void writeSpike (int electrodeId, const SpikeChannel* channel, const Spike* event);
 
@@ -202,22 +396,32 @@ public:
     /** Returns the name of this NWB file */
     String getFileName() override;
 
+    /** Returns the total size of this file and its shards, in bytes */
+    int64 getFileSize();
+
+    /** Returns the rows written so far to the continuous and TTL series, to map this file into a master file */
+    VirtualSegment getVirtualSegment();
+
+    /** Replaces the continuous, event, spike and text series by virtual datasets that concatenate the finished segments
+        and the current segment file, which is mapped as it grows, and removes the objects only found in segments (units,
+        trials, spike indexes and features, continuous rows). The series of this file cannot be written afterwards. */
+    bool makeVirtual (const Array<VirtualSegment>& segments, const String& currentSegment);
+
+    /** Sets the creation and session start times of a file created ahead of recording to now */
+    bool restamp();
+
+    /** Renames a file prepared ahead of recording and sets its creation and session start times to now.
+        The file must not have shards, raw data files or stripes, whose names are derived from its own. */
+    bool moveTo (const String& newName);
+
     /** Generate a new uuid string*/
     String generateUuid();
 
-	protected:
-	protected:
-        
 protected:
-        
     /** Initializes the default groups */
     int createFileStructure() override;
 
-	private:
-	private:
-
 private:
-
     /** Creates a new dataset to hold text data (messages) */
     void createTextDataSet (String path, String name, String text);
 
@@ -236,20 +440,94 @@ private:
     /** Creates dataset attributes */
     bool createExtraInfo (String basePath, String name, String desc, String id, uint16 index, uint16 typeIndex);
 
-    /** Creates a dataset of synchronized timestamps (interval = 1/sample_rate) */
-    HDF5RecordingData* createTimestampDataSet (String basePath, int chunk_size, float interval);
+    /** Creates a dataset of synchronized timestamps (interval = 1/sample_rate), optionally in a shard */
+    HDF5RecordingData* createTimestampDataSet (String basePath, int chunk_size, float interval, NWBShardFile* shard = nullptr);
+
+    /** Creates a dataset of sample numbers, optionally in a shard */
+    HDF5RecordingData* createSampleNumberDataSet (String basePath, int chunk_size, NWBShardFile* shard = nullptr);
+
+    /** Creates a dataset in a shard, linked from path in this file, and declares it to the journal */
+    HDF5RecordingData* createLinkedDataSet (NWBShardFile* shard, BaseDataType type, int sizeY, int chunkX, String path);
+
+    /** Creates the data dataset of a continuous series, stored externally in a raw file */
+    bool createRawDataSet (ecephys::ElectricalSeries* series, const String& groupName, const String& path);
+
+    /** Copies a channel of the current block into the raw buffer of a series, and writes the block once all channels are copied */
+    void writeRawData (ecephys::ElectricalSeries* series, int channel, int nSamples);
+
+    /** Switches this file and its shards to SWMR mode, once all objects are created */
+    bool startSWMRWrite();
+
+    /** Reopens a growing dataset so that it is flushed each time it grows by a chunk */
+    bool setAppendFlush (ScopedPointer<HDF5RecordingData>& dataSet, hid_t location, const String& path);
+
+    /** Returns the current time, formatted as an ISO 8601 string with the UTC offset */
+    static String getTimeString();
+
+    /** Overwrites a fixed or variable length string dataset */
+    bool rewriteText (const String& path, const String& text);
+
+    /** Returns the HDF5 identifiers of the open datasets of a file, in increasing order */
+    static std::vector<hid_t> getOpenDataSetIds (hid_t fileId);
+
+    /** Creates and writes the electrode index of each channel */
+    bool createElectrodeDataSet (String path, String description, const Array<int>& electrodes);
+
+    /** Creates and writes the conversion (bit volts) of each channel */
+    bool createChannelConversionDataSet (String path, String description, const Array<float>& conversions);
+
+    /** Creates and writes the type of each channel */
+    bool createChannelTypesDataSet (String path, String description, const Array<uint8>& types);
+
+    /** Writes a string attribute, reusing the handle of its object while attribute targets are cached */
+    int setAttributeStr (const String& value, String path, String name) override;
+
+    /* While a recording is started in a copy of a template, objects are opened instead of created and
+       the attributes already in the template are not written again, except object_id, which must be unique.
+       Created datasets are declared to the journal. */
+    HDF5RecordingData* createDataSet (BaseDataType type, int sizeX, int chunkX, String path) override;
+    HDF5RecordingData* createDataSet (BaseDataType type, int sizeX, int sizeY, int chunkX, String path) override;
+    HDF5RecordingData* createDataSet (BaseDataType type, int sizeX, int sizeY, int sizeZ, int chunkX, String path) override;
+    HDF5RecordingData* createDataSet (BaseDataType type, int sizeX, int sizeY, int sizeZ, int chunkX, int chunkY, String path) override;
+    int createGroup (String path) override;
+    int createReference (String path, String reference) override;
+    int setAttribute (BaseDataType type, const void* data, String path, String name) override;
+    int setAttributeStrArray (const StringArray& values, String path, String name) override;
+    int setAttributeRef (String referencePath, String attributePath, String attributeName) override;
+
+    /** Flushes this file and its shards */
+    bool flushFiles();
+
+    /** Flushes this file and its shards and copies them, as they are on disk, to their base images (see
+        JournalWriter::basePath), which nwb-recover replays the journal into */
+    bool writeBaseImages();
 
-    /** Creates a dataset of sample numbers */
-    HDF5RecordingData* createSampleNumberDataSet (String basePath, int chunk_size);
+    /** Deletes the base images of this file and its shards */
+    void removeBaseImages();
 
-    /** Creates a dataset for electrode indices */
-    HDF5RecordingData* createElectrodeDataSet (String basePath, String description, int chunk_size);
+    /** Writes the num_samples attribute of each series, and sets the size of the datasets stored in raw data files */
+    void writeSampleCounts();
 
-    /** Creates a dataset for electrode indices */
-    HDF5RecordingData* createChannelConversionDataSet (String basePath, String description, int chunk_size);
+    /** Drops the journal entries of the datasets of a series or a table about to be deleted */
+    void forgetDataSets (TimeSeries* series);
+    void forgetDataSets (Units* table);
+    void forgetDataSets (TimeIntervals* table);
 
-    /** Creates a dataset for channel types */
-    HDF5RecordingData* createChannelTypesDataSet (String basePath, String description, int chunk_size);
+    /** Gives the objects copied from a template new identifiers and creation times */
+    bool restampTemplate();
+
+    /** Closes the objects kept open for attribute writes, and stops caching them */
+    void closeAttributeTargets();
+
+    /** Keeps the objects that string attributes are written to open while it exists, so that
+        the many attributes of each object do not each open it again by path */
+    struct AttributeTargetCache
+    {
+        AttributeTargetCache (NWBFile& file_) : file (file_) { file.cachingAttributeTargets = true; }
+        ~AttributeTargetCache() { file.closeAttributeTargets(); }
+
+        NWBFile& file;
+    };
 
     /** Adds attributes (e.g. conversion, resolution) to a continuous dataset */
     void createDataAttributes (String basePath, float conversion, float resolution, String unit);
@@ -263,7 +541,67 @@ private:
     /** Writes metadata associated with an event*/
     void writeEventMetadata (TimeSeries* timeSeries, const MetadataEventObject* info, const MetadataEvent* event);
 
-    const String filename;
+    /** Creates the datasets of the time index of a spike series */
+    bool createSpikeIndex (ecephys::SpikeEventSeries* series);
+
+    /** Adds a spike time to the current block of a spike series' index */
+    void updateSpikeIndex (ecephys::SpikeEventSeries* series, double timestamp);
+
+    /** Writes the current (possibly partial) block of a spike series' index */
+    void writeSpikeIndexBlock (ecephys::SpikeEventSeries* series);
+
+    /** Creates the datasets holding the waveform features of a spike series */
+    bool createSpikeFeatures (ecephys::SpikeEventSeries* series);
+
+    /** Computes and writes the waveform features of a spike */
+    void writeSpikeFeatures (ecephys::SpikeEventSeries* series, const SpikeChannel* channel, const Spike* event);
+
+    /** Creates the dataset mapping each event of an event series to a row of the continuous series with the same stream */
+    bool createContinuousRowDataSet (TimeSeries* eventSeries, int continuousSeries);
+
+    /** Queues the continuous row of an event to be written once the continuous data covering it is written */
+    void writeContinuousRow (TimeSeries* eventSeries, int64 sampleNumber);
+
+    /** Writes the continuous rows of pending events (all of them if force is true) */
+    void flushContinuousRows (TimeSeries* eventSeries, bool force = false);
+
+    /** Creates the trials table if a trial rule is set */
+    bool createTrialsTable (const Array<const EventChannel*>& eventArray);
+
+    /** Starts or ends a trial if a TTL event matches the trial rule */
+    void updateTrials (int eventID, const TTLEvent* event);
+
+    /** Writes the open trial to the trials table, ending at stopTime and the given row of each continuous series */
+    void writeTrial (double stopTime, const Array<int64>& stopRows);
+
+    /** Returns the row of a continuous series corresponding to an event of an event series */
+    int64 getContinuousRow (int continuousSeries, const TimeSeries* eventSeries, int64 sampleNumber, double timestamp);
+
+    /** Creates the Units table, whose rows are added as spikes of new units are written */
+    bool createUnitsTable();
+
+    /** Adds a spike to the Units table, and the row of its unit if it is the first spike of the unit */
+    void writeUnitSpike (int spikeChannel, uint16 sortedId, double timestamp);
+
+    /** Groups the spike times of the Units table by unit, taking the HDF5 lock for each window of units */
+    bool groupUnitSpikeTimes();
+
+    /** Creates a column of strings, written at once with a fixed length type as long as the longest value */
+    bool createStringColumn (const String& path, const StringArray& values);
+
+    /** Creates a column of object references, written at once */
+    bool createReferenceColumn (const String& path, const StringArray& targets);
+
+    /** Creates a one-dimensional dataset of numRows rows and writes all of them */
+    bool writeColumn (const String& path, hid_t type, int numRows, const void* data);
+
+    /** Creates an empty VectorIndex dataset pointing to the VectorData at targetPath */
+    HDF5RecordingData* createVectorIndex (String path, String targetPath, String description);
+
+    /** Writes the description, namespace, neurodata_type and object_id of a column of a table */
+    void setColumnAttributes (const String& path, const String& description, const String& neurodataType);
+
+    String filename;
     const String GUIVersion;
 
     OwnedArray<ecephys::ElectricalSeries> continuousDataSets;
@@ -271,10 +609,44 @@ private:
     OwnedArray<TTLEventSeries> eventDataSets;
     std::unique_ptr<AnnotationSeries> messagesDataSet;
     std::unique_ptr<AnnotationSeries> syncMsgDataSet;
+    std::unique_ptr<Units> units;
+    std::unique_ptr<TimeIntervals> trials;
+
+    int trialTTLLine = 0;
+    String trialStreamName;
+
+    FileSettings settings;
+
+    OwnedArray<NWBShardFile> shards;
+
+    Array<LiveTap*> liveTaps;
+
+    String templatePath;
+    bool attaching = false;
+
+    bool cachingAttributeTargets = false;
+    std::map<String, hid_t> attributeTargets;
+
+    bool swmrWriting = false;
+
+    DataSetJournal journal;
+
+    /** Number of checkpoints, their total and longest duration in seconds, and the longest time any of them held the HDF5 lock at once */
+    int numCheckpoints = 0;
+    double checkpointSeconds = 0;
+    double longestCheckpoint = 0;
+    double longestCheckpointHold = 0;
+
+    /** File being flushed by flushNextStep() (0 for this one, then the shards) and the last dataset flushed in it */
+    size_t flushFileIndex = 0;
+    hid_t lastFlushedDataSet = -1;
+    bool flushFailed = false;
+    int numOpenChannels = -1;
 
     const String identifierText;
 
     HeapBlock<float> scaledBuffer;
+    HeapBlock<float> featureBuffer;
     HeapBlock<int16> intBuffer;
     size_t bufferSize;
 
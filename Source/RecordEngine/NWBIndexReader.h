@@ -0,0 +1,338 @@
+/*
+    ------------------------------------------------------------------
+
+    This file is part of the Open Ephys GUI
+    Copyright (C) 2024 Open Ephys
+
+    ------------------------------------------------------------------
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef NWBINDEXREADER_H
+#define NWBINDEXREADER_H
+
+#include <hdf5.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace NWBRecording
+{
+
+/**
+        Uses the indexes the record engine writes next to the data of an NWB file
+        (see the extensions to the NWB schema in the README) to locate data without
+        scanning whole datasets.
+
+        Header-only, as nothing in the plugin reads spikes or aligned windows back:
+        analysis tools can include it with the HDF5 C library alone.
+     */
+class IndexReader
+{
+public:
+    /** Constructor, the file stays owned by the caller */
+    explicit IndexReader (hid_t file_) : file (file_) {}
+
+    /** Finds the rows [first, last) of a SpikeEventSeries (e.g. "/acquisition/<name>") with spike times in
+        [startTime, stopTime), reading the spike_index blocks and the timestamps of the matching blocks only.
+        Each series holds the spikes of a single electrode, so the electrode of a query is chosen by its series.
+        Spike times within a series are assumed to be in increasing order. */
+    bool findSpikes (const std::string& seriesPath, double startTime, double stopTime, uint64_t& first, uint64_t& last) const
+    {
+        if (! exists (seriesPath + "/timestamps"))
+            return false;
+
+        const uint64_t numSpikes = getLength (seriesPath + "/timestamps");
+
+        first = 0;
+        last = numSpikes;
+
+        const std::string index = seriesPath + "/spike_index";
+        const uint64_t numBlocks = exists (index + "/block_start") ? getLength (index + "/block_start") : 0;
+
+        if (numBlocks > 0)
+        {
+            std::vector<uint64_t> starts (numBlocks);
+            std::vector<double> minTimes (numBlocks);
+            std::vector<double> maxTimes (numBlocks);
+
+            if (! readRows (index + "/block_start", H5T_NATIVE_UINT64, 0, numBlocks, starts.data())
+                || ! readRows (index + "/block_min_time", H5T_NATIVE_DOUBLE, 0, numBlocks, minTimes.data())
+                || ! readRows (index + "/block_max_time", H5T_NATIVE_DOUBLE, 0, numBlocks, maxTimes.data()))
+                return false;
+
+            /* Block i spans rows [starts[i], starts[i + 1]). The last block is extended to the end of
+               the series, since spikes written after it (e.g. while still recording) are not indexed yet */
+            uint64_t firstBlock = 0;
+
+            while (firstBlock < numBlocks - 1 && maxTimes[firstBlock] < startTime)
+                firstBlock++;
+
+            uint64_t lastBlock = numBlocks - 1;
+
+            while (lastBlock > firstBlock && minTimes[lastBlock] >= stopTime)
+                lastBlock--;
+
+            first = std::min (starts[firstBlock], numSpikes);
+            last = lastBlock == numBlocks - 1 ? numSpikes : std::min (starts[lastBlock + 1], numSpikes);
+        }
+
+        if (last <= first)
+        {
+            last = first;
+            return true;
+        }
+
+        // the candidate blocks are narrowed down with their own timestamps
+        std::vector<double> timestamps (last - first);
+
+        if (! readRows (seriesPath + "/timestamps", H5T_NATIVE_DOUBLE, first, last - first, timestamps.data()))
+            return false;
+
+        const uint64_t start = first + uint64_t (std::lower_bound (timestamps.begin(), timestamps.end(), startTime) - timestamps.begin());
+        const uint64_t stop = first + uint64_t (std::lower_bound (timestamps.begin(), timestamps.end(), stopTime) - timestamps.begin());
+
+        first = start;
+        last = std::max (start, stop);
+
+        return true;
+    }
+
+    /** Reads the waveforms (int16, rows x channels x samples) and timestamps of the rows [first, last) of a SpikeEventSeries */
+    bool readSpikes (const std::string& seriesPath, uint64_t first, uint64_t last, int16_t* waveforms, double* timestamps) const
+    {
+        if (last <= first)
+            return true;
+
+        return readRows (seriesPath + "/data", H5T_NATIVE_INT16, first, last - first, waveforms)
+               && readRows (seriesPath + "/timestamps", H5T_NATIVE_DOUBLE, first, last - first, timestamps);
+    }
+
+    /** Reads the continuous_row dataset of a TTL or text event series, along with the path of the
+        ElectricalSeries its rows refer to (its "series" attribute) */
+    bool readContinuousRows (const std::string& eventSeriesPath, std::vector<int64_t>& rows, std::string& continuousSeriesPath) const
+    {
+        const std::string path = eventSeriesPath + "/continuous_row";
+
+        if (! exists (path))
+            return false;
+
+        rows.resize (getLength (path));
+
+        if (! rows.empty() && ! readRows (path, H5T_NATIVE_INT64, 0, rows.size(), rows.data()))
+            return false;
+
+        // the "series" attribute is an object reference to the aligned ElectricalSeries
+        hobj_ref_t reference;
+        bool ok = false;
+
+        const hid_t attribute = H5Aopen_by_name (file, path.c_str(), "series", H5P_DEFAULT, H5P_DEFAULT);
+
+        if (attribute < 0)
+            return false;
+
+        if (H5Aread (attribute, H5T_STD_REF_OBJ, &reference) >= 0)
+        {
+            const hid_t series = H5Rdereference2 (file, H5P_DEFAULT, H5R_OBJECT, &reference);
+
+            if (series >= 0)
+            {
+                const ssize_t length = H5Iget_name (series, nullptr, 0);
+
+                if (length > 0)
+                {
+                    std::vector<char> name (size_t (length) + 1);
+                    H5Iget_name (series, name.data(), name.size());
+                    continuousSeriesPath = name.data();
+                    ok = true;
+                }
+
+                H5Oclose (series);
+            }
+        }
+
+        H5Aclose (attribute);
+
+        return ok;
+    }
+
+    /** Reads the windows [row - samplesBefore, row + samplesAfter) of an ElectricalSeries around each of rows
+        (e.g. the continuous_row of a set of events) into buffer, one window (samples x channels) after the other
+        in the order of rows. Windows that do not fit inside the data are left filled with zeros.
+
+        Windows are read in batches of non-overlapping hyperslabs, one HDF5 read per batch, instead of one read
+        per window. */
+    bool readAlignedWindows (const std::string& continuousSeriesPath, const std::vector<int64_t>& rows, int samplesBefore, int samplesAfter, int16_t* buffer) const
+    {
+        const int windowLength = samplesBefore + samplesAfter;
+
+        if (rows.empty() || windowLength <= 0)
+            return true;
+
+        const std::string path = continuousSeriesPath + "/data";
+
+        if (! exists (path))
+            return false;
+
+        const hid_t dataSet = H5Dopen2 (file, path.c_str(), H5P_DEFAULT);
+
+        if (dataSet < 0)
+            return false;
+
+        const hid_t space = H5Dget_space (dataSet);
+        hsize_t dims[2] = { 0, 0 };
+
+        if (H5Sget_simple_extent_ndims (space) != 2)
+        {
+            H5Sclose (space);
+            H5Dclose (dataSet);
+            return false;
+        }
+
+        H5Sget_simple_extent_dims (space, dims, nullptr);
+
+        const hsize_t numChannels = dims[1];
+        const size_t windowSize = size_t (windowLength) * numChannels;
+
+        std::fill (buffer, buffer + windowSize * rows.size(), int16_t (0));
+
+        /* HDF5 fills a combined selection in file order, so windows are read sorted by row.
+           Overlapping windows would be merged by the selection, so they end a batch. */
+        std::vector<size_t> order;
+
+        for (size_t i = 0; i < rows.size(); i++)
+        {
+            if (rows[i] - samplesBefore >= 0 && rows[i] + samplesAfter <= int64_t (dims[0]))
+                order.push_back (i);
+        }
+
+        std::sort (order.begin(), order.end(), [&rows] (size_t a, size_t b)
+                   { return rows[a] < rows[b]; });
+
+        std::vector<int16_t> batchBuffer (windowSize * std::max<size_t> (1, order.size()));
+        bool ok = true;
+
+        size_t batchStart = 0;
+
+        while (ok && batchStart < order.size())
+        {
+            size_t batchEnd = batchStart + 1;
+
+            while (batchEnd < order.size() && rows[order[batchEnd]] - rows[order[batchEnd - 1]] >= windowLength)
+                batchEnd++;
+
+            H5Sselect_none (space);
+
+            for (size_t i = batchStart; i < batchEnd; i++)
+            {
+                hsize_t count[2] = { hsize_t (windowLength), numChannels };
+                hsize_t offset[2] = { hsize_t (rows[order[i]] - samplesBefore), 0 };
+
+                H5Sselect_hyperslab (space, H5S_SELECT_OR, offset, nullptr, count, nullptr);
+            }
+
+            hsize_t memDims[2] = { hsize_t (windowLength) * (batchEnd - batchStart), numChannels };
+            const hid_t memSpace = H5Screate_simple (2, memDims, nullptr);
+
+            ok = H5Dread (dataSet, H5T_NATIVE_INT16, memSpace, space, H5P_DEFAULT, batchBuffer.data()) >= 0;
+            H5Sclose (memSpace);
+
+            for (size_t i = batchStart; ok && i < batchEnd; i++)
+                std::copy (batchBuffer.begin() + (i - batchStart) * windowSize,
+                           batchBuffer.begin() + (i - batchStart + 1) * windowSize,
+                           buffer + order[i] * windowSize);
+
+            batchStart = batchEnd;
+        }
+
+        H5Sclose (space);
+        H5Dclose (dataSet);
+
+        return ok;
+    }
+
+private:
+    /** Returns true if a link exists at path, along with all the groups leading to it */
+    bool exists (const std::string& path) const
+    {
+        for (size_t separator = path.find ('/', 1); separator != std::string::npos; separator = path.find ('/', separator + 1))
+        {
+            if (H5Lexists (file, path.substr (0, separator).c_str(), H5P_DEFAULT) <= 0)
+                return false;
+        }
+
+        return H5Lexists (file, path.c_str(), H5P_DEFAULT) > 0;
+    }
+
+    /** Returns the number of rows of a dataset, 0 if it cannot be opened */
+    uint64_t getLength (const std::string& path) const
+    {
+        const hid_t dataSet = H5Dopen2 (file, path.c_str(), H5P_DEFAULT);
+
+        if (dataSet < 0)
+            return 0;
+
+        const hid_t space = H5Dget_space (dataSet);
+        hsize_t dims[3] = { 0, 0, 0 };
+
+        if (H5Sget_simple_extent_ndims (space) > 0)
+            H5Sget_simple_extent_dims (space, dims, nullptr);
+
+        H5Sclose (space);
+        H5Dclose (dataSet);
+
+        return dims[0];
+    }
+
+    /** Reads count whole rows of a dataset of up to three dimensions, starting at row start */
+    bool readRows (const std::string& path, hid_t type, uint64_t start, uint64_t count, void* buffer) const
+    {
+        const hid_t dataSet = H5Dopen2 (file, path.c_str(), H5P_DEFAULT);
+
+        if (dataSet < 0)
+            return false;
+
+        const hid_t space = H5Dget_space (dataSet);
+        const int rank = H5Sget_simple_extent_ndims (space);
+
+        hsize_t dims[3] = { 0, 1, 1 };
+        hsize_t offset[3] = { start, 0, 0 };
+        bool ok = rank >= 1 && rank <= 3 && H5Sget_simple_extent_dims (space, dims, nullptr) == rank && start + count <= dims[0];
+
+        if (ok)
+        {
+            hsize_t rows[3] = { count, dims[1], dims[2] };
+            H5Sselect_hyperslab (space, H5S_SELECT_SET, offset, nullptr, rows, nullptr);
+
+            const hid_t memSpace = H5Screate_simple (rank, rows, nullptr);
+            ok = H5Dread (dataSet, type, memSpace, space, H5P_DEFAULT, buffer) >= 0;
+            H5Sclose (memSpace);
+        }
+
+        H5Sclose (space);
+        H5Dclose (dataSet);
+
+        return ok;
+    }
+
+    hid_t file;
+};
+
+} // namespace NWBRecording
+
+#endif
@@ -0,0 +1,317 @@
+/*
+    ------------------------------------------------------------------
+
+    This file is part of the Open Ephys GUI
+    Copyright (C) 2024 Open Ephys
+
+    ------------------------------------------------------------------
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef NWBJOURNAL_H
+#define NWBJOURNAL_H
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+namespace NWBRecording
+{
+
+/**
+        Header of a record of a recovery journal
+
+        A journal (<file>.journal) starts with the 8 byte magic "NWBJRNL2" and is
+        followed by records, each made of this header and payloadSize bytes:
+
+            DATASET  declares that dataSet is the dataset at the path in the payload
+            ROWS     numRows rows of dataSet starting at firstRow, in the native
+                     layout of elementType. column is the column written for a
+                     single channel, or -1 for whole rows.
+
+        Records are appended in the order the data is written to the NWB file, and
+        replayed into the base image of the file (<file>.base), a copy taken once its
+        structure is written. checksum is the FNV-1a hash of the header, with
+        checksum set to 0, followed by the payload.
+     */
+struct JournalRecord
+{
+    /** Kinds of records */
+    enum Kind : uint32_t
+    {
+        DATASET = 1,
+        ROWS = 2
+    };
+
+    /** Types of the elements of ROWS records */
+    enum ElementType : uint32_t
+    {
+        U8,
+        U16,
+        U32,
+        U64,
+        I8,
+        I16,
+        I32,
+        I64,
+        F32,
+        F64,
+        STR
+    };
+
+    /** Identifies the start of a record, to find where a journal cut short by a crash ends */
+    static constexpr uint32_t recordMagic = 0x4e57424a;
+
+    uint32_t magic = recordMagic;
+    uint32_t kind = DATASET;
+    uint32_t dataSet = 0;
+    int32_t column = -1;
+    int64_t firstRow = 0;
+    uint32_t numRows = 0;
+    uint32_t elementType = U8;
+    uint32_t elementSize = 0;
+    uint32_t payloadSize = 0;
+    uint32_t checksum = 0;
+
+    /** Keeps the header free of padding, so that it can be hashed as it is */
+    uint32_t reserved = 0;
+
+    /** Returns the checksum of this header and its payload */
+    uint32_t computeChecksum (const void* payload) const
+    {
+        JournalRecord header = *this;
+        header.checksum = 0;
+
+        return hash (payload, payloadSize, hash (&header, sizeof (header), 2166136261u));
+    }
+
+    /** Continues an FNV-1a hash over size bytes */
+    static uint32_t hash (const void* data, size_t size, uint32_t value)
+    {
+        const unsigned char* bytes = static_cast<const unsigned char*> (data);
+
+        for (size_t i = 0; i < size; i++)
+            value = (value ^ bytes[i]) * 16777619u;
+
+        return value;
+    }
+};
+
+static_assert (sizeof (JournalRecord) == 48, "journal records are hashed and written without padding");
+
+/**
+        Appends records to a recovery journal
+
+        Records are buffered and reach the operating system in large sequential
+        writes; flush() hands the buffer over, and sync() also waits for the disk.
+
+        Header-only so that it can be shared by the record engine and the tools.
+     */
+class JournalWriter
+{
+public:
+    /** Destructor, leaves the journal in place */
+    ~JournalWriter() { close (false); }
+
+    /** Returns the path of the journal of a file */
+    static std::string journalPath (const std::string& filePath)
+    {
+        return filePath + ".journal";
+    }
+
+    /** Returns the path of the base image of a file or of one of its shards, which the journal is replayed into */
+    static std::string basePath (const std::string& filePath)
+    {
+        return filePath + ".base";
+    }
+
+    /** Creates the journal, replacing any existing one */
+    bool open (const std::string& path)
+    {
+        close (false);
+
+        file = fopen (path.c_str(), "wb");
+
+        if (file == nullptr)
+            return false;
+
+        setvbuf (file, nullptr, _IOFBF, bufferSize);
+        fileName = path;
+
+        return fwrite ("NWBJRNL2", 1, 8, file) == 8;
+    }
+
+    /** Returns true if the journal is open */
+    bool isOpen() const { return file != nullptr; }
+
+    /** Writes a record and its payload, with its checksum */
+    bool write (const JournalRecord& record, const void* payload)
+    {
+        if (file == nullptr)
+            return false;
+
+        JournalRecord header = record;
+        header.checksum = record.computeChecksum (payload);
+
+        return fwrite (&header, sizeof (header), 1, file) == 1
+               && (record.payloadSize == 0 || fwrite (payload, record.payloadSize, 1, file) == 1);
+    }
+
+    /** Hands the buffered records over to the operating system, so they survive a crash of this process */
+    bool flush()
+    {
+        return file == nullptr || fflush (file) == 0;
+    }
+
+    /** Writes the buffered records to the disk, so they survive a power loss */
+    bool sync()
+    {
+        if (file == nullptr || fflush (file) != 0)
+            return file == nullptr;
+
+#ifdef _WIN32
+        return _commit (_fileno (file)) == 0;
+#else
+        return fsync (fileno (file)) == 0;
+#endif
+    }
+
+    /** Hands the buffered records over to the operating system and returns a duplicate of the descriptor of the
+        journal, for syncDuplicate() to wait for the disk while the journal goes on being written. Returns -1 on failure */
+    int duplicate()
+    {
+        if (file == nullptr || fflush (file) != 0)
+            return -1;
+
+#ifdef _WIN32
+        return _dup (_fileno (file));
+#else
+        return dup (fileno (file));
+#endif
+    }
+
+    /** Writes what was handed over to the operating system through a duplicate descriptor to the disk, and closes it */
+    static bool syncDuplicate (int descriptor)
+    {
+#ifdef _WIN32
+        const bool ok = _commit (descriptor) == 0;
+        _close (descriptor);
+#else
+        const bool ok = fsync (descriptor) == 0;
+        ::close (descriptor);
+#endif
+
+        return ok;
+    }
+
+    /** Renames the journal, which stays open */
+    bool moveTo (const std::string& path)
+    {
+        if (file == nullptr || std::rename (fileName.c_str(), path.c_str()) != 0)
+            return false;
+
+        fileName = path;
+        return true;
+    }
+
+    /** Closes the journal, and deletes it if it is no longer needed */
+    void close (bool remove)
+    {
+        if (file == nullptr)
+            return;
+
+        fclose (file);
+        file = nullptr;
+
+        if (remove)
+            std::remove (fileName.c_str());
+    }
+
+    /** Size of the buffer records are collected in */
+    static constexpr size_t bufferSize = 1 << 20;
+
+private:
+    FILE* file = nullptr;
+    std::string fileName;
+};
+
+/**
+        Reads the records of a recovery journal, up to the end of the last complete one
+     */
+class JournalReader
+{
+public:
+    /** Destructor */
+    ~JournalReader()
+    {
+        if (file != nullptr)
+            fclose (file);
+    }
+
+    /** Opens a journal and checks its magic */
+    bool open (const std::string& path)
+    {
+        file = fopen (path.c_str(), "rb");
+
+        char magic[8];
+        return file != nullptr && fread (magic, 1, 8, file) == 8 && memcmp (magic, "NWBJRNL2", 8) == 0;
+    }
+
+    /** Reads the next record. Returns false at the end of the journal, or at a record that was not completely or correctly written */
+    bool next (JournalRecord& record, std::vector<char>& payload)
+    {
+        if (fread (&record, sizeof (record), 1, file) != 1 || record.magic != JournalRecord::recordMagic)
+            return false;
+
+        payload.resize (record.payloadSize);
+
+        if (record.payloadSize > 0 && fread (payload.data(), record.payloadSize, 1, file) != 1)
+            return false;
+
+        // a crash can leave the end of the journal with data that was never written, or a power loss with garbage
+        if (record.checksum != record.computeChecksum (payload.data()))
+        {
+            corrupt = true;
+            return false;
+        }
+
+        offset += sizeof (record) + record.payloadSize;
+        return true;
+    }
+
+    /** Returns the offset of the end of the last record read */
+    uint64_t getOffset() const { return offset; }
+
+    /** Returns true if reading stopped at a record whose checksum does not match */
+    bool stoppedAtCorruptRecord() const { return corrupt; }
+
+private:
+    FILE* file = nullptr;
+    uint64_t offset = 8;
+    bool corrupt = false;
+};
+
+} // namespace NWBRecording
+
+#endif
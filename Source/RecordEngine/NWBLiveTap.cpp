@@ -0,0 +1,221 @@
+/*
+    ------------------------------------------------------------------
+
+    This file is part of the Open Ephys GUI
+    Copyright (C) 2024 Open Ephys
+
+    ------------------------------------------------------------------
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include "NWBLiveTap.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <new>
+
+#if defined(__linux__) || defined(__APPLE__)
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#define LIVE_TAP_AVAILABLE 1
+#endif
+
+using namespace NWBRecording;
+
+namespace
+{
+
+/* Slots are cache line aligned, so that a slot header and its samples do not share lines with the previous slot */
+const size_t SLOT_ALIGNMENT = 64;
+
+size_t alignUp (size_t size)
+{
+    return (size + SLOT_ALIGNMENT - 1) / SLOT_ALIGNMENT * SLOT_ALIGNMENT;
+}
+
+} // namespace
+
+LiveTap::LiveTap (const std::string& name_, const std::string& streamName, int numChannels_, double sampleRate, const float* conversions)
+    : name (name_),
+      numChannels (numChannels_)
+{
+#ifdef LIVE_TAP_AVAILABLE
+    const size_t slotOffset = alignUp (sizeof (LiveTapHeader) + sizeof (float) * numChannels);
+    const size_t slotStride = alignUp (sizeof (LiveTapSlot) + sizeof (int16_t) * numChannels * slotSamples);
+
+    mappedSize = slotOffset + slotStride * numSlots;
+
+    // an object left by a previous run is replaced, readers still mapping it keep the old data
+    shm_unlink (name.c_str());
+
+    const int fd = shm_open (name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0644);
+
+    if (fd < 0)
+    {
+        std::cerr << "Could not create shared memory " << name << ": " << strerror (errno) << std::endl;
+        return;
+    }
+
+    void* memory = MAP_FAILED;
+
+    // the new object is zero-filled, so every slot starts with an even sequence number
+    if (ftruncate (fd, (off_t) mappedSize) == 0)
+        memory = mmap (nullptr, mappedSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+    close (fd);
+
+    if (memory == MAP_FAILED)
+    {
+        std::cerr << "Could not map shared memory " << name << ": " << strerror (errno) << std::endl;
+        shm_unlink (name.c_str());
+        return;
+    }
+
+    LiveTapHeader* newHeader = new (memory) LiveTapHeader;
+
+    newHeader->version = 1;
+    newHeader->numChannels = (uint32_t) numChannels;
+    newHeader->numSlots = numSlots;
+    newHeader->slotSamples = slotSamples;
+    newHeader->slotOffset = slotOffset;
+    newHeader->slotStride = slotStride;
+    newHeader->sampleRate = sampleRate;
+    strncpy (newHeader->streamName, streamName.c_str(), sizeof (newHeader->streamName) - 1);
+    newHeader->slotsPublished.store (0, std::memory_order_relaxed);
+
+    // the conversions follow the header, which holds atomics and so is not copied as plain memory
+    float* channelConversions = reinterpret_cast<float*> (reinterpret_cast<char*> (newHeader) + sizeof (LiveTapHeader));
+    memcpy (channelConversions, conversions, sizeof (float) * numChannels);
+
+    // readers check the magic last, so it is written once the rest of the header is
+    std::atomic_thread_fence (std::memory_order_release);
+    memcpy (newHeader->magic, "NWBTAP1", 8);
+
+    header = newHeader;
+#endif
+}
+
+LiveTap::~LiveTap()
+{
+#ifdef LIVE_TAP_AVAILABLE
+    if (header != nullptr)
+    {
+        munmap (header, mappedSize);
+        shm_unlink (name.c_str());
+    }
+#endif
+}
+
+LiveTapSlot* LiveTap::getSlot (uint64_t slotNumber) const
+{
+    char* base = reinterpret_cast<char*> (header) + header->slotOffset;
+    return reinterpret_cast<LiveTapSlot*> (base + (slotNumber % numSlots) * header->slotStride);
+}
+
+void LiveTap::writeChannel (int channel, const int16_t* samples, int numSamples)
+{
+    if (header == nullptr || channel < 0 || channel >= numChannels)
+        return;
+
+    if (channel == 0)
+    {
+        // a block whose other channels never arrived is published as it is, so its slots are not left locked
+        if (blockOpen)
+        {
+            channelsWritten = numChannels;
+            startKnown = true;
+            publishIfComplete();
+        }
+
+        if (numSamples <= 0)
+            return;
+
+        blockSamples = std::min (numSamples, numSlots * slotSamples);
+        blockSlots = (blockSamples + slotSamples - 1) / slotSamples;
+        blockSlot = header->slotsPublished.load (std::memory_order_relaxed);
+
+        for (int k = 0; k < blockSlots; k++)
+        {
+            LiveTapSlot* slot = getSlot (blockSlot + k);
+            slot->sequence.store (slot->sequence.load (std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        }
+
+        std::atomic_thread_fence (std::memory_order_release);
+
+        for (int k = 0; k < blockSlots; k++)
+        {
+            LiveTapSlot* slot = getSlot (blockSlot + k);
+            slot->slotNumber = blockSlot + k;
+            slot->numSamples = (uint32_t) std::min (slotSamples, blockSamples - k * slotSamples);
+        }
+
+        channelsWritten = 0;
+        startKnown = false;
+        blockOpen = true;
+    }
+
+    if (! blockOpen)
+        return;
+
+    const int count = std::min (numSamples, blockSamples);
+
+    for (int k = 0; k * slotSamples < count; k++)
+    {
+        int16_t* dest = reinterpret_cast<int16_t*> (getSlot (blockSlot + k) + 1) + channel;
+        const int16_t* src = samples + k * slotSamples;
+        const int n = std::min (slotSamples, count - k * slotSamples);
+
+        for (int i = 0; i < n; i++)
+            dest[i * numChannels] = src[i];
+    }
+
+    channelsWritten++;
+    publishIfComplete();
+}
+
+void LiveTap::setBlockStart (int64_t sampleNumber, double timestamp)
+{
+    if (! blockOpen)
+        return;
+
+    for (int k = 0; k < blockSlots; k++)
+    {
+        LiveTapSlot* slot = getSlot (blockSlot + k);
+        slot->firstSampleNumber = sampleNumber + (int64_t) k * slotSamples;
+        slot->firstTimestamp = timestamp + (double) k * slotSamples / header->sampleRate;
+    }
+
+    startKnown = true;
+    publishIfComplete();
+}
+
+void LiveTap::publishIfComplete()
+{
+    if (! blockOpen || ! startKnown || channelsWritten < numChannels)
+        return;
+
+    for (int k = 0; k < blockSlots; k++)
+    {
+        LiveTapSlot* slot = getSlot (blockSlot + k);
+        slot->sequence.store (slot->sequence.load (std::memory_order_relaxed) + 1, std::memory_order_release);
+    }
+
+    header->slotsPublished.store (blockSlot + blockSlots, std::memory_order_release);
+    blockOpen = false;
+}
@@ -0,0 +1,166 @@
+/*
+    ------------------------------------------------------------------
+
+    This file is part of the Open Ephys GUI
+    Copyright (C) 2024 Open Ephys
+
+    ------------------------------------------------------------------
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef NWBLIVETAP_H
+#define NWBLIVETAP_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+namespace NWBRecording
+{
+
+/**
+        Header at the start of a live tap shared memory object
+
+        The header is followed by the conversion (volts per bit) of each channel,
+        then by numSlots slots of slotStride bytes starting at slotOffset.
+     */
+struct LiveTapHeader
+{
+    /** "NWBTAP1" */
+    char magic[8];
+
+    /** Layout version (1) */
+    uint32_t version;
+
+    /** Number of interleaved channels in each sample */
+    uint32_t numChannels;
+
+    /** Number of slots in the ring */
+    uint32_t numSlots;
+
+    /** Maximum number of samples held by a slot */
+    uint32_t slotSamples;
+
+    /** Offset of the first slot from the start of the object, in bytes */
+    uint64_t slotOffset;
+
+    /** Distance between consecutive slots, in bytes */
+    uint64_t slotStride;
+
+    /** Sample rate of all channels */
+    double sampleRate;
+
+    /** Name of the stream */
+    char streamName[256];
+
+    /** Number of slots published so far; slot n is at index n % numSlots */
+    std::atomic<uint64_t> slotsPublished;
+};
+
+/**
+        Header of a slot of a live tap, followed by numSamples interleaved int16 samples
+
+        The sequence number is a seqlock: it is odd while the slot is written. A
+        reader copies the slot and accepts the copy if the sequence number was
+        even and unchanged before and after, and slotNumber is the slot it expects.
+     */
+struct LiveTapSlot
+{
+    /** Odd while the slot is being written */
+    std::atomic<uint64_t> sequence;
+
+    /** Number of the slot since the tap was created */
+    uint64_t slotNumber;
+
+    /** Sample number of the first sample */
+    int64_t firstSampleNumber;
+
+    /** Timestamp (in seconds) of the first sample */
+    double firstTimestamp;
+
+    /** Number of samples in the slot */
+    uint32_t numSamples;
+
+    uint32_t reserved;
+};
+
+/**
+        Publishes the int16 samples of a continuous stream into a POSIX shared
+        memory ring (/dev/shm/<name> on Linux), which other processes can map
+        read-only to get the data written to NWB with minimal latency.
+
+        Channels are written one at a time, as they are converted. A block is
+        published once all of its channels and its first sample number are known.
+        Blocks larger than a slot span consecutive slots.
+
+        Only available on Linux and macOS.
+     */
+class LiveTap
+{
+public:
+    /** Creates the shared memory object, replacing any object with the same name */
+    LiveTap (const std::string& name, const std::string& streamName, int numChannels, double sampleRate, const float* conversions);
+
+    /** Removes the shared memory object (readers keep their mapping) */
+    ~LiveTap();
+
+    /** Returns true if the shared memory object was created */
+    bool isOpen() const { return header != nullptr; }
+
+    /** Returns the name of the shared memory object */
+    const std::string& getName() const { return name; }
+
+    /** Copies the samples of a channel of the current block; channel 0 starts a new block */
+    void writeChannel (int channel, const int16_t* samples, int numSamples);
+
+    /** Sets the sample number and timestamp of the first sample of the current block */
+    void setBlockStart (int64_t sampleNumber, double timestamp);
+
+    /** Number of slots in the ring */
+    static constexpr int numSlots = 32;
+
+    /** Number of samples per slot */
+    static constexpr int slotSamples = 1024;
+
+private:
+    /** Returns the slot with the given number */
+    LiveTapSlot* getSlot (uint64_t slotNumber) const;
+
+    /** Publishes the current block if all of its channels and its start are known */
+    void publishIfComplete();
+
+    std::string name;
+    int numChannels;
+
+    LiveTapHeader* header = nullptr;
+    size_t mappedSize = 0;
+
+    /** Number of the first slot of the current block, and number of slots it spans */
+    uint64_t blockSlot = 0;
+    int blockSlots = 0;
+
+    /** Number of samples of the current block (at most numSlots * slotSamples) */
+    int blockSamples = 0;
+
+    int channelsWritten = 0;
+    bool startKnown = false;
+    bool blockOpen = false;
+};
+
+} // namespace NWBRecording
+
+#endif
@@ -0,0 +1,285 @@
+/*
+    ------------------------------------------------------------------
+
+    This file is part of the Open Ephys GUI
+    Copyright (C) 2024 Open Ephys
+
+    ------------------------------------------------------------------
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include "NWBMigrator.h"
+
+#include <cstdio>
+#include <iostream>
+#include <vector>
+
+#ifdef _WIN32
+#include <io.h>
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+
+#ifdef __APPLE__
+#include <sys/resource.h>
+#endif
+
+using namespace NWBRecording;
+
+namespace
+{
+
+/** Gives the I/O of the calling thread the lowest priority, so that it only uses the disks when the recording does not */
+void lowerIOPriority()
+{
+#if defined(__linux__) && defined(SYS_ioprio_set)
+    // IOPRIO_WHO_PROCESS with 0 is the calling thread, IOPRIO_CLASS_IDLE is class 3
+    syscall (SYS_ioprio_set, 1, 0, 3 << 13);
+#elif defined(__APPLE__)
+    setiopolicy_np (IOPOL_TYPE_DISK, IOPOL_SCOPE_THREAD, IOPOL_THROTTLE);
+#elif defined(_WIN32)
+    SetThreadPriority (GetCurrentThread(), THREAD_MODE_BACKGROUND_BEGIN);
+#endif
+}
+
+/** Writes what was written to a file to the disk */
+bool syncFile (FILE* file)
+{
+    if (fflush (file) != 0)
+        return false;
+
+#ifdef _WIN32
+    return _commit (_fileno (file)) == 0;
+#else
+    const int fd = fileno (file);
+
+    if (fsync (fd) != 0)
+        return false;
+
+#ifdef __linux__
+    // drops the copy from the page cache, so that it is read back from the disk
+    posix_fadvise (fd, 0, 0, POSIX_FADV_DONTNEED);
+#endif
+
+    return true;
+#endif
+}
+
+/** Extends a 64 bit FNV-1a hash with a block of bytes */
+uint64 hashBlock (uint64 hash, const char* data, size_t size)
+{
+    for (size_t i = 0; i < size; i++)
+        hash = (hash ^ uint8 (data[i])) * 0x100000001b3ULL;
+
+    return hash;
+}
+
+const uint64 emptyHash = 0xcbf29ce484222325ULL;
+
+} // namespace
+
+Migrator::Migrator()
+{
+}
+
+Migrator::~Migrator()
+{
+    /* Moving the queue to a network share can take hours, which unloading the engine must not wait for.
+       The file being moved is given some time to finish at full speed, and the others are not started. */
+    draining = true;
+
+    if (! pool.removeAllJobs (false, finishTimeoutMs))
+    {
+        cancelled = true;
+        pool.removeAllJobs (false, -1);
+    }
+
+    const ScopedLock lock (pendingLock);
+
+    for (const Migration& migration : pending)
+        std::cerr << "Not moved to " << migration.destinationDirectory.getFullPathName() << ": " << migration.file.getFullPathName()
+                  << " and the files sharing its name that are still next to it" << std::endl;
+}
+
+void Migrator::migrate (const File& file, const File& recordingRoot, const File& destinationRoot, int rateMBps)
+{
+    // files outside the recording directory are moved to the top of the destination
+    const File destinationDirectory = file.isAChildOf (recordingRoot)
+                                          ? destinationRoot.getChildFile (file.getParentDirectory().getRelativePathFrom (recordingRoot))
+                                          : destinationRoot;
+
+    {
+        const ScopedLock lock (pendingLock);
+        pending.push_back ({ file, destinationDirectory });
+    }
+
+    pool.addJob ([this, file, destinationDirectory, rateMBps]
+                 {
+                     lowerIOPriority();
+
+                     const bool moved = moveFiles (file, destinationDirectory, rateMBps);
+
+                     // a cancelled file is listed with those not started
+                     if (cancelled)
+                         return;
+
+                     if (moved)
+                         std::cout << "Moved " << file.getFullPathName() << " to " << destinationDirectory.getFullPathName() << std::endl;
+                     else
+                         std::cerr << "Error moving " << file.getFullPathName() << " to " << destinationDirectory.getFullPathName()
+                                   << ", the remaining files are left where they were recorded" << std::endl;
+
+                     const ScopedLock lock (pendingLock);
+
+                     for (auto it = pending.begin(); it != pending.end(); ++it)
+                     {
+                         if (it->file == file)
+                         {
+                             pending.erase (it);
+                             break;
+                         }
+                     }
+                 });
+}
+
+bool Migrator::moveFiles (const File& file, const File& destinationDirectory, int rateMBps)
+{
+    if (! destinationDirectory.createDirectory())
+        return false;
+
+    // shards and raw data files are named <stem>.<group>.h5 and <stem>.<group>.dat
+    Array<File> files = file.getParentDirectory().findChildFiles (File::findFiles, false, file.getFileNameWithoutExtension() + ".*");
+
+    // the NWB file goes last, so that it only appears at the destination once the files it links to are there
+    files.removeFirstMatchingValue (file);
+    files.add (file);
+
+    for (const File& source : files)
+    {
+        const File destination = destinationDirectory.getChildFile (source.getFileName());
+
+        // a rename does not move any data, but only works within a volume
+        if (std::rename (source.getFullPathName().toRawUTF8(), destination.getFullPathName().toRawUTF8()) == 0)
+            continue;
+
+        if (! copyAndVerify (source, destination, rateMBps))
+            return false;
+
+        source.deleteFile();
+    }
+
+    return true;
+}
+
+bool Migrator::copyAndVerify (const File& source, const File& destination, int rateMBps)
+{
+    const File partial = destination.getSiblingFile (destination.getFileName() + ".partial");
+
+    FILE* input = fopen (source.getFullPathName().toRawUTF8(), "rb");
+    FILE* output = fopen (partial.getFullPathName().toRawUTF8(), "wb");
+
+    std::vector<char> block (blockSize);
+    uint64 sourceHash = emptyHash;
+    int64 numBytes = 0;
+    bool ok = input != nullptr && output != nullptr;
+
+    const double start = Time::getMillisecondCounterHiRes();
+
+    while (ok)
+    {
+        // the partial copy is deleted below, and the original stays in place
+        if (cancelled)
+        {
+            ok = false;
+            break;
+        }
+
+        const size_t size = fread (block.data(), 1, blockSize, input);
+
+        if (size == 0)
+        {
+            ok = ferror (input) == 0;
+            break;
+        }
+
+        ok = fwrite (block.data(), 1, size, output) == size;
+        sourceHash = hashBlock (sourceHash, block.data(), size);
+        numBytes += size;
+
+        throttle (numBytes, start, rateMBps);
+    }
+
+    ok = ok && syncFile (output);
+
+    if (input != nullptr)
+        fclose (input);
+
+    if (output != nullptr)
+        ok = fclose (output) == 0 && ok;
+
+    // the copy is read back, so that the original is only deleted once the data is known to be on the other disk
+    if (ok)
+    {
+        FILE* copy = fopen (partial.getFullPathName().toRawUTF8(), "rb");
+        uint64 copyHash = emptyHash;
+        int64 copyBytes = 0;
+
+        while (copy != nullptr && ! cancelled)
+        {
+            const size_t size = fread (block.data(), 1, blockSize, copy);
+
+            if (size == 0)
+                break;
+
+            copyHash = hashBlock (copyHash, block.data(), size);
+            copyBytes += size;
+        }
+
+        if (copy != nullptr)
+            fclose (copy);
+
+        ok = copy != nullptr && ! cancelled && copyHash == sourceHash && copyBytes == numBytes;
+
+        if (! ok && ! cancelled)
+            std::cerr << "The copy of " << source.getFullPathName() << " does not match the original" << std::endl;
+    }
+
+    if (ok)
+        ok = std::rename (partial.getFullPathName().toRawUTF8(), destination.getFullPathName().toRawUTF8()) == 0;
+
+    if (! ok)
+        partial.deleteFile();
+
+    return ok;
+}
+
+void Migrator::throttle (int64 numBytes, double start, int rateMBps)
+{
+    if (draining)
+        return;
+
+    const double due = start + double (numBytes) / (double (rateMBps) * (1 << 20)) * 1000.0;
+    const double now = Time::getMillisecondCounterHiRes();
+
+    if (due > now)
+        Thread::sleep (int (due - now));
+}
@@ -0,0 +1,99 @@
+/*
+    ------------------------------------------------------------------
+
+    This file is part of the Open Ephys GUI
+    Copyright (C) 2024 Open Ephys
+
+    ------------------------------------------------------------------
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef NWBMIGRATOR_H
+#define NWBMIGRATOR_H
+
+#include <RecordingLib.h>
+
+#include <atomic>
+#include <vector>
+
+namespace NWBRecording
+{
+
+/**
+        Moves finished recording files from the directory they are recorded to
+        (typically a fast local disk) to a destination directory (e.g. a RAID
+        volume or a network share), one at a time on a background thread.
+
+        A file is moved together with the files next to it that share its name
+        (shards and raw data files), keeping its path relative to the recording
+        directory. Files on the same volume are renamed. Otherwise they are
+        copied at a limited rate with the lowest I/O priority, the copy is
+        written to the disk and read back to verify it, and only then is the
+        original deleted.
+
+        Files still queued when the migrator is destroyed are left where they
+        were recorded, and listed in the log.
+     */
+class Migrator
+{
+public:
+    /** Constructor */
+    Migrator();
+
+    /** Gives the file being moved finishTimeoutMs to finish without the rate limit, then cancels it.
+        Files not moved yet stay where they were recorded and are listed in the log. */
+    ~Migrator();
+
+    /** Queues a finished file, to be moved from the recording directory recordingRoot to the same path under destinationRoot */
+    void migrate (const File& file, const File& recordingRoot, const File& destinationRoot, int rateMBps);
+
+    /** Size of the blocks files are copied in */
+    static constexpr size_t blockSize = 1 << 20;
+
+    /** Time the file being moved is given to finish when the migrator is destroyed */
+    static constexpr int finishTimeoutMs = 10000;
+
+private:
+    /** Moves a file and the files sharing its name, returns false if any of them could not be moved */
+    bool moveFiles (const File& file, const File& destinationDirectory, int rateMBps);
+
+    /** Copies a file at a limited rate, then reads the copy back and compares it to the original */
+    bool copyAndVerify (const File& source, const File& destination, int rateMBps);
+
+    /** Waits as long as needed for numBytes transferred since start to stay under the rate */
+    void throttle (int64 numBytes, double start, int rateMBps);
+
+    /** A queued file, with the directory it is moved to */
+    struct Migration
+    {
+        File file;
+        File destinationDirectory;
+    };
+
+    ThreadPool pool { 1 };
+    std::atomic<bool> draining { false };
+    std::atomic<bool> cancelled { false };
+
+    /** Files queued or being moved */
+    std::vector<Migration> pending;
+    CriticalSection pendingLock;
+
+    JUCE_DECLARE_NON_COPYABLE (Migrator);
+};
+
+} // namespace NWBRecording
+
+#endif
@@ -29,6 +29,9 @@
 
 using namespace NWBRecording;
 
+/** Files last modified before the plugin was loaded belong to a previous session */
+static const Time loadTime = Time::getCurrentTime();
+
 NWBRecordEngine::NWBRecordEngine()
 {
     smpBuffer.malloc (MAX_BUFFER_SIZE);
@@ -36,17 +39,29 @@ NWBRecordEngine::NWBRecordEngine()
 
 NWBRecordEngine::~NWBRecordEngine()
 {
-    if (nwb != nullptr)
+    acquisitionWatcher.stopTimer();
+
+    // the checkpoint thread takes the HDF5 lock, so it is stopped before the lock is held here
+    checkpointer.stopThread (5000);
+
     {
-        spikeChannels.clear();
-        eventChannels.clear();
-        continuousChannelGroups.clear();
-        datasetIndexes.clear();
-        writeChannelIndexes.clear();
+        const ScopedLock lock (NWBFile::getHDF5Lock());
+        prepareGeneration++;
 
-        nwb->close();
-        nwb.reset();
+        // the last file (and the master file) of the last experiment is finished like the others
+        finishExperiment();
     }
+
+    // pending preparations see their generation changed and return, a running one is waited for
+    preparer.removeAllJobs (false, -1);
+
+    // files of previous experiments must be complete before the plugin is unloaded, so the jobs queued before this one are run
+    WaitableEvent finalized;
+    finalizer.addJob ([&finalized]
+                      { finalized.signal(); });
+    finalized.wait();
+
+    discardPreparedFiles();
 }
 
 RecordEngineManager* NWBRecordEngine::getEngineManager()
@@ -56,95 +71,897 @@ RecordEngineManager* NWBRecordEngine::getEngineManager()
     EngineParameter* param;
     param = new EngineParameter (EngineParameter::STR, 0, "Identifier Text", String());
     man->addParameter (param);
+    param = new EngineParameter (EngineParameter::INT, 1, "Trial TTL Line", 0, 0, 256);
+    man->addParameter (param);
+    param = new EngineParameter (EngineParameter::STR, 2, "Trial Event Stream", String());
+    man->addParameter (param);
+    param = new EngineParameter (EngineParameter::BOOL, 3, "Write with io_uring (Linux)", false);
+    man->addParameter (param);
+    param = new EngineParameter (EngineParameter::BOOL, 4, "Bypass page cache (Linux)", false);
+    man->addParameter (param);
+    param = new EngineParameter (EngineParameter::STR, 5, "Stripe Directories (Linux)", String());
+    man->addParameter (param);
+    param = new EngineParameter (EngineParameter::INT, 6, "Stripe Size (MB)", 1, 1, 1024);
+    man->addParameter (param);
+    param = new EngineParameter (EngineParameter::BOOL, 7, "One File Per Stream", false);
+    man->addParameter (param);
+    param = new EngineParameter (EngineParameter::INT, 8, "Rollover Size (GB)", 0, 0, 1024);
+    man->addParameter (param);
+    param = new EngineParameter (EngineParameter::INT, 9, "Rollover Time (hours)", 0, 0, 168);
+    man->addParameter (param);
+    param = new EngineParameter (EngineParameter::BOOL, 10, "Raw Continuous Data Files (readers need HDF5_EXTFILE_PREFIX)", false);
+    man->addParameter (param);
+    param = new EngineParameter (EngineParameter::BOOL, 11, "Allow Reading While Recording (SWMR)", false);
+    man->addParameter (param);
+    param = new EngineParameter (EngineParameter::STR, 12, "Live Tap Name (Linux/macOS)", String());
+    man->addParameter (param);
+    param = new EngineParameter (EngineParameter::BOOL, 13, "Latest File Format (Paged, experimental)", false);
+    man->addParameter (param);
+    param = new EngineParameter (EngineParameter::INT, 14, "File Space Page Size (KB)", 64, 4, 16384);
+    man->addParameter (param);
+    param = new EngineParameter (EngineParameter::INT, 15, "Metadata Cache Size (MB, experimental)", 0, 0, 1024);
+    man->addParameter (param);
+    param = new EngineParameter (EngineParameter::INT, 16, "Checkpoint Interval (s, experimental)", 0, 0, 3600);
+    man->addParameter (param);
+    param = new EngineParameter (EngineParameter::BOOL, 17, "Write Recovery Journal", false);
+    man->addParameter (param);
+    param = new EngineParameter (EngineParameter::STR, 18, "Move Finished Files To", String());
+    man->addParameter (param);
+    param = new EngineParameter (EngineParameter::INT, 19, "Move Rate Limit (MB/s)", 100, 1, 10000);
+    man->addParameter (param);
+    param = new EngineParameter (EngineParameter::STR, 20, "Spillover Directories", String());
+    man->addParameter (param);
+    param = new EngineParameter (EngineParameter::INT, 21, "Spillover Free Space (GB)", 10, 1, 1024);
+    man->addParameter (param);
     return man;
 }
 
 void NWBRecordEngine::openFiles (File rootFolder, int experimentNumber, int recordingNumber)
 {
+    const ScopedLock lock (NWBFile::getHDF5Lock());
+
     if (recordingNumber == 0) // new file needed
     {
-        spikeChannels.clear();
-        eventChannels.clear();
-        continuousChannels.clear();
-        continuousChannelGroups.clear();
-        datasetIndexes.clear();
-        writeChannelIndexes.clear();
-
         // New file for each experiment, e.g. experiment1.nwb, epxperiment2.nwb, etc.
         String basepath = rootFolder.getFullPathName() + rootFolder.getSeparatorString() + "experiment" + String (experimentNumber) + ".nwb";
 
-        if (nwb != nullptr)
+        // the previous file is closed in the background, so the next experiment starts without waiting for it
+        finishExperiment();
+
+        collectChannels();
+
+        // each stream is published to /<name>.<stream index>, e.g. /dev/shm/mytap.0 on Linux
+        liveTaps.clear();
+
+        if (liveTapName.trim().isNotEmpty())
         {
-            nwb->close();
-            nwb.reset();
+            for (int i = 0; i < continuousChannelGroups.size(); i++)
+            {
+                const ContinuousGroup& group = continuousChannelGroups.getReference (i);
+
+                String streamName = group[0]->getSourceNodeName() + "-" + String (group[0]->getSourceNodeId()) + "." + group[0]->getStreamName();
+                String tapName = "/" + File::createLegalFileName (liveTapName.trim()) + "." + String (i);
+
+                Array<float> conversions;
+
+                for (auto channel : group)
+                    conversions.add (channel->getBitVolts() / 1e6);
+
+                LiveTap* tap = new LiveTap (tapName.toStdString(), streamName.toStdString(), group.size(), group[0]->getSampleRate(), conversions.getRawDataPointer());
+
+                if (tap->isOpen())
+                    std::cout << "Publishing " << streamName << " to shared memory " << tapName << std::endl;
+                else
+                {
+                    delete tap;
+                    tap = nullptr;
+                }
+
+                liveTaps.add (tap);
+            }
         }
 
+        masterPath = basepath;
+        masterIdentifier = Uuid().toString();
+        finishedSegments.clear();
+        syncTexts.clear();
+
         // create a unique identifier for the file if it doesn't exist
         Uuid identifier;
         identifierText = identifier.toString();
 
-        nwb = std::make_unique<NWBFile> (basepath, CoreServices::getGUIVersion(), identifierText);
+        // segments are written next to the master file, e.g. experiment1_part001.nwb
+        segmentNumber = (rolloverSizeGB > 0 || rolloverHours > 0 || isSpilloverEnabled()) ? 1 : 0;
+        segmentDirectory = rootFolder.getFullPathName();
+        nextSpillover = 0;
+
+        // an experiment started on a disk that is already nearly full starts on the next one
+        if (isSpilloverEnabled() && rootFolder.getBytesFreeOnVolume() < (int64 (spilloverFreeGB) << 30))
+            selectSpilloverDirectory();
+
+        const String path = segmentNumber > 0 ? getSegmentPath (segmentNumber) : basepath;
+
+        nwb = takePreparedFile (path);
 
-        // get pointers to all continuous channels for electrode table
-        for (int i = 0; i < recordNode->getNumOutputs(); i++)
+        if (nwb == nullptr)
+            nwb = createFile (path, identifierText, false);
+
+        if (segmentNumber > 0)
+        {
+            writeMasterFile();
+            prepareNextSegment();
+        }
+
+        segmentStartTime = lastRolloverCheck = Time::getMillisecondCounterHiRes();
+    }
+
+    checkpointer.setInterval (checkpointIntervalSeconds);
+}
+
+void NWBRecordEngine::collectChannels()
+{
+    spikeChannels.clear();
+    eventChannels.clear();
+    continuousChannels.clear();
+    continuousChannelGroups.clear();
+    datasetIndexes.clear();
+    writeChannelIndexes.clear();
+
+    // get pointers to all continuous channels for electrode table
+    for (int i = 0; i < recordNode->getNumOutputs(); i++)
+    {
+        const ContinuousChannel* channelInfo = getContinuousChannel (i); // channel info object
+
+        continuousChannels.add (channelInfo);
+    }
+
+    datasetIndexes.insertMultiple (0, 0, getNumRecordedContinuousChannels());
+    writeChannelIndexes.insertMultiple (0, 0, getNumRecordedContinuousChannels());
+    continuousChannelGroups.clear();
+
+    int streamIndex = -1;
+    uint16 lastStreamId = 0;
+    int indexWithinStream = 0;
+
+    for (int ch = 0; ch < getNumRecordedContinuousChannels(); ch++)
+    {
+        int globalIndex = getGlobalIndex (ch); // the global channel index (across all channels entering the Record Node)
+        int localIndex = getLocalIndex (ch); // the local channel index (within a stream)
+
+        const ContinuousChannel* channelInfo = getContinuousChannel (globalIndex); // channel info object
+
+        int sourceId = channelInfo->getSourceNodeId();
+        int streamId = channelInfo->getStreamId();
+
+        if (streamId != lastStreamId)
         {
-            const ContinuousChannel* channelInfo = getContinuousChannel (i); // channel info object
+            streamIndex++;
+            indexWithinStream = 0;
 
-            continuousChannels.add (channelInfo);
+            ContinuousGroup newGroup;
+            continuousChannelGroups.add (newGroup);
         }
 
-        datasetIndexes.insertMultiple (0, 0, getNumRecordedContinuousChannels());
-        writeChannelIndexes.insertMultiple (0, 0, getNumRecordedContinuousChannels());
-        continuousChannelGroups.clear();
+        continuousChannelGroups.getReference (streamIndex).add (channelInfo);
+
+        datasetIndexes.set (ch, streamIndex);
+        writeChannelIndexes.set (ch, indexWithinStream++);
+
+        lastStreamId = streamId;
+    }
+
+    for (int i = 0; i < getNumRecordedEventChannels(); i++)
+        eventChannels.add (getEventChannel (i));
+
+    for (int i = 0; i < getNumRecordedSpikeChannels(); i++)
+        spikeChannels.add (getSpikeChannel (i));
+}
+
+std::unique_ptr<NWBFile> NWBRecordEngine::createFile (const String& path, const String& identifier, bool isMaster)
+{
+    auto file = std::make_unique<NWBFile> (path, CoreServices::getGUIVersion(), identifier);
+
+    //open the file
+    if (! isMaster)
+    {
+        FileSettings settings;
+        settings.ioDriver = useUring ? FileSettings::IO_URING : FileSettings::SEC2;
+        settings.directIO = useDirectIO;
+        settings.stripeDirectories = stripeDirectories.trim();
+        settings.stripeSizeMB = stripeSizeMB;
+        settings.swmr = readWhileRecording;
+        settings.formatProfile = latestPagedFormat ? FileSettings::LATEST_PAGED : FileSettings::COMPATIBLE;
+        settings.pageSizeKB = pageSizeKB;
+        settings.metadataCacheMB = metadataCacheMB;
+        settings.shardStreams = shardStreams;
+        settings.rawContinuousData = rawContinuousData;
+        settings.journal = writeJournal;
+
+        file->setFileSettings (settings);
+        file->setLiveTaps (getLiveTapArray());
+
+        if (templateFile.existsAsFile() && templateSignature == getLayoutSignature() && ! hasNamedSidecars())
+            file->setTemplate (templateFile.getFullPathName());
+    }
 
-        int streamIndex = -1;
-        uint16 lastStreamId = 0;
-        int indexWithinStream = 0;
+    file->open (getNumRecordedContinuousChannels() + continuousChannelGroups.size() + eventChannels.size() + spikeChannels.size()); //total channels + timestamp arrays, to create a big enough buffer
 
-        for (int ch = 0; ch < getNumRecordedContinuousChannels(); ch++)
+    //create the recording
+    if (! isMaster)
+        file->setTrialRule (trialTTLLine, trialStreamName);
+
+    file->startNewRecording (0, continuousChannelGroups, continuousChannels, eventChannels, spikeChannels);
+
+    return file;
+}
+
+void NWBRecordEngine::replaySyncTexts (NWBFile* file)
+{
+    for (auto& sync : syncTexts)
+        file->writeTimestampSyncText (sync.streamId, sync.timestamp, sync.sourceSampleRate, sync.text);
+}
+
+Array<LiveTap*> NWBRecordEngine::getLiveTapArray() const
+{
+    Array<LiveTap*> taps;
+
+    for (auto tap : liveTaps)
+        taps.add (tap);
+
+    return taps;
+}
+
+void NWBRecordEngine::startAcquisition()
+{
+    const ScopedLock lock (NWBFile::getHDF5Lock());
+
+    // no file is being written, so the channel arrays can be refreshed for the file of the first experiment
+    if (nwb == nullptr)
+    {
+        collectChannels();
+        removeStaleFiles (getPreparedDirectory (recordNode->getDataDirectory()), "*.nwb");
+        prepareNextFile (recordNode->getDataDirectory());
+    }
+    else // the file prepared after the last experiment was discarded when acquisition stopped
+        prepareNextFile (File (masterPath).getParentDirectory());
+
+    acquisitionWatcher.startTimer (1000);
+}
+
+NWBRecordEngine::AcquisitionWatcher::AcquisitionWatcher (NWBRecordEngine& engine_) : engine (engine_)
+{
+}
+
+void NWBRecordEngine::AcquisitionWatcher::timerCallback()
+{
+    if (CoreServices::getAcquisitionStatus())
+        return;
+
+    stopTimer();
+
+    // closing files waits for the HDF5 lock, which the message thread must not do
+    NWBRecordEngine& owner = engine;
+
+    owner.preparer.addJob ([&owner]
+                           {
+                               // acquisition restarted before the job ran, and the files will be used
+                               if (! CoreServices::getAcquisitionStatus())
+                                   owner.discardPreparedFiles();
+                           });
+}
+
+void NWBRecordEngine::discardPreparedFiles()
+{
+    const ScopedLock lock (NWBFile::getHDF5Lock());
+
+    // a preparation still pending is abandoned
+    prepareGeneration++;
+
+    File directory = templateFile.getParentDirectory();
+
+    if (preparedFile != nullptr)
+    {
+        directory = File (preparedFile->getFileName()).getParentDirectory();
+        discardFile (std::move (preparedFile));
+    }
+
+    templateFile.deleteFile();
+    templateFile = File();
+    templateSignature.clear();
+
+    // other engines recording to the same data directory may still use it
+    if (directory.isDirectory() && directory.findChildFiles (File::findFilesAndDirectories, false).isEmpty())
+        directory.deleteFile();
+}
+
+File NWBRecordEngine::getPreparedDirectory (const File& directory)
+{
+    return directory.getChildFile (".nwb-prepared");
+}
+
+void NWBRecordEngine::removeStaleFiles (const File& directory, const String& pattern)
+{
+    // files of other engines recording to the same directory are newer, and left alone, while a template is never reused across sessions
+    for (auto file : directory.findChildFiles (File::findFiles, false, pattern))
+    {
+        if (file.getLastModificationTime() < loadTime)
         {
-            int globalIndex = getGlobalIndex (ch); // the global channel index (across all channels entering the Record Node)
-            int localIndex = getLocalIndex (ch); // the local channel index (within a stream)
+            std::cout << "Removing " << file.getFullPathName() << ", left behind by a previous session" << std::endl;
+            file.deleteFile();
+        }
+    }
+}
 
-            const ContinuousChannel* channelInfo = getContinuousChannel (globalIndex); // channel info object
+static String describeChannel (const ContinuousChannel* channel)
+{
+    return String (channel->getGlobalIndex()) + ":" + channel->getSourceNodeName() + "-" + String (channel->getSourceNodeId())
+           + "." + channel->getStreamName() + "#" + String (channel->getStreamId()) + "/" + String (channel->getSampleRate())
+           + "/" + String (channel->getBitVolts()) + "/" + String ((int) channel->getChannelType());
+}
 
-            int sourceId = channelInfo->getSourceNodeId();
-            int streamId = channelInfo->getStreamId();
+String NWBRecordEngine::getLayoutSignature() const
+{
+    // built from what startNewRecording writes, as the info objects of a channel can be reused after the signal chain changes
+    String signature = String (useUring) + String (useDirectIO) + String (readWhileRecording) + String (latestPagedFormat) + " " + String (pageSizeKB) + " " + String (metadataCacheMB) + " " + String (writeJournal) + " " + String (trialTTLLine) + " " + trialStreamName + " " + String (getNumRecordedContinuousChannels());
 
-            if (streamId != lastStreamId)
-            {
-                streamIndex++;
-                indexWithinStream = 0;
+    for (auto channel : continuousChannels)
+        signature += " " + describeChannel (channel);
 
-                ContinuousGroup newGroup;
-                continuousChannelGroups.add (newGroup);
-            }
+    for (auto& group : continuousChannelGroups)
+    {
+        signature += " |";
 
-            continuousChannelGroups.getReference (streamIndex).add (channelInfo);
+        for (auto channel : group)
+            signature += " " + String (channel->getGlobalIndex());
+    }
 
-            datasetIndexes.set (ch, streamIndex);
-            writeChannelIndexes.set (ch, indexWithinStream++);
+    for (auto channel : eventChannels)
+    {
+        signature += " e" + String ((int) channel->getType()) + ":" + channel->getName() + ":" + channel->getSourceNodeName() + "-" + String (channel->getSourceNodeId())
+                     + "." + channel->getStreamName() + "#" + String (channel->getStreamId()) + "/" + String (channel->getSampleRate())
+                     + "/" + String ((int) channel->getLength()) + "/" + String ((int64) channel->getDataSize());
 
-            lastStreamId = streamId;
+        for (int i = 0; i < channel->getEventMetadataCount(); i++)
+        {
+            const MetadataDescriptor* descriptor = channel->getEventMetadataDescriptor (i);
+            signature += "/" + String ((int) descriptor->getType()) + "x" + String ((int) descriptor->getLength());
         }
+    }
+
+    for (auto channel : spikeChannels)
+    {
+        signature += " s" + channel->getName() + ":" + channel->getSourceNodeName() + "-" + String (channel->getSourceNodeId())
+                     + "." + channel->getStreamName() + "/" + String (channel->getNumChannels()) + "/" + String ((int) channel->getTotalSamples());
 
-        for (int i = 0; i < getNumRecordedEventChannels(); i++)
-            eventChannels.add (getEventChannel (i));
+        for (auto source : channel->getSourceChannels())
+            signature += " " + describeChannel (source);
+    }
 
-        for (int i = 0; i < getNumRecordedSpikeChannels(); i++)
-            spikeChannels.add (getSpikeChannel (i));
+    return signature;
+}
 
-        //open the file
-        nwb->open (getNumRecordedContinuousChannels() + continuousChannelGroups.size() + eventChannels.size() + spikeChannels.size()); //total channels + timestamp arrays, to create a big enough buffer
+void NWBRecordEngine::prepareNextFile (const File& directory)
+{
+    // shard, raw data and stripe files are named after the file, which is only known when recording starts
+    if (hasNamedSidecars() || ! directory.isDirectory())
+        return;
 
-        //create the recording
-        nwb->startNewRecording (recordingNumber, continuousChannelGroups, continuousChannels, eventChannels, spikeChannels);
+    const String signature = getLayoutSignature();
+
+    if (preparedFile != nullptr)
+    {
+        if (preparedSignature == signature && File (preparedFile->getFileName()).getParentDirectory() == getPreparedDirectory (directory))
+            return;
+
+        discardFile (std::move (preparedFile));
+    }
+
+    const int generation = ++prepareGeneration;
+    const String path = getPreparedDirectory (directory).getChildFile (Uuid().toString() + ".nwb").getFullPathName();
+    const String identifier = Uuid().toString();
+
+    preparer.addJob ([this, generation, directory, path, identifier, signature]
+                     {
+                         const ScopedLock lock (NWBFile::getHDF5Lock());
+
+                         // recording started, or the settings changed, before the job ran
+                         if (generation != prepareGeneration)
+                             return;
+
+                         if (! getPreparedDirectory (directory).createDirectory())
+                         {
+                             std::cerr << "Could not create " << getPreparedDirectory (directory).getFullPathName() << std::endl;
+                             return;
+                         }
+
+                         buildTemplate (directory, signature);
+
+                         preparedFile = createFile (path, identifier, false);
+                         preparedSignature = signature;
+                         preparedIdentifier = identifier;
+                     });
+}
+
+bool NWBRecordEngine::hasNamedSidecars() const
+{
+    return shardStreams || rawContinuousData || stripeDirectories.trim().isNotEmpty();
+}
+
+void NWBRecordEngine::buildTemplate (const File& directory, const String& signature)
+{
+    if (templateSignature == signature && templateFile.existsAsFile())
+        return;
+
+    // only the template of the current configuration is kept
+    templateFile.deleteFile();
+    templateSignature.clear();
+
+    const File file = getPreparedDirectory (directory).getChildFile ("template-" + String::toHexString (signature.hashCode64()) + ".nwb");
+    file.deleteFile();
+
+    std::unique_ptr<NWBFile> skeleton = createFile (file.getFullPathName(), Uuid().toString(), false);
+    skeleton->setLiveTaps (Array<LiveTap*>());
+
+    if (skeleton->closeAsTemplate())
+    {
+        templateFile = file;
+        templateSignature = signature;
+    }
+    else
+    {
+        std::cerr << "Could not write file template " << file.getFullPathName() << std::endl;
+        file.deleteFile();
+    }
+}
+
+std::unique_ptr<NWBFile> NWBRecordEngine::takePreparedFile (const String& path)
+{
+    // a file still being prepared is abandoned, as finishing it would take as long as creating one here
+    prepareGeneration++;
+
+    if (preparedFile == nullptr)
+        return nullptr;
+
+    std::unique_ptr<NWBFile> file = std::move (preparedFile);
+
+    if (preparedSignature != getLayoutSignature())
+    {
+        discardFile (std::move (file));
+        return nullptr;
+    }
+
+    if (! file->moveTo (path))
+    {
+        std::cout << "The prepared file could not be renamed while open (renaming open files fails on Windows), creating " << path << " instead" << std::endl;
+        discardFile (std::move (file));
+        return nullptr;
+    }
+
+    file->setLiveTaps (getLiveTapArray());
+    identifierText = preparedIdentifier;
+
+    return file;
+}
+
+void NWBRecordEngine::discardFile (std::unique_ptr<NWBFile> file)
+{
+    // a prepared file holds no data, so it is closed right away
+    const File path (file->getFileName());
+
+    file->setLiveTaps (Array<LiveTap*>());
+    file->close();
+    file.reset();
+
+    path.deleteFile();
+}
+
+String NWBRecordEngine::getSegmentPath (int segment) const
+{
+    const String name = File (masterPath).getFileNameWithoutExtension() + "_part" + String (segment).paddedLeft ('0', 3) + ".nwb";
+
+    return File (segmentDirectory).getChildFile (name).getFullPathName();
+}
+
+String NWBRecordEngine::getSegmentReference (const String& segmentPath) const
+{
+    const File segment (segmentPath);
+
+    // segments next to the master file move with it, spilled segments stay on their disk
+    if (segment.getParentDirectory() == File (masterPath).getParentDirectory())
+        return segment.getFileName();
+
+    return segment.getFullPathName();
+}
+
+bool NWBRecordEngine::isSpilloverEnabled() const
+{
+    // striped files are already spread over several disks
+    return spilloverDirectories.trim().isNotEmpty() && stripeDirectories.trim().isEmpty();
+}
+
+bool NWBRecordEngine::selectSpilloverDirectory()
+{
+    const StringArray directories = StringArray::fromTokens (spilloverDirectories, ";", "");
+
+    if (nextSpillover >= directories.size())
+        return false;
+
+    // the recording keeps its place in the data directory, e.g. <spillover>/<session>/Record Node 101
+    const File recordingFolder = File (masterPath).getParentDirectory();
+    const File dataDirectory = recordNode->getDataDirectory();
+
+    while (nextSpillover < directories.size())
+    {
+        const String path = directories[nextSpillover++].trim();
+
+        if (path.isEmpty() || ! File::isAbsolutePath (path))
+            continue;
+
+        const File directory = recordingFolder.isAChildOf (dataDirectory)
+                                   ? File (path).getChildFile (recordingFolder.getRelativePathFrom (dataDirectory))
+                                   : File (path);
+
+        if (directory.createDirectory() && directory.getBytesFreeOnVolume() >= (int64 (spilloverFreeGB) << 30))
+        {
+            segmentDirectory = directory.getFullPathName();
+            return true;
+        }
+
+        std::cerr << "Spillover directory " << directory.getFullPathName() << " cannot be written or has less than "
+                  << spilloverFreeGB << " GB free" << std::endl;
+    }
+
+    std::cerr << "No spillover directory left, recording continues in " << segmentDirectory << std::endl;
+
+    return false;
+}
+
+void NWBRecordEngine::endChannelBlock (bool lastBlock)
+{
+    // the journal of a complete block reaches the operating system, so it survives a crash of the GUI
+    if (writeJournal && nwb != nullptr)
+    {
+        const ScopedLock lock (NWBFile::getHDF5Lock());
+        nwb->flushJournal();
+    }
+
+    if (segmentNumber == 0 || lastBlock || nwb == nullptr)
+        return;
+
+    const double now = Time::getMillisecondCounterHiRes();
+
+    // the size of the file is queried from HDF5, so it is only checked about once per second
+    if (now - lastRolloverCheck < 1000.0)
+        return;
+
+    lastRolloverCheck = now;
+
+    const ScopedLock lock (NWBFile::getHDF5Lock());
+
+    // the recording spills over to the next directory before its disk is full, and does so only once per directory
+    const bool spillover = isSpilloverEnabled()
+                           && File (segmentDirectory).getBytesFreeOnVolume() < (int64 (spilloverFreeGB) << 30)
+                           && selectSpilloverDirectory();
+
+    if (spillover
+        || (rolloverSizeGB > 0 && nwb->getFileSize() >= (int64 (rolloverSizeGB) << 30))
+        || (rolloverHours > 0 && now - segmentStartTime >= rolloverHours * 3600000.0))
+    {
+        rollover();
+        segmentStartTime = now;
+    }
+}
+
+void NWBRecordEngine::rollover()
+{
+    /* This is called between blocks, once all channels of a block are written, so the
+       segments hold the same number of rows in every channel and no samples are dropped */
+    nwb->stopRecording();
+
+    VirtualSegment segment = nwb->getVirtualSegment();
+    segment.fileName = getSegmentReference (nwb->getFileName());
+    finishedSegments.add (segment);
+
+    fileGeneration++;
+    finalizeInBackground (std::move (nwb));
+
+    const String path = getSegmentPath (++segmentNumber);
+
+    nwb = takeNextSegment (path);
+
+    if (nwb == nullptr)
+    {
+        identifierText = Uuid().toString();
+        nwb = createFile (path, identifierText, false);
+    }
+
+    replaySyncTexts (nwb.get());
+
+    remapMasterFile (getSegmentReference (path));
+    prepareNextSegment();
+
+    std::cout << "Continuing recording in " << nwb->getFileName() << std::endl;
+}
+
+void NWBRecordEngine::prepareNextSegment()
+{
+    const int generation = ++segmentGeneration;
+    const String path = getSegmentPath (segmentNumber + 1);
+    const String identifier = Uuid().toString();
+
+    // the segment is created with its final name, so its shard, raw data and stripe files are named after it
+    preparer.addJob ([this, generation, path, identifier]
+                     {
+                         const ScopedLock lock (NWBFile::getHDF5Lock());
+
+                         // the segment it was prepared for started, or the experiment ended, before the job ran
+                         if (generation != segmentGeneration)
+                             return;
+
+                         File (path).deleteFile();
+
+                         nextSegment = createFile (path, identifier, false);
+                         nextSegmentIdentifier = identifier;
+                     });
+}
+
+std::unique_ptr<NWBFile> NWBRecordEngine::takeNextSegment (const String& path)
+{
+    // a segment still being prepared is abandoned, as finishing it would take as long as creating one here
+    segmentGeneration++;
+
+    if (nextSegment == nullptr)
+        return nullptr;
+
+    std::unique_ptr<NWBFile> file = std::move (nextSegment);
+
+    // the segment directory moves to the next spillover directory when its disk fills up
+    if (file->getFileName() != path)
+    {
+        discardSegment (std::move (file));
+        return nullptr;
+    }
+
+    if (! file->restamp())
+        std::cerr << "Could not update the creation time of " << path << std::endl;
+
+    file->setLiveTaps (getLiveTapArray());
+    identifierText = nextSegmentIdentifier;
+
+    return file;
+}
+
+void NWBRecordEngine::discardSegment (std::unique_ptr<NWBFile> file)
+{
+    const File path (file->getFileName());
+
+    file->setLiveTaps (Array<LiveTap*>());
+    file->close();
+    file.reset();
+
+    // shards, raw data files and stripes are named after the segment
+    for (auto sidecar : path.getParentDirectory().findChildFiles (File::findFiles, false, path.getFileNameWithoutExtension() + ".*"))
+        sidecar.deleteFile();
+
+    path.deleteFile();
+}
+
+void NWBRecordEngine::finishExperiment()
+{
+    if (nwb == nullptr)
+        return;
+
+    const bool segmented = segmentNumber > 0;
+
+    if (segmented)
+    {
+        VirtualSegment segment = nwb->getVirtualSegment();
+        segment.fileName = getSegmentReference (nwb->getFileName());
+        finishedSegments.add (segment);
+
+        segmentGeneration++;
+
+        if (nextSegment != nullptr)
+            discardSegment (std::move (nextSegment));
+    }
+
+    fileGeneration++;
+    finalizeInBackground (std::move (nwb));
+
+    if (! segmented)
+        return;
+
+    // the master file maps the finished segments alone, with their final number of samples
+    remapMasterFile (String());
+
+    // the master file of a segmented experiment is moved after its last segment
+    const File migrationTarget = getMigrationDirectory();
+
+    if (migrationTarget != File())
+    {
+        const File master (masterPath);
+        const File recordingRoot = recordNode->getDataDirectory();
+        const int rate = migrationRateMBps;
+
+        finalizer.addJob ([this, master, recordingRoot, migrationTarget, rate]
+                          { migrator.migrate (master, recordingRoot, migrationTarget, rate); });
+    }
+}
+
+void NWBRecordEngine::finalizeInBackground (std::unique_ptr<NWBFile> file)
+{
+    // the live taps belong to the engine and may be replaced before the file is closed
+    file->setLiveTaps (Array<LiveTap*>());
+
+    NWBFile* finished = file.release();
+
+    // the file is moved with the settings it was recorded with
+    const File migrationTarget = getMigrationDirectory();
+    const File recordingRoot = recordNode->getDataDirectory();
+    const int rate = migrationRateMBps;
+
+    finalizer.addJob ([this, finished, migrationTarget, recordingRoot, rate]
+                      {
+                          const bool ok = finished->close();
+                          const String fileName = finished->getFileName();
+
+                          {
+                              const ScopedLock lock (NWBFile::getHDF5Lock());
+                              delete finished;
+                          }
+
+                          fileFinalized (fileName, ok);
+
+                          // an incomplete file stays next to its journal, where nwb-recover expects it, and a spilled
+                          // segment stays on its disk, where the master file refers to it
+                          if (ok && migrationTarget != File() && File (fileName).isAChildOf (recordingRoot))
+                              migrator.migrate (File (fileName), recordingRoot, migrationTarget, rate);
+                      });
+}
+
+void NWBRecordEngine::fileFinalized (const String& fileName, bool success)
+{
+    if (success)
+        std::cout << "Finished writing " << fileName << std::endl;
+    else
+        std::cerr << "Error finishing " << fileName << ", the file may be incomplete" << std::endl;
+}
+
+File NWBRecordEngine::getMigrationDirectory() const
+{
+    const String directory = migrationDirectory.trim();
+
+    // striped files are spread over several volumes, and are left where they are
+    if (directory.isEmpty() || ! File::isAbsolutePath (directory) || stripeDirectories.trim().isNotEmpty())
+        return File();
+
+    return File (directory);
+}
+
+void NWBRecordEngine::writeMasterFile()
+{
+    // the master file is written once per experiment, and its mappings are updated in place as segments finish
+    File (masterPath).deleteFile();
+
+    std::unique_ptr<NWBFile> master = createFile (masterPath, masterIdentifier, true);
+    replaySyncTexts (master.get());
+
+    if (! master->makeVirtual (finishedSegments, getSegmentReference (nwb->getFileName())))
+        std::cerr << "Error mapping segments into " << masterPath << std::endl;
+
+    master->close();
+}
+
+void NWBRecordEngine::remapMasterFile (const String& currentSegment)
+{
+    const String path = masterPath;
+    const Array<VirtualSegment> segments = finishedSegments;
+
+    // queued after the segment that just finished, on the thread that closes it, so the recording thread does not wait
+    finalizer.addJob ([path, segments, currentSegment]
+                      {
+                          const ScopedLock lock (NWBFile::getHDF5Lock());
+
+                          if (! VirtualSegments::remap (path, segments, currentSegment))
+                              std::cerr << "Error updating the segments mapped into " << path << std::endl;
+                      });
+}
+
+void NWBRecordEngine::checkpointCurrentFile()
+{
+    const int64 start = Time::getHighResolutionTicks();
+    double longestHold = 0;
+    int generation = 0;
+
+    // each step is short and holds the lock on its own, so that the recording thread waits for one of them at most
+    auto runStep = [&] (auto step)
+    {
+        const ScopedLock lock (NWBFile::getHDF5Lock());
+        const int64 stepStart = Time::getHighResolutionTicks();
+
+        // the file was closed or replaced by the next one since the last step
+        if (generation != fileGeneration || nwb == nullptr)
+            return false;
+
+        const bool more = step();
+
+        longestHold = jmax (longestHold, Time::highResolutionTicksToSeconds (Time::getHighResolutionTicks() - stepStart));
+
+        return more;
+    };
+
+    {
+        const ScopedLock lock (NWBFile::getHDF5Lock());
+
+        if (nwb == nullptr)
+            return;
+
+        generation = fileGeneration;
+    }
+
+    if (! runStep ([this]
+                   { nwb->beginCheckpoint(); return true; }))
+        return;
+
+    bool flushing = true;
+
+    while (flushing)
+        flushing = runStep ([this]
+                            { return nwb->flushNextStep(); });
+
+    int journal = -1;
+
+    if (! runStep ([this, &journal]
+                   { journal = nwb->duplicateJournal(); return true; }))
+        return;
+
+    // waiting for the disk is left out of the lock, the journal is written to it so that it survives a power loss
+    const bool synced = journal < 0 || JournalWriter::syncDuplicate (journal);
+
+    if (! synced)
+        std::cerr << "Error syncing the journal of the current file" << std::endl;
+
+    runStep ([this, start, &longestHold]
+             { return nwb->endCheckpoint (Time::highResolutionTicksToSeconds (Time::getHighResolutionTicks() - start), longestHold); });
+}
+
+NWBRecordEngine::CheckpointThread::CheckpointThread (NWBRecordEngine& engine_) : Thread ("NWB Checkpoint"),
+                                                                                   engine (engine_)
+{
+}
+
+void NWBRecordEngine::CheckpointThread::setInterval (int seconds)
+{
+    intervalSeconds = seconds;
+
+    if (seconds > 0)
+        startThread();
+
+    notify();
+}
+
+void NWBRecordEngine::CheckpointThread::run()
+{
+    while (! threadShouldExit())
+    {
+        const int seconds = intervalSeconds;
+
+        // a new interval wakes the thread up, which then waits for it in full
+        if (wait (seconds > 0 ? seconds * 1000 : -1) || threadShouldExit())
+            continue;
+
+        engine.checkpointCurrentFile();
     }
 }
 
 void NWBRecordEngine::closeFiles()
 {
+    const ScopedLock lock (NWBFile::getHDF5Lock());
+
     nwb->stopRecording();
+
+    // the next experiment is most likely recorded with the same channels, into the same directory
+    prepareNextFile (File (masterPath).getParentDirectory());
 }
 
 void NWBRecordEngine::writeContinuousData (int writeChannel,
@@ -153,6 +970,8 @@ void NWBRecordEngine::writeContinuousData (int writeChannel,
                                            const double* timestampBuffer,
                                            int size)
 {
+    const ScopedLock lock (NWBFile::getHDF5Lock());
+
     nwb->writeData (datasetIndexes[writeChannel],
                     writeChannelIndexes[writeChannel],
                     size,
@@ -182,11 +1001,18 @@ void NWBRecordEngine::writeEvent (int eventIndex, const MidiMessage& event)
     const EventChannel* channel = getEventChannel (eventIndex);
     EventPtr eventStruct = Event::deserialize (event, channel);
 
+    const ScopedLock lock (NWBFile::getHDF5Lock());
+
     nwb->writeEvent (eventIndex, channel, eventStruct);
 }
 
 void NWBRecordEngine::writeTimestampSyncText (uint64 streamId, int64 timestamp, float sourceSampleRate, String text)
 {
+    const ScopedLock lock (NWBFile::getHDF5Lock());
+
+    if (segmentNumber > 0)
+        syncTexts.add ({ streamId, timestamp, sourceSampleRate, text });
+
     nwb->writeTimestampSyncText (streamId, timestamp, sourceSampleRate, text);
 }
 
@@ -194,10 +1020,35 @@ void NWBRecordEngine::writeSpike (int electrodeIndex, const Spike* spike)
 {
     const SpikeChannel* channel = getSpikeChannel (electrodeIndex);
 
+    const ScopedLock lock (NWBFile::getHDF5Lock());
+
     nwb->writeSpike (electrodeIndex, channel, spike);
 }
 
 void NWBRecordEngine::setParameter (EngineParameter& parameter)
 {
+    const ScopedLock lock (NWBFile::getHDF5Lock());
+
     strParameter (0, identifierText);
+    intParameter (1, trialTTLLine);
+    strParameter (2, trialStreamName);
+    boolParameter (3, useUring);
+    boolParameter (4, useDirectIO);
+    strParameter (5, stripeDirectories);
+    intParameter (6, stripeSizeMB);
+    boolParameter (7, shardStreams);
+    intParameter (8, rolloverSizeGB);
+    intParameter (9, rolloverHours);
+    boolParameter (10, rawContinuousData);
+    boolParameter (11, readWhileRecording);
+    strParameter (12, liveTapName);
+    boolParameter (13, latestPagedFormat);
+    intParameter (14, pageSizeKB);
+    intParameter (15, metadataCacheMB);
+    intParameter (16, checkpointIntervalSeconds);
+    boolParameter (17, writeJournal);
+    strParameter (18, migrationDirectory);
+    intParameter (19, migrationRateMBps);
+    strParameter (20, spilloverDirectories);
+    intParameter (21, spilloverFreeGB);
 }
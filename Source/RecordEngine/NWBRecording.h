@@ -27,6 +27,7 @@
 #include <RecordingLib.h>
 
 #include "NWBFormat.h"
+#include "NWBMigrator.h"
 
 namespace NWBRecording
 {
@@ -76,10 +77,170 @@ public:
     /** Allows the file identifier to be set externally*/
     void setParameter (EngineParameter& parameter) override;
 
+    /** Called after the continuous data of a block is written, rolls over to a new segment file if needed */
+    void endChannelBlock (bool lastBlock) override;
+
+    /** Called when acquisition starts, prepares the file of the first experiment in the background */
+    void startAcquisition() override;
+
 private:
+    /** Fills the channel arrays from the channels that are currently recorded */
+    void collectChannels();
+
+    /** Creates, opens and starts a file for the current experiment. The master file is written without the file driver, shard and trial settings */
+    std::unique_ptr<NWBFile> createFile (const String& path, const String& identifier, bool isMaster);
+
+    /** Writes the sync text messages of the current experiment into a new file */
+    void replaySyncTexts (NWBFile* file);
+
+    /** Returns the live taps of the continuous streams, indexed like the streams */
+    Array<LiveTap*> getLiveTapArray() const;
+
+    /** Returns everything the structure of a file depends on, to check that a prepared file matches the current channels and settings */
+    String getLayoutSignature() const;
+
+    /** Creates the next file in the background, with a temporary name in a directory on the same volume as the recording */
+    void prepareNextFile (const File& directory);
+
+    /** Returns the subdirectory of directory that prepared files and templates are written to, on the same volume */
+    static File getPreparedDirectory (const File& directory);
+
+    /** Closes and deletes the prepared file and the template, along with their directory once it is empty */
+    void discardPreparedFiles();
+
+    /** Deletes the files matching pattern in directory that a previous session left behind, such as prepared files of a crashed one */
+    static void removeStaleFiles (const File& directory, const String& pattern);
+
+    /** Returns true if the file has shard, raw data or stripe files, whose names are derived from its own */
+    bool hasNamedSidecars() const;
+
+    /** Writes the structure of a file with the current channels and settings into a template, which new files are copied from */
+    void buildTemplate (const File& directory, const String& signature);
+
+    /** Returns the prepared file moved to path if it matches the current channels and settings, null otherwise */
+    std::unique_ptr<NWBFile> takePreparedFile (const String& path);
+
+    /** Closes and deletes a prepared file that is not used */
+    void discardFile (std::unique_ptr<NWBFile> file);
+
+    /** Returns the path of a segment file of the current experiment, in the current segment directory */
+    String getSegmentPath (int segment) const;
+
+    /** Returns the name the master file refers to a segment file by: relative next to it, absolute on another disk */
+    String getSegmentReference (const String& segmentPath) const;
+
+    /** Returns true if segments spill over to other directories when the disk they are written to nears full */
+    bool isSpilloverEnabled() const;
+
+    /** Moves the segment directory to the next spillover directory with enough free space, returns false if there is none */
+    bool selectSpilloverDirectory();
+
+    /** Closes the current segment file and continues recording into the next one */
+    void rollover();
+
+    /** Hands a file over to the finalizer thread, which closes it while the next file is recorded */
+    void finalizeInBackground (std::unique_ptr<NWBFile> file);
+
+    /** Called on the finalizer thread once a file is closed, with false if closing it failed */
+    void fileFinalized (const String& fileName, bool success);
+
+    /** Returns the directory finished files are moved to, or File() if they stay where they are recorded */
+    File getMigrationDirectory() const;
+
+    /** Writes the master file of the experiment, mapping the finished segments and the current one */
+    void writeMasterFile();
+
+    /** Maps the finished segments and the current one (none once the experiment ends) into the master file, in the background */
+    void remapMasterFile (const String& currentSegment);
+
+    /** Creates the file of the next segment in the background, with its final name */
+    void prepareNextSegment();
+
+    /** Returns the prepared segment if it was created at path, null otherwise */
+    std::unique_ptr<NWBFile> takeNextSegment (const String& path);
+
+    /** Closes and deletes a prepared segment that is not used, along with the files named after it */
+    void discardSegment (std::unique_ptr<NWBFile> file);
+
+    /** Closes the current file in the background and finishes the master file of a segmented experiment */
+    void finishExperiment();
+
+    /** A sync text message, written again into each segment file */
+    struct SyncText
+    {
+        uint64 streamId;
+        int64 timestamp;
+        float sourceSampleRate;
+        String text;
+    };
+
+    /** Checkpoints the current file at a fixed interval, so that the file on disk is never more than an interval
+        behind and the metadata the fixed size cache evicts on the recording thread is mostly clean */
+    class CheckpointThread : public Thread
+    {
+    public:
+        /** Constructor */
+        CheckpointThread (NWBRecordEngine& engine);
+
+        /** Sets the interval between checkpoints (0 to stop them), starting the thread if needed */
+        void setInterval (int seconds);
+
+        /** Waits for the interval and checkpoints the current file, until the thread is stopped */
+        void run() override;
+
+    private:
+        NWBRecordEngine& engine;
+        std::atomic<int> intervalSeconds { 0 };
+    };
+
+    /** Checkpoints the current file, if one is being recorded */
+    void checkpointCurrentFile();
+
+    /** Discards the prepared files once acquisition stops, which record engines are not told about */
+    class AcquisitionWatcher : public Timer
+    {
+    public:
+        /** Constructor */
+        AcquisitionWatcher (NWBRecordEngine& engine);
+
+        /** Checks whether acquisition is still running */
+        void timerCallback() override;
+
+    private:
+        NWBRecordEngine& engine;
+    };
+
     /** Pointer to the current NWB file */
     std::unique_ptr<NWBFile> nwb;
 
+    /** Incremented when the current file is handed over to the finalizer, so that a checkpoint in progress stops */
+    int fileGeneration = 0;
+
+    CheckpointThread checkpointer { *this };
+
+    /** Moves finished files to the migration directory, declared before the finalizer which hands them over */
+    Migrator migrator;
+
+    /** Closes the files of previous experiments and segments, one at a time */
+    ThreadPool finalizer { 1 };
+
+    /** Creates the file of the next experiment ahead of recording, so that openFiles only has to rename it */
+    ThreadPool preparer { 1 };
+
+    std::unique_ptr<NWBFile> preparedFile;
+    String preparedSignature;
+    String preparedIdentifier;
+
+    /** Incremented when a pending preparation must be abandoned */
+    int prepareGeneration = 0;
+
+    /** Empty file of the current configuration, keyed by its layout signature */
+    File templateFile;
+    String templateSignature;
+
+    /** Started with acquisition, declared after the preparer it queues the cleanup on */
+    AcquisitionWatcher acquisitionWatcher { *this };
+
     /** For each incoming recorded channel, which dataset (stream) is it associated with? */
     Array<int> datasetIndexes;
 
@@ -104,6 +265,76 @@ private:
     /** The identifier for the current file (can be set externally) */
     String identifierText;
 
+    int trialTTLLine = 0;
+    String trialStreamName;
+
+    bool useUring = false;
+    bool useDirectIO = false;
+
+    String stripeDirectories;
+    int stripeSizeMB = 1;
+
+    bool shardStreams = false;
+    bool rawContinuousData = false;
+    bool readWhileRecording = false;
+
+    /** Writes the latest HDF5 file format with paged file space, in pages of pageSizeKB */
+    bool latestPagedFormat = false;
+    int pageSizeKB = 64;
+
+    /** Fixed size of the metadata cache of each file (0 for HDF5's adaptive cache), and interval between checkpoints (0 for none) */
+    int metadataCacheMB = 0;
+    int checkpointIntervalSeconds = 0;
+
+    /** Journals the data written to each file, so that nwb-recover can rebuild it after a crash */
+    bool writeJournal = false;
+
+    /** Directory finished files are moved to (empty to leave them in the recording directory), and rate of the copies */
+    String migrationDirectory;
+    int migrationRateMBps = 100;
+
+    /** Prefix of the shared memory objects the continuous streams are published to (empty for none) */
+    String liveTapName;
+
+    /** Live tap of each continuous stream, kept across segment files */
+    OwnedArray<LiveTap> liveTaps;
+
+    /** Size (in GB) and duration (in hours) of each segment file, 0 to write a single file */
+    int rolloverSizeGB = 0;
+    int rolloverHours = 0;
+
+    /** Path and identifier of the master file of the current experiment */
+    String masterPath;
+    String masterIdentifier;
+
+    /** Number of the segment being written (0 if the experiment is written to a single file) */
+    int segmentNumber = 0;
+
+    /** Directories (separated by ';') segments continue in when the free space on their disk falls below spilloverFreeGB */
+    String spilloverDirectories;
+    int spilloverFreeGB = 10;
+
+    /** Directory new segments are written to, and index of the next spillover directory to use */
+    String segmentDirectory;
+    int nextSpillover = 0;
+
+    /** Rows written to each finished segment */
+    Array<VirtualSegment> finishedSegments;
+
+    /** File of the next segment, created ahead of the rollover */
+    std::unique_ptr<NWBFile> nextSegment;
+    String nextSegmentIdentifier;
+
+    /** Incremented when a pending segment preparation must be abandoned */
+    int segmentGeneration = 0;
+
+    /** Sync text messages of the current experiment */
+    Array<SyncText> syncTexts;
+
+    /** Times (from Time::getMillisecondCounterHiRes) at which the current segment started and its size was last checked */
+    double segmentStartTime = 0;
+    double lastRolloverCheck = 0;
+
     JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR (NWBRecordEngine);
 };
 } // namespace NWBRecording
@@ -0,0 +1,78 @@
+/*
+    ------------------------------------------------------------------
+
+    This file is part of the Open Ephys GUI
+    Copyright (C) 2024 Open Ephys
+
+    ------------------------------------------------------------------
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include "NWBShardFile.h"
+
+using namespace NWBRecording;
+
+NWBShardFile::NWBShardFile (String fName) : NWBFileBase(),
+                                            filename (fName)
+{
+}
+
+String NWBShardFile::getShardPath (const String& nwbPath, const String& streamName)
+{
+    const File nwbFile (nwbPath);
+
+    return nwbFile.getSiblingFile (nwbFile.getFileNameWithoutExtension() + "." + File::createLegalFileName (streamName) + ".h5").getFullPathName();
+}
+
+HDF5RecordingData* NWBShardFile::createShardDataSet (BaseDataType type, int sizeY, int chunkX, String path)
+{
+    if (sizeY > 0)
+        return createDataSet (type, 0, sizeY, chunkX, path);
+
+    return createDataSet (type, 0, chunkX, path);
+}
+
+HDF5RecordingData* NWBShardFile::createLinkedDataSet (hid_t nwbFile, BaseDataType type, int sizeY, int chunkX, const String& path)
+{
+    const String shardPath = "/" + path.fromLastOccurrenceOf ("/", false, false);
+
+    HDF5RecordingData* dSet = createShardDataSet (type, sizeY, chunkX, shardPath);
+
+    if (dSet == nullptr)
+        return nullptr;
+
+    // a relative target is looked up next to the NWB file, so the files can be moved together
+    const String shardFile = File (filename).getFileName();
+
+    if (H5Lcreate_external (shardFile.toRawUTF8(), shardPath.toRawUTF8(), nwbFile, path.toRawUTF8(), H5P_DEFAULT, H5P_DEFAULT) < 0)
+    {
+        std::cerr << "Error linking " << path << " to " << shardFile << std::endl;
+        delete dSet;
+        return nullptr;
+    }
+
+    return dSet;
+}
+
+String NWBShardFile::getFileName()
+{
+    return filename;
+}
+
+int NWBShardFile::createFileStructure()
+{
+    return 0;
+}
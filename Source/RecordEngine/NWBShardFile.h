@@ -0,0 +1,66 @@
+/*
+    ------------------------------------------------------------------
+
+    This file is part of the Open Ephys GUI
+    Copyright (C) 2024 Open Ephys
+
+    ------------------------------------------------------------------
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef NWBSHARDFILE_H
+#define NWBSHARDFILE_H
+
+#include "NWBFileBase.h"
+
+namespace NWBRecording
+{
+
+/**
+        Plain HDF5 file holding the large datasets of one stream when an
+        NWB file is split into shards. The NWB file links to its datasets
+        with external links.
+     */
+class NWBShardFile : public NWBFileBase
+{
+public:
+    /** Constructor */
+    NWBShardFile (String fName);
+
+    /** Returns the path of the shard of a stream of the NWB file at nwbPath, next to it */
+    static String getShardPath (const String& nwbPath, const String& streamName);
+
+    /** Creates a 1-D (sizeY = 0) or 2-D extendable dataset */
+    HDF5RecordingData* createShardDataSet (BaseDataType type, int sizeY, int chunkX, String path);
+
+    /** Creates a dataset in this shard, named after the last component of path, and links path in the
+        NWB file nwbFile to it */
+    HDF5RecordingData* createLinkedDataSet (hid_t nwbFile, BaseDataType type, int sizeY, int chunkX, const String& path);
+
+    /** Returns the name of this file */
+    String getFileName() override;
+
+protected:
+    /** Shards have no required structure */
+    int createFileStructure() override;
+
+private:
+    String filename;
+};
+
+} // namespace NWBRecording
+
+#endif
@@ -0,0 +1,265 @@
+/*
+    ------------------------------------------------------------------
+
+    This file is part of the Open Ephys GUI
+    Copyright (C) 2024 Open Ephys
+
+    ------------------------------------------------------------------
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef NWBSPIKETIMES_H
+#define NWBSPIKETIMES_H
+
+#include <hdf5.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace NWBRecording
+{
+
+/**
+        Groups the spike times of a Units table by unit
+
+        During recording, spike times are appended to the table in the order they
+        arrive, along with the row of their unit. The spike_times column of a Units
+        table holds the spike times of each unit in one contiguous block, ending at
+        the row's value of spike_times_index, so they are grouped once the recording
+        ends: first the spikes of each unit are counted and spike_times_index is
+        written, then spike_times is filled a window of units at a time, each
+        window holding at most bufferSize spike times in memory.
+
+        Each step is short enough to be run with the HDF5 lock held. Header-only,
+        so that nwb-recover can finish the table of a file whose recording crashed.
+     */
+class SpikeTimeGrouper
+{
+public:
+    /** Destructor, keeps the spike times in arrival order */
+    ~SpikeTimeGrouper() { close (false); }
+
+    /** Names of the datasets written during recording, inside the Units group */
+    static constexpr const char* arrivalTimesName = "spike_times_in_arrival_order";
+    static constexpr const char* arrivalUnitsName = "spike_units_in_arrival_order";
+
+    /** Maximum number of spike times held in memory */
+    static constexpr uint64_t bufferSize = 1 << 24;
+
+    /** Number of rows read from the datasets in arrival order at once */
+    static constexpr uint64_t blockSize = 1 << 20;
+
+    /** Counts the spikes of each unit of the Units group at unitsPath, and sizes and writes spike_times_index */
+    bool open (hid_t file, const std::string& unitsPath)
+    {
+        units = H5Gopen2 (file, unitsPath.c_str(), H5P_DEFAULT);
+
+        if (units < 0)
+            return false;
+
+        arrivalTimes = H5Dopen2 (units, arrivalTimesName, H5P_DEFAULT);
+        arrivalUnits = H5Dopen2 (units, arrivalUnitsName, H5P_DEFAULT);
+        spikeTimes = H5Dopen2 (units, "spike_times", H5P_DEFAULT);
+        spikeTimesIndex = H5Dopen2 (units, "spike_times_index", H5P_DEFAULT);
+
+        const hid_t ids = H5Dopen2 (units, "id", H5P_DEFAULT);
+        numUnits = getLength (ids);
+
+        if (ids >= 0)
+            H5Dclose (ids);
+
+        if (arrivalTimes < 0 || arrivalUnits < 0 || spikeTimes < 0 || spikeTimesIndex < 0 || ids < 0)
+            return false;
+
+        // a crash may leave one of the two a few rows longer than the other
+        numSpikes = std::min (getLength (arrivalTimes), getLength (arrivalUnits));
+
+        counts.assign (numUnits, 0);
+
+        std::vector<int32_t> rows;
+
+        for (uint64_t start = 0; start < numSpikes; start += blockSize)
+        {
+            rows.resize (std::min (blockSize, numSpikes - start));
+
+            if (! readRows (arrivalUnits, H5T_NATIVE_INT32, start, rows.size(), rows.data()))
+                return false;
+
+            for (auto row : rows)
+            {
+                if (row >= 0 && uint64_t (row) < numUnits)
+                    counts[row]++;
+            }
+        }
+
+        starts.resize (numUnits);
+        std::vector<uint64_t> ends (numUnits);
+        uint64_t total = 0;
+
+        for (uint64_t unit = 0; unit < numUnits; unit++)
+        {
+            starts[unit] = total;
+            total += counts[unit];
+            ends[unit] = total;
+        }
+
+        hsize_t size = total;
+        hsize_t indexSize = numUnits;
+
+        return H5Dset_extent (spikeTimes, &size) >= 0
+               && H5Dset_extent (spikeTimesIndex, &indexSize) >= 0
+               && (numUnits == 0 || writeRows (spikeTimesIndex, H5T_NATIVE_UINT64, 0, numUnits, ends.data()));
+    }
+
+    /** Returns true once the spike times of all units are written */
+    bool isDone() const { return nextUnit >= numUnits; }
+
+    /** Writes the spike times of the next units whose spikes fit in the buffer (or of the next unit alone, if they do not) */
+    bool writeNextUnits()
+    {
+        const uint64_t firstUnit = nextUnit;
+        uint64_t size = 0;
+
+        while (nextUnit < numUnits && (nextUnit == firstUnit || size + counts[nextUnit] <= bufferSize))
+            size += counts[nextUnit++];
+
+        if (size == 0)
+            return true;
+
+        std::vector<double> buffer (size);
+        std::vector<uint64_t> filled (nextUnit - firstUnit, 0);
+
+        std::vector<double> times;
+        std::vector<int32_t> rows;
+
+        for (uint64_t start = 0; start < numSpikes; start += blockSize)
+        {
+            const uint64_t count = std::min (blockSize, numSpikes - start);
+            times.resize (count);
+            rows.resize (count);
+
+            if (! readRows (arrivalTimes, H5T_NATIVE_DOUBLE, start, count, times.data())
+                || ! readRows (arrivalUnits, H5T_NATIVE_INT32, start, count, rows.data()))
+                return false;
+
+            for (uint64_t i = 0; i < count; i++)
+            {
+                if (rows[i] < 0 || uint64_t (rows[i]) < firstUnit || uint64_t (rows[i]) >= nextUnit)
+                    continue;
+
+                const uint64_t unit = uint64_t (rows[i]);
+                buffer[starts[unit] - starts[firstUnit] + filled[unit - firstUnit]++] = times[i];
+            }
+        }
+
+        return writeRows (spikeTimes, H5T_NATIVE_DOUBLE, starts[firstUnit], size, buffer.data());
+    }
+
+    /** Closes the datasets, and deletes the ones in arrival order once the spike times are grouped */
+    bool close (bool removeArrivalOrder)
+    {
+        bool ok = true;
+
+        for (hid_t* dataSet : { &arrivalTimes, &arrivalUnits, &spikeTimes, &spikeTimesIndex })
+        {
+            if (*dataSet >= 0)
+                H5Dclose (*dataSet);
+
+            *dataSet = -1;
+        }
+
+        if (units < 0)
+            return false;
+
+        if (removeArrivalOrder)
+            ok = H5Ldelete (units, arrivalTimesName, H5P_DEFAULT) >= 0 && H5Ldelete (units, arrivalUnitsName, H5P_DEFAULT) >= 0;
+
+        H5Gclose (units);
+        units = -1;
+
+        return ok;
+    }
+
+    /** Returns the number of units and of spikes in arrival order */
+    uint64_t getNumUnits() const { return numUnits; }
+    uint64_t getNumSpikes() const { return numSpikes; }
+
+private:
+    static uint64_t getLength (hid_t dataSet)
+    {
+        if (dataSet < 0)
+            return 0;
+
+        const hid_t space = H5Dget_space (dataSet);
+        hsize_t dims[1] = { 0 };
+
+        if (H5Sget_simple_extent_ndims (space) == 1)
+            H5Sget_simple_extent_dims (space, dims, nullptr);
+
+        H5Sclose (space);
+
+        return dims[0];
+    }
+
+    static bool readRows (hid_t dataSet, hid_t type, uint64_t start, uint64_t count, void* data)
+    {
+        return transferRows (dataSet, type, start, count, data, false);
+    }
+
+    static bool writeRows (hid_t dataSet, hid_t type, uint64_t start, uint64_t count, const void* data)
+    {
+        return transferRows (dataSet, type, start, count, const_cast<void*> (data), true);
+    }
+
+    static bool transferRows (hid_t dataSet, hid_t type, uint64_t start, uint64_t count, void* data, bool write)
+    {
+        const hid_t space = H5Dget_space (dataSet);
+        const hsize_t offset = start;
+        const hsize_t rows = count;
+
+        H5Sselect_hyperslab (space, H5S_SELECT_SET, &offset, nullptr, &rows, nullptr);
+        const hid_t memSpace = H5Screate_simple (1, &rows, nullptr);
+
+        const bool ok = (write ? H5Dwrite (dataSet, type, memSpace, space, H5P_DEFAULT, data)
+                               : H5Dread (dataSet, type, memSpace, space, H5P_DEFAULT, data))
+                        >= 0;
+
+        H5Sclose (memSpace);
+        H5Sclose (space);
+
+        return ok;
+    }
+
+    hid_t units = -1;
+    hid_t arrivalTimes = -1;
+    hid_t arrivalUnits = -1;
+    hid_t spikeTimes = -1;
+    hid_t spikeTimesIndex = -1;
+
+    uint64_t numUnits = 0;
+    uint64_t numSpikes = 0;
+    uint64_t nextUnit = 0;
+
+    /** Number of spikes of each unit, and the row of spike_times its spikes start at */
+    std::vector<uint64_t> counts;
+    std::vector<uint64_t> starts;
+};
+
+} // namespace NWBRecording
+
+#endif
@@ -0,0 +1,160 @@
+/*
+    ------------------------------------------------------------------
+
+    This file is part of the Open Ephys GUI
+    Copyright (C) 2024 Open Ephys
+
+    ------------------------------------------------------------------
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef NWBSTRIPESET_H
+#define NWBSTRIPESET_H
+
+#include <cstdint>
+#include <fstream>
+#include <string>
+#include <vector>
+
+namespace NWBRecording
+{
+
+/**
+        Layout of a file striped across several member files
+
+        The file is split into regions of stripeSize bytes, assigned round-robin
+        to the members. The layout is stored in a small text descriptor next to
+        the file (<file>.stripes):
+
+            NWB_STRIPES 1
+            stripe_size <bytes>
+            size <bytes>
+            member <path>
+            ...
+
+        Header-only so that it can be shared by the file driver and the tools.
+     */
+struct StripeSet
+{
+    /** Size of each region, in bytes */
+    uint64_t stripeSize = 0;
+
+    /** Logical size of the file, in bytes */
+    uint64_t size = 0;
+
+    /** Paths of the member files */
+    std::vector<std::string> members;
+
+    /** Returns the path of the descriptor of a striped file */
+    static std::string descriptorPath (const std::string& filePath)
+    {
+        return filePath + ".stripes";
+    }
+
+    /** Returns the member holding a file offset */
+    int memberOf (uint64_t addr) const
+    {
+        return (int) ((addr / stripeSize) % members.size());
+    }
+
+    /** Returns the offset within its member of a file offset */
+    uint64_t memberOffset (uint64_t addr) const
+    {
+        return (addr / stripeSize) / members.size() * stripeSize + addr % stripeSize;
+    }
+
+    /** Returns the end of the region holding a file offset */
+    uint64_t stripeEnd (uint64_t addr) const
+    {
+        return (addr / stripeSize + 1) * stripeSize;
+    }
+
+    /** Returns the size of a member holding the first fileSize bytes of the file */
+    uint64_t memberSize (int member, uint64_t fileSize) const
+    {
+        const uint64_t numMembers = members.size();
+        const uint64_t fullStripes = fileSize / stripeSize;
+        const uint64_t remainder = fileSize % stripeSize;
+
+        uint64_t length = (fullStripes / numMembers + ((uint64_t) member < fullStripes % numMembers ? 1 : 0)) * stripeSize;
+
+        if (remainder > 0 && (uint64_t) member == fullStripes % numMembers)
+            length += remainder;
+
+        return length;
+    }
+
+    /** Returns the end of the data held by a member of the given size, as a file offset */
+    uint64_t fileEnd (int member, uint64_t memberSize) const
+    {
+        if (memberSize == 0)
+            return 0;
+
+        const uint64_t localStripe = (memberSize - 1) / stripeSize;
+        return (localStripe * members.size() + member) * stripeSize + memberSize - localStripe * stripeSize;
+    }
+
+    /** Reads a descriptor */
+    bool read (const std::string& path)
+    {
+        std::ifstream in (path);
+        std::string key;
+        int version = 0;
+
+        if (! (in >> key >> version) || key != "NWB_STRIPES" || version != 1)
+            return false;
+
+        members.clear();
+
+        while (in >> key)
+        {
+            if (key == "stripe_size")
+                in >> stripeSize;
+            else if (key == "size")
+                in >> size;
+            else if (key == "member")
+            {
+                std::string member;
+                in >> std::ws;
+                std::getline (in, member);
+                members.push_back (member);
+            }
+            else
+                return false;
+        }
+
+        return stripeSize > 0 && ! members.empty();
+    }
+
+    /** Writes a descriptor */
+    bool write (const std::string& path) const
+    {
+        std::ofstream out (path, std::ios::trunc);
+
+        out << "NWB_STRIPES 1\n"
+            << "stripe_size " << stripeSize << "\n"
+            << "size " << size << "\n";
+
+        for (const std::string& member : members)
+            out << "member " << member << "\n";
+
+        return bool (out.flush());
+    }
+};
+
+} // namespace NWBRecording
+
+#endif
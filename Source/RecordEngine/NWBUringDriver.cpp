@@ -0,0 +1,1053 @@
+/*
+    ------------------------------------------------------------------
+
+    This file is part of the Open Ephys GUI
+    Copyright (C) 2024 Open Ephys
+
+    ------------------------------------------------------------------
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include "NWBUringDriver.h"
+#include "NWBStripeSet.h"
+
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+
+#if defined(__linux__) && defined(__NR_io_uring_setup)
+
+#include <H5FDdevelop.h>
+
+#include <linux/io_uring.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <new>
+
+using namespace NWBRecording;
+
+namespace
+{
+
+/* Largest address that fits in an off_t (same limit as the sec2 driver) */
+const haddr_t MAX_ADDR = (((haddr_t) 1 << (8 * sizeof (off_t) - 1)) - 1);
+
+/* Driver value, outside of the range reserved by the HDF Group */
+const H5FD_class_value_t DRIVER_VALUE = 0x4E57;
+
+/** Memory-mapped submission and completion queues of an io_uring */
+struct Ring
+{
+    int fd = -1;
+    unsigned entries = 0;
+
+    unsigned* sqHead = nullptr;
+    unsigned* sqTail = nullptr;
+    unsigned* sqMask = nullptr;
+    unsigned* sqArray = nullptr;
+    io_uring_sqe* sqes = nullptr;
+
+    unsigned* cqHead = nullptr;
+    unsigned* cqTail = nullptr;
+    unsigned* cqMask = nullptr;
+    io_uring_cqe* cqes = nullptr;
+
+    void* sqRing = nullptr;
+    size_t sqRingSize = 0;
+    void* cqRing = nullptr;
+    size_t cqRingSize = 0;
+    size_t sqesSize = 0;
+};
+
+int ringSetup (unsigned entries, io_uring_params* params)
+{
+    return (int) syscall (__NR_io_uring_setup, entries, params);
+}
+
+int ringEnter (int fd, unsigned toSubmit, unsigned minComplete, unsigned flags)
+{
+    return (int) syscall (__NR_io_uring_enter, fd, toSubmit, minComplete, flags, nullptr, 0);
+}
+
+int ringRegister (int fd, unsigned opcode, const void* arg, unsigned numArgs)
+{
+    return (int) syscall (__NR_io_uring_register, fd, opcode, arg, numArgs);
+}
+
+void closeRing (Ring& ring)
+{
+    if (ring.sqes != nullptr)
+        munmap (ring.sqes, ring.sqesSize);
+
+    if (ring.cqRing != nullptr && ring.cqRing != ring.sqRing)
+        munmap (ring.cqRing, ring.cqRingSize);
+
+    if (ring.sqRing != nullptr)
+        munmap (ring.sqRing, ring.sqRingSize);
+
+    if (ring.fd >= 0)
+        close (ring.fd);
+
+    ring = Ring();
+}
+
+bool openRing (Ring& ring, unsigned entries)
+{
+    io_uring_params params;
+    memset (&params, 0, sizeof (params));
+
+    ring.fd = ringSetup (entries, &params);
+
+    if (ring.fd < 0)
+        return false;
+
+    ring.entries = params.sq_entries;
+    ring.sqRingSize = params.sq_off.array + params.sq_entries * sizeof (unsigned);
+    ring.cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof (io_uring_cqe);
+    ring.sqesSize = params.sq_entries * sizeof (io_uring_sqe);
+
+    const bool singleMap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+
+    if (singleMap)
+        ring.sqRingSize = ring.cqRingSize = std::max (ring.sqRingSize, ring.cqRingSize);
+
+    void* sqRing = mmap (nullptr, ring.sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQ_RING);
+
+    if (sqRing == MAP_FAILED)
+    {
+        closeRing (ring);
+        return false;
+    }
+
+    ring.sqRing = sqRing;
+
+    void* cqRing = sqRing;
+
+    if (! singleMap)
+    {
+        cqRing = mmap (nullptr, ring.cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_CQ_RING);
+
+        if (cqRing == MAP_FAILED)
+        {
+            closeRing (ring);
+            return false;
+        }
+    }
+
+    ring.cqRing = cqRing;
+
+    void* sqes = mmap (nullptr, ring.sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQES);
+
+    if (sqes == MAP_FAILED)
+    {
+        closeRing (ring);
+        return false;
+    }
+
+    ring.sqes = (io_uring_sqe*) sqes;
+
+    char* sq = (char*) sqRing;
+    ring.sqHead = (unsigned*) (sq + params.sq_off.head);
+    ring.sqTail = (unsigned*) (sq + params.sq_off.tail);
+    ring.sqMask = (unsigned*) (sq + params.sq_off.ring_mask);
+    ring.sqArray = (unsigned*) (sq + params.sq_off.array);
+
+    char* cq = (char*) cqRing;
+    ring.cqHead = (unsigned*) (cq + params.cq_off.head);
+    ring.cqTail = (unsigned*) (cq + params.cq_off.tail);
+    ring.cqMask = (unsigned*) (cq + params.cq_off.ring_mask);
+    ring.cqes = (io_uring_cqe*) (cq + params.cq_off.cqes);
+
+    return true;
+}
+
+bool writeFully (int fd, const char* data, size_t size, haddr_t addr)
+{
+    while (size > 0)
+    {
+        const ssize_t n = pwrite (fd, data, size, (off_t) addr);
+
+        if (n < 0 && errno == EINTR)
+            continue;
+
+        if (n <= 0)
+            return false;
+
+        data += n;
+        size -= (size_t) n;
+        addr += (haddr_t) n;
+    }
+
+    return true;
+}
+
+/** A write buffer and the file region it holds */
+struct Slot
+{
+    enum State
+    {
+        FREE,
+        FILLING,
+        PENDING
+    };
+
+    State state = FREE;
+
+    /* File region held by the buffer */
+    haddr_t addr = 0;
+    size_t size = 0;
+
+    /* Offset of the data within the buffer, so that file offsets and buffer addresses share the same alignment */
+    size_t lead = 0;
+
+    /* Part of the region submitted to the ring */
+    haddr_t ioAddr = 0;
+    size_t ioSize = 0;
+};
+
+/** A file holding the data of a driver file (one, or one per stripe directory) */
+struct Member
+{
+    int fd = -1;
+    int directFd = -1; // same file opened with O_DIRECT, or -1
+};
+
+/** Per-file state of the driver */
+struct UringFile
+{
+    H5FD_t pub; // must come first, HDF5 casts between H5FD_t and this struct
+
+    UringDriver::Options options;
+
+    std::vector<Member> members;
+    StripeSet stripes; // layout of the members, if striped
+    std::string descriptorPath;
+
+    haddr_t eoa = 0;
+    haddr_t eof = 0;
+    dev_t device = 0;
+    ino_t inode = 0;
+
+    Ring ring;
+    bool hasRing = false;
+    bool registered = false;
+
+    char* buffers = nullptr;
+    Slot slots[UringDriver::numBuffers];
+
+    int filling = -1; // slot that new contiguous writes are appended to
+    int numQueued = 0; // entries in the submission queue not yet passed to the kernel
+    int numPending = 0; // slots queued or in flight
+
+    bool failed = false;
+
+    char* bufferAt (int slot) { return buffers + (size_t) slot * UringDriver::bufferSize; }
+
+    bool isStriped() const { return members.size() > 1; }
+
+    /* Member file holding a file offset */
+    Member& memberAt (haddr_t addr) { return isStriped() ? members[stripes.memberOf (addr)] : members[0]; }
+
+    /* Offset within its member of a file offset */
+    haddr_t memberOffset (haddr_t addr) const { return isStriped() ? stripes.memberOffset (addr) : addr; }
+
+    /* Number of bytes from a file offset to the end of its stripe */
+    haddr_t toStripeEnd (haddr_t addr) const { return isStriped() ? stripes.stripeEnd (addr) - addr : MAX_ADDR; }
+
+    /* Address in memory of a file offset held by a slot */
+    char* dataAt (int slot, haddr_t addr) { return bufferAt (slot) + slots[slot].lead + (size_t) (addr - slots[slot].addr); }
+};
+
+/* Passes queued entries to the kernel, optionally waiting for at least one completion */
+bool enter (UringFile* file, unsigned minComplete)
+{
+    for (;;)
+    {
+        const unsigned flags = minComplete > 0 ? IORING_ENTER_GETEVENTS : 0;
+        const int ret = ringEnter (file->ring.fd, (unsigned) file->numQueued, minComplete, flags);
+
+        if (ret >= 0)
+        {
+            file->numQueued -= std::min (ret, file->numQueued);
+            return true;
+        }
+
+        if (errno != EINTR && errno != EAGAIN && errno != EBUSY)
+            return false;
+
+        if (errno == EBUSY)
+            return true; // completion queue is full; the caller reaps before retrying
+    }
+}
+
+/* Handles all available completions. Failed or short writes are finished synchronously. */
+void reap (UringFile* file)
+{
+    Ring& ring = file->ring;
+
+    unsigned head = *ring.cqHead;
+    const unsigned tail = __atomic_load_n (ring.cqTail, __ATOMIC_ACQUIRE);
+
+    while (head != tail)
+    {
+        const io_uring_cqe& cqe = ring.cqes[head & *ring.cqMask];
+        const int index = (int) cqe.user_data;
+        Slot& slot = file->slots[index];
+
+        const size_t done = cqe.res > 0 ? (size_t) cqe.res : 0;
+
+        const haddr_t remaining = slot.ioAddr + done;
+
+        if (done < slot.ioSize && ! writeFully (file->memberAt (remaining).fd, file->dataAt (index, remaining), slot.ioSize - done, file->memberOffset (remaining)))
+        {
+            std::cerr << "io_uring write of " << slot.ioSize << " bytes at " << slot.ioAddr << " failed" << std::endl;
+            file->failed = true;
+        }
+
+        slot.state = Slot::FREE;
+        file->numPending--;
+        head++;
+    }
+
+    __atomic_store_n (ring.cqHead, head, __ATOMIC_RELEASE);
+}
+
+/* Waits until every queued write has completed */
+bool waitAll (UringFile* file)
+{
+    while (file->numPending > 0)
+    {
+        if (! enter (file, 1))
+        {
+            file->failed = true;
+            return false;
+        }
+
+        reap (file);
+    }
+
+    return ! file->failed;
+}
+
+/* Adds a write of part of a slot to the submission queue, submitting a batch when enough are queued */
+bool submitSlot (UringFile* file, int index, int fd, haddr_t addr, size_t size)
+{
+    Ring& ring = file->ring;
+    Slot& slot = file->slots[index];
+
+    slot.ioAddr = addr;
+    slot.ioSize = size;
+
+    const unsigned tail = *ring.sqTail;
+
+    // there are as many queue entries as slots, so a free entry always exists
+    const unsigned entry = tail & *ring.sqMask;
+    io_uring_sqe* sqe = &ring.sqes[entry];
+    memset (sqe, 0, sizeof (*sqe));
+
+    sqe->opcode = file->registered ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t) file->dataAt (index, addr);
+    sqe->len = (uint32_t) size;
+    sqe->off = (uint64_t) file->memberOffset (addr);
+    sqe->buf_index = (uint16_t) index;
+    sqe->user_data = (uint64_t) index;
+
+    ring.sqArray[entry] = entry;
+    __atomic_store_n (ring.sqTail, tail + 1, __ATOMIC_RELEASE);
+
+    slot.state = Slot::PENDING;
+    file->numQueued++;
+    file->numPending++;
+
+    if (file->numQueued >= UringDriver::submitBatch && ! enter (file, 0))
+    {
+        file->failed = true;
+        return false;
+    }
+
+    return true;
+}
+
+/* Writes a filled slot. With direct I/O, the block-aligned middle of the region goes through the
+   O_DIRECT descriptor and the unaligned head and tail are written right away through the regular one. */
+bool writeSlot (UringFile* file, int index)
+{
+    Slot& slot = file->slots[index];
+
+    // slots never cross a stripe boundary, so the whole slot belongs to one member
+    const Member& member = file->memberAt (slot.addr);
+
+    haddr_t ioAddr = slot.addr;
+    size_t ioSize = slot.size;
+    int fd = member.fd;
+
+    if (member.directFd >= 0)
+    {
+        const haddr_t alignment = UringDriver::directAlignment;
+        const haddr_t end = slot.addr + slot.size;
+        const haddr_t alignedStart = (slot.addr + alignment - 1) / alignment * alignment;
+        const haddr_t alignedEnd = end / alignment * alignment;
+
+        if (alignedStart < alignedEnd)
+        {
+            if (! writeFully (member.fd, file->dataAt (index, slot.addr), (size_t) (alignedStart - slot.addr), file->memberOffset (slot.addr))
+                || ! writeFully (member.fd, file->dataAt (index, alignedEnd), (size_t) (end - alignedEnd), file->memberOffset (alignedEnd)))
+            {
+                file->failed = true;
+                return false;
+            }
+
+            ioAddr = alignedStart;
+            ioSize = (size_t) (alignedEnd - alignedStart);
+            fd = member.directFd;
+        }
+    }
+
+    if (file->hasRing)
+        return submitSlot (file, index, fd, ioAddr, ioSize);
+
+    const bool ok = writeFully (fd, file->dataAt (index, ioAddr), ioSize, file->memberOffset (ioAddr))
+                    || writeFully (member.fd, file->dataAt (index, ioAddr), ioSize, file->memberOffset (ioAddr));
+
+    slot.state = Slot::FREE;
+
+    if (! ok)
+        file->failed = true;
+
+    return ok;
+}
+
+/* Writes the slot being filled, if any */
+bool sealFilling (UringFile* file)
+{
+    if (file->filling < 0)
+        return true;
+
+    const int index = file->filling;
+    file->filling = -1;
+
+    return writeSlot (file, index);
+}
+
+/* Returns true if [addr, addr + size) overlaps a queued or in-flight write */
+bool overlapsPending (const UringFile* file, haddr_t addr, size_t size)
+{
+    for (const Slot& slot : file->slots)
+    {
+        if (slot.state == Slot::PENDING && addr < slot.addr + slot.size && slot.addr < addr + size)
+            return true;
+    }
+
+    return false;
+}
+
+/* Returns the index of a free slot, waiting for a completion if all are in use */
+int acquireSlot (UringFile* file)
+{
+    for (;;)
+    {
+        for (int i = 0; i < UringDriver::numBuffers; i++)
+        {
+            if (file->slots[i].state == Slot::FREE)
+                return i;
+        }
+
+        if (! file->hasRing || ! enter (file, 1))
+        {
+            file->failed = true;
+            return -1;
+        }
+
+        reap (file);
+    }
+}
+
+bool drain (UringFile* file)
+{
+    if (file->buffers == nullptr)
+        return ! file->failed;
+
+    if (! sealFilling (file))
+        return false;
+
+    return file->hasRing ? waitAll (file) : ! file->failed;
+}
+
+bool allocateBuffers (UringFile* file)
+{
+    void* buffers = nullptr;
+
+    if (posix_memalign (&buffers, UringDriver::directAlignment, (size_t) UringDriver::numBuffers * UringDriver::bufferSize) != 0)
+        return false;
+
+    file->buffers = (char*) buffers;
+    return true;
+}
+
+bool setupRing (UringFile* file)
+{
+    if (! openRing (file->ring, UringDriver::numBuffers))
+        return false;
+
+    iovec iov[UringDriver::numBuffers];
+
+    for (int i = 0; i < UringDriver::numBuffers; i++)
+    {
+        iov[i].iov_base = file->bufferAt (i);
+        iov[i].iov_len = UringDriver::bufferSize;
+    }
+
+    // registration pins the buffers and can exceed RLIMIT_MEMLOCK; unregistered buffers still work, just with more overhead per write
+    file->registered = ringRegister (file->ring.fd, IORING_REGISTER_BUFFERS, iov, UringDriver::numBuffers) == 0;
+    file->hasRing = true;
+
+    return true;
+}
+
+void* uringFaplCopy (const void* fapl)
+{
+    UringDriver::Options* copy = (UringDriver::Options*) malloc (sizeof (UringDriver::Options));
+
+    if (copy != nullptr)
+        memcpy (copy, fapl, sizeof (UringDriver::Options));
+
+    return copy;
+}
+
+herr_t uringFaplFree (void* fapl)
+{
+    free (fapl);
+    return 0;
+}
+
+void* uringFaplGet (H5FD_t* _file)
+{
+    return uringFaplCopy (&((UringFile*) _file)->options);
+}
+
+/* Finds the member files of a file: the file itself, or the members of a striped set.
+   Existing striped sets are described by their descriptor, new ones by the driver options. */
+void getMembers (UringFile* file, const char* name, unsigned flags)
+{
+    const std::string descriptorPath = StripeSet::descriptorPath (name);
+
+    if (! (flags & H5F_ACC_TRUNC) && file->stripes.read (descriptorPath))
+    {
+        file->descriptorPath = descriptorPath;
+        return;
+    }
+
+    file->stripes = StripeSet();
+
+    if (! (flags & H5F_ACC_RDWR) || file->options.stripeDirs[0] == '\0' || file->options.stripeSize == 0)
+    {
+        file->stripes.members.push_back (name);
+        return;
+    }
+
+    std::string baseName = name;
+    const size_t separator = baseName.find_last_of ('/');
+
+    if (separator != std::string::npos)
+        baseName = baseName.substr (separator + 1);
+
+    const std::string directories = file->options.stripeDirs;
+    size_t start = 0;
+
+    while (start <= directories.size())
+    {
+        size_t end = directories.find (';', start);
+
+        if (end == std::string::npos)
+            end = directories.size();
+
+        if (end > start)
+        {
+            const std::string member = directories.substr (start, end - start) + "/" + baseName + "." + std::to_string (file->stripes.members.size());
+            file->stripes.members.push_back (member);
+        }
+
+        start = end + 1;
+    }
+
+    file->stripes.stripeSize = file->options.stripeSize;
+    file->descriptorPath = descriptorPath;
+}
+
+bool closeMembers (UringFile* file)
+{
+    bool ok = true;
+
+    for (Member& member : file->members)
+    {
+        if (member.directFd >= 0 && close (member.directFd) != 0)
+            ok = false;
+
+        if (member.fd >= 0 && close (member.fd) != 0)
+            ok = false;
+    }
+
+    file->members.clear();
+
+    return ok;
+}
+
+/* Records the layout and size of a striped file */
+bool writeDescriptor (UringFile* file)
+{
+    if (file->descriptorPath.empty() || ! (file->pub.access_flags & H5F_ACC_RDWR))
+        return true;
+
+    file->stripes.size = file->eof;
+    return file->stripes.write (file->descriptorPath);
+}
+
+H5FD_t* uringOpen (const char* name, unsigned flags, hid_t fapl, haddr_t maxaddr)
+{
+    if (name == nullptr || *name == '\0' || maxaddr == 0 || maxaddr == HADDR_UNDEF || maxaddr > MAX_ADDR)
+        return nullptr;
+
+    int oflags = (flags & H5F_ACC_RDWR) ? O_RDWR : O_RDONLY;
+
+    if (flags & H5F_ACC_TRUNC)
+        oflags |= O_TRUNC;
+    if (flags & H5F_ACC_CREAT)
+        oflags |= O_CREAT;
+    if (flags & H5F_ACC_EXCL)
+        oflags |= O_EXCL;
+
+    UringFile* file = new (std::nothrow) UringFile();
+
+    if (file == nullptr)
+        return nullptr;
+
+    const UringDriver::Options* options = (const UringDriver::Options*) H5Pget_driver_info (fapl);
+
+    if (options != nullptr)
+        file->options = *options;
+
+    getMembers (file, name, flags);
+
+    for (const std::string& path : file->stripes.members)
+    {
+        Member member;
+        member.fd = open (path.c_str(), oflags, 0666);
+
+        struct stat sb;
+
+        if (member.fd < 0 || fstat (member.fd, &sb) < 0)
+        {
+            if (member.fd >= 0)
+                close (member.fd);
+
+            closeMembers (file);
+            delete file;
+            return nullptr;
+        }
+
+        if (file->members.empty())
+        {
+            file->device = sb.st_dev;
+            file->inode = sb.st_ino;
+        }
+
+        const haddr_t end = file->descriptorPath.empty() ? (haddr_t) sb.st_size : file->stripes.fileEnd ((int) file->members.size(), sb.st_size);
+        file->eof = std::max (file->eof, end);
+
+        file->members.push_back (member);
+    }
+
+    // read-only files are read synchronously and need none of the write machinery
+    if (! (flags & H5F_ACC_RDWR))
+        return &file->pub;
+
+    if (! allocateBuffers (file))
+    {
+        closeMembers (file);
+        delete file;
+        return nullptr;
+    }
+
+    if (file->options.directIO)
+    {
+        // the members already exist (and have been truncated) at this point
+        for (int i = 0; i < (int) file->members.size(); i++)
+        {
+            file->members[i].directFd = open (file->stripes.members[i].c_str(), O_WRONLY | O_DIRECT);
+
+            if (file->members[i].directFd < 0)
+                std::cout << "O_DIRECT is not supported for " << file->stripes.members[i] << ", writing through the page cache" << std::endl;
+        }
+    }
+
+    if (file->options.useRing && ! setupRing (file))
+        std::cout << "io_uring unavailable for " << name << ", writing synchronously" << std::endl;
+
+    file->pub.access_flags = flags;
+
+    if (! writeDescriptor (file))
+        std::cerr << "Could not write stripe descriptor " << file->descriptorPath << std::endl;
+
+    return &file->pub;
+}
+
+herr_t uringClose (H5FD_t* _file)
+{
+    UringFile* file = (UringFile*) _file;
+
+    bool ok = drain (file);
+
+    if (file->hasRing)
+        closeRing (file->ring);
+
+    free (file->buffers);
+
+    ok = writeDescriptor (file) && ok;
+    ok = closeMembers (file) && ok;
+
+    delete file;
+
+    return ok ? 0 : -1;
+}
+
+int uringCmp (const H5FD_t* _f1, const H5FD_t* _f2)
+{
+    const UringFile* f1 = (const UringFile*) _f1;
+    const UringFile* f2 = (const UringFile*) _f2;
+
+    if (f1->device != f2->device)
+        return f1->device < f2->device ? -1 : 1;
+
+    if (f1->inode != f2->inode)
+        return f1->inode < f2->inode ? -1 : 1;
+
+    return 0;
+}
+
+herr_t uringQuery (const H5FD_t* _file, unsigned long* flags)
+{
+    if (flags != nullptr)
+    {
+        *flags = H5FD_FEAT_AGGREGATE_METADATA | H5FD_FEAT_ACCUMULATE_METADATA | H5FD_FEAT_DATA_SIEVE
+                 | H5FD_FEAT_AGGREGATE_SMALLDATA;
+
+        // a single file has the layout of the default driver, a striped file only exists as its members
+        if (_file == nullptr || ! ((const UringFile*) _file)->isStriped())
+            *flags |= H5FD_FEAT_DEFAULT_VFD_COMPATIBLE;
+    }
+
+    return 0;
+}
+
+haddr_t uringGetEoa (const H5FD_t* _file, H5FD_mem_t)
+{
+    return ((const UringFile*) _file)->eoa;
+}
+
+herr_t uringSetEoa (H5FD_t* _file, H5FD_mem_t, haddr_t addr)
+{
+    ((UringFile*) _file)->eoa = addr;
+    return 0;
+}
+
+haddr_t uringGetEof (const H5FD_t* _file, H5FD_mem_t)
+{
+    return ((const UringFile*) _file)->eof;
+}
+
+herr_t uringGetHandle (H5FD_t* _file, hid_t, void** handle)
+{
+    if (handle == nullptr)
+        return -1;
+
+    *handle = &((UringFile*) _file)->members[0].fd;
+    return 0;
+}
+
+herr_t uringRead (H5FD_t* _file, H5FD_mem_t, hid_t, haddr_t addr, size_t size, void* buf)
+{
+    UringFile* file = (UringFile*) _file;
+
+    if (addr == HADDR_UNDEF || addr + size > file->eoa)
+        return -1;
+
+    if (! drain (file))
+        return -1;
+
+    char* dest = (char*) buf;
+
+    while (size > 0)
+    {
+        const size_t toRead = (size_t) std::min ((haddr_t) size, file->toStripeEnd (addr));
+        const ssize_t n = pread (file->memberAt (addr).fd, dest, toRead, (off_t) file->memberOffset (addr));
+
+        if (n < 0 && errno == EINTR)
+            continue;
+
+        if (n < 0)
+            return -1;
+
+        // reading past the end of the file (or of a member) returns zeros
+        const size_t done = n > 0 ? (size_t) n : toRead;
+
+        if (n == 0)
+            memset (dest, 0, toRead);
+
+        dest += done;
+        size -= done;
+        addr += (haddr_t) done;
+    }
+
+    return 0;
+}
+
+herr_t uringWrite (H5FD_t* _file, H5FD_mem_t, hid_t, haddr_t addr, size_t size, const void* buf)
+{
+    UringFile* file = (UringFile*) _file;
+
+    if (addr == HADDR_UNDEF || addr + size > file->eoa || file->failed || file->buffers == nullptr)
+        return -1;
+
+    const haddr_t end = addr + size;
+    const char* src = (const char*) buf;
+
+    while (size > 0)
+    {
+        if (file->filling >= 0)
+        {
+            const Slot& slot = file->slots[file->filling];
+
+            // a slot only holds contiguous data from a single stripe
+            if (slot.addr + slot.size != addr || slot.lead + slot.size == UringDriver::bufferSize
+                || (file->isStriped() && addr % file->stripes.stripeSize == 0))
+            {
+                if (! sealFilling (file))
+                    return -1;
+            }
+        }
+
+        const size_t lead = file->filling >= 0 ? file->slots[file->filling].lead : (size_t) (addr % UringDriver::directAlignment);
+        const size_t used = file->filling >= 0 ? file->slots[file->filling].size : 0;
+        const size_t n = (size_t) std::min ((haddr_t) std::min (size, UringDriver::bufferSize - lead - used), file->toStripeEnd (addr));
+
+        // writes to the same region must reach the disk in order
+        if (overlapsPending (file, addr, n) && ! waitAll (file))
+            return -1;
+
+        if (file->filling < 0)
+        {
+            const int index = acquireSlot (file);
+
+            if (index < 0)
+                return -1;
+
+            file->slots[index].state = Slot::FILLING;
+            file->slots[index].addr = addr;
+            file->slots[index].size = 0;
+            file->slots[index].lead = lead;
+            file->filling = index;
+        }
+
+        Slot& slot = file->slots[file->filling];
+
+        memcpy (file->dataAt (file->filling, addr), src, n);
+        slot.size += n;
+
+        src += n;
+        addr += n;
+        size -= n;
+    }
+
+    file->eof = std::max (file->eof, end);
+
+    return 0;
+}
+
+herr_t uringFlush (H5FD_t* _file, hid_t, hbool_t)
+{
+    return drain ((UringFile*) _file) ? 0 : -1;
+}
+
+herr_t uringTruncate (H5FD_t* _file, hid_t, hbool_t)
+{
+    UringFile* file = (UringFile*) _file;
+
+    if (! drain (file))
+        return -1;
+
+    if (file->eoa != file->eof)
+    {
+        for (int i = 0; i < (int) file->members.size(); i++)
+        {
+            const haddr_t length = file->isStriped() ? file->stripes.memberSize (i, file->eoa) : file->eoa;
+
+            if (ftruncate (file->members[i].fd, (off_t) length) < 0)
+                return -1;
+        }
+
+        file->eof = file->eoa;
+    }
+
+    return writeDescriptor (file) ? 0 : -1;
+}
+
+herr_t uringLock (H5FD_t* _file, hbool_t rw)
+{
+    const int operation = (rw ? LOCK_EX : LOCK_SH) | LOCK_NB;
+
+    if (flock (((UringFile*) _file)->members[0].fd, operation) < 0 && errno != ENOSYS)
+        return -1;
+
+    return 0;
+}
+
+herr_t uringUnlock (H5FD_t* _file)
+{
+    if (flock (((UringFile*) _file)->members[0].fd, LOCK_UN) < 0 && errno != ENOSYS)
+        return -1;
+
+    return 0;
+}
+
+herr_t uringDelete (const char* name, hid_t)
+{
+    const std::string descriptorPath = StripeSet::descriptorPath (name);
+    StripeSet stripes;
+
+    if (! stripes.read (descriptorPath))
+        return remove (name) == 0 ? 0 : -1;
+
+    bool ok = true;
+
+    for (const std::string& member : stripes.members)
+        ok = remove (member.c_str()) == 0 && ok;
+
+    return (remove (descriptorPath.c_str()) == 0 && ok) ? 0 : -1;
+}
+
+const H5FD_class_t uringClass = {
+    H5FD_CLASS_VERSION, /* struct version */
+    DRIVER_VALUE, /* value */
+    "nwb_io_uring", /* name */
+    MAX_ADDR, /* maxaddr */
+    H5F_CLOSE_WEAK, /* fc_degree */
+    nullptr, /* terminate */
+    nullptr, /* sb_size */
+    nullptr, /* sb_encode */
+    nullptr, /* sb_decode */
+    sizeof (UringDriver::Options), /* fapl_size */
+    uringFaplGet, /* fapl_get */
+    uringFaplCopy, /* fapl_copy */
+    uringFaplFree, /* fapl_free */
+    0, /* dxpl_size */
+    nullptr, /* dxpl_copy */
+    nullptr, /* dxpl_free */
+    uringOpen, /* open */
+    uringClose, /* close */
+    uringCmp, /* cmp */
+    uringQuery, /* query */
+    nullptr, /* get_type_map */
+    nullptr, /* alloc */
+    nullptr, /* free */
+    uringGetEoa, /* get_eoa */
+    uringSetEoa, /* set_eoa */
+    uringGetEof, /* get_eof */
+    uringGetHandle, /* get_handle */
+    uringRead, /* read */
+    uringWrite, /* write */
+    nullptr, /* read_vector */
+    nullptr, /* write_vector */
+    nullptr, /* read_selection */
+    nullptr, /* write_selection */
+    uringFlush, /* flush */
+    uringTruncate, /* truncate */
+    uringLock, /* lock */
+    uringUnlock, /* unlock */
+    uringDelete, /* del */
+    nullptr, /* ctl */
+    H5FD_FLMAP_DICHOTOMY /* fl_map */
+};
+
+hid_t getDriverId()
+{
+    static const hid_t driverId = H5FDregister (&uringClass);
+    return driverId;
+}
+
+} // namespace
+
+bool UringDriver::isAvailable()
+{
+    // io_uring can be missing from the kernel or disabled by the administrator (kernel.io_uring_disabled)
+    static const bool available = []
+    {
+        Ring ring;
+
+        if (! openRing (ring, 1))
+            return false;
+
+        closeRing (ring);
+        return true;
+    }();
+
+    return available;
+}
+
+bool UringDriver::setDriver (hid_t fapl, const Options& options)
+{
+    Options fileOptions = options;
+    fileOptions.useRing = options.useRing && isAvailable();
+
+    const bool striped = fileOptions.stripeDirs[0] != '\0' && fileOptions.stripeSize > 0;
+
+    if (! fileOptions.useRing && ! fileOptions.directIO && ! striped)
+        return false;
+
+    const hid_t driverId = getDriverId();
+
+    if (driverId < 0)
+        return false;
+
+    return H5Pset_driver (fapl, driverId, &fileOptions) >= 0;
+}
+
+#else
+
+using namespace NWBRecording;
+
+bool UringDriver::isAvailable()
+{
+    return false;
+}
+
+bool UringDriver::setDriver (hid_t, const Options&)
+{
+    return false;
+}
+
+#endif
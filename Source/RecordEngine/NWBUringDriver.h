@@ -0,0 +1,99 @@
+/*
+    ------------------------------------------------------------------
+
+    This file is part of the Open Ephys GUI
+    Copyright (C) 2024 Open Ephys
+
+    ------------------------------------------------------------------
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef NWBURINGDRIVER_H
+#define NWBURINGDRIVER_H
+
+#include <hdf5.h>
+
+#include <cstdint>
+
+namespace NWBRecording
+{
+
+/**
+        HDF5 virtual file driver that writes through a Linux io_uring
+
+        Writes are copied into a pool of registered buffers and submitted to the
+        kernel in batches, so the writing thread does not block on each pwrite.
+        Contiguous writes are merged into the same buffer. Reads, flushes and
+        truncation wait for all pending writes, and a write overlapping a pending
+        one waits for it first, so the file is always consistent from HDF5's point
+        of view.
+
+        Files can be striped across several directories (one per disk): the file is
+        split into stripeSize regions distributed round-robin across member files,
+        described by a StripeSet descriptor next to the file. With io_uring, writes
+        to different disks are in flight at the same time.
+
+        The driver can also bypass the page cache: the block-aligned part of each
+        buffer is written through an O_DIRECT descriptor, while unaligned heads and
+        tails (mostly small metadata writes) go through a regular descriptor. Large
+        allocations must then be aligned in the file (H5Pset_alignment) for raw data
+        to avoid the page cache. Direct I/O does not require io_uring.
+
+        io_uring is only available on Linux kernels that support it and O_DIRECT
+        only on Linux file systems that support it; otherwise the driver falls back
+        to regular synchronous writes.
+     */
+class UringDriver
+{
+public:
+    /** Driver settings, stored in the file access property list */
+    struct Options
+    {
+        /** Submit writes through io_uring */
+        bool useRing = true;
+
+        /** Write block-aligned data with O_DIRECT */
+        bool directIO = false;
+
+        /** Size of the regions distributed across the stripe directories (a multiple of directAlignment) */
+        uint64_t stripeSize = 0;
+
+        /** Directories (separated by ';') that the file is striped across, one per disk; empty to write a single file */
+        char stripeDirs[4096] = {};
+    };
+
+    /** Returns true if io_uring can be used on this system */
+    static bool isAvailable();
+
+    /** Selects this driver on a file access property list. Returns false, leaving the list unchanged, if none of the options can be used */
+    static bool setDriver (hid_t fapl, const Options& options);
+
+    /** Number of write buffers (and submission queue entries) per file */
+    static constexpr int numBuffers = 8;
+
+    /** Size of each write buffer */
+    static constexpr size_t bufferSize = 1 << 20;
+
+    /** Number of filled buffers queued before they are submitted to the kernel */
+    static constexpr int submitBatch = 4;
+
+    /** Alignment of file offsets, lengths and memory for direct I/O (covers 512 and 4096 byte logical blocks) */
+    static constexpr size_t directAlignment = 4096;
+};
+
+} // namespace NWBRecording
+
+#endif
@@ -0,0 +1,216 @@
+/*
+    ------------------------------------------------------------------
+
+    This file is part of the Open Ephys GUI
+    Copyright (C) 2024 Open Ephys
+
+    ------------------------------------------------------------------
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include "NWBVirtualSegments.h"
+
+#include <iostream>
+#include <vector>
+
+using namespace NWBRecording;
+
+bool VirtualSegments::remap (const String& path, const Array<VirtualSegment>& segments, const String& currentSegment)
+{
+    if (segments.size() == 0)
+        return true;
+
+    const hid_t file = H5Fopen (path.toRawUTF8(), H5F_ACC_RDWR, H5P_DEFAULT);
+
+    if (file < 0)
+        return false;
+
+    bool ok = true;
+
+    // all segments of an experiment have the same datasets
+    for (auto& entry : segments.getReference (0).rows)
+    {
+        if (! map (file, entry.first, segments, currentSegment))
+        {
+            std::cerr << "Error mapping " << entry.first << " into " << path << std::endl;
+            ok = false;
+        }
+
+        if (! entry.first.endsWith ("/data"))
+            continue;
+
+        // the number of samples of each series in the finished segments
+        const String series = entry.first.dropLastCharacters (5);
+        uint64 numSamples = 0;
+
+        for (auto& segment : segments)
+        {
+            auto rows = segment.rows.find (entry.first);
+
+            if (rows != segment.rows.end())
+                numSamples += rows->second;
+        }
+
+        if (H5Aexists_by_name (file, series.toRawUTF8(), "num_samples", H5P_DEFAULT) > 0)
+        {
+            const hid_t attribute = H5Aopen_by_name (file, series.toRawUTF8(), "num_samples", H5P_DEFAULT, H5P_DEFAULT);
+            ok = attribute >= 0 && H5Awrite (attribute, H5T_NATIVE_UINT64, &numSamples) >= 0 && ok;
+
+            if (attribute >= 0)
+                H5Aclose (attribute);
+        }
+    }
+
+    return H5Fclose (file) >= 0 && ok;
+}
+
+/** Copies an attribute of the object at location to the object whose identifier is pointed to by data */
+static herr_t copyAttribute (hid_t location, const char* name, const H5A_info_t*, void* data)
+{
+    const hid_t target = *static_cast<hid_t*> (data);
+
+    const hid_t attribute = H5Aopen (location, name, H5P_DEFAULT);
+    const hid_t type = H5Aget_type (attribute);
+    const hid_t space = H5Aget_space (attribute);
+
+    std::vector<char> buffer ((size_t) jmax<hssize_t> (1, H5Sget_simple_extent_npoints (space)) * H5Tget_size (type));
+
+    herr_t ret = H5Aread (attribute, type, buffer.data());
+
+    if (ret >= 0)
+    {
+        const hid_t copy = H5Acreate2 (target, name, type, space, H5P_DEFAULT, H5P_DEFAULT);
+        ret = copy >= 0 ? H5Awrite (copy, type, buffer.data()) : -1;
+
+        if (copy >= 0)
+            H5Aclose (copy);
+
+        // frees variable length strings, does nothing for other types
+        H5Treclaim (type, space, H5P_DEFAULT, buffer.data());
+    }
+
+    H5Sclose (space);
+    H5Tclose (type);
+    H5Aclose (attribute);
+
+    return ret < 0 ? -1 : 0;
+}
+
+bool VirtualSegments::map (hid_t fileId, const String& path, const Array<VirtualSegment>& segments, const String& currentSegment)
+{
+    const hid_t dataSet = H5Dopen2 (fileId, path.toRawUTF8(), H5P_DEFAULT);
+
+    if (dataSet < 0)
+        return false;
+
+    const hid_t type = H5Dget_type (dataSet);
+    const hid_t space = H5Dget_space (dataSet);
+    const int rank = H5Sget_simple_extent_ndims (space);
+
+    // rows of channels (continuous data), or of channels and samples (spike waveforms)
+    hsize_t dims[3] = { 0, 1, 1 };
+
+    if (rank >= 1 && rank <= 3)
+        H5Sget_simple_extent_dims (space, dims, nullptr);
+
+    H5Sclose (space);
+
+    if (rank < 1 || rank > 3)
+    {
+        H5Tclose (type);
+        H5Dclose (dataSet);
+        return false;
+    }
+
+    hsize_t totalRows = 0;
+
+    for (auto& segment : segments)
+    {
+        auto rows = segment.rows.find (path);
+
+        if (rows != segment.rows.end())
+            totalRows += rows->second;
+    }
+
+    hsize_t size[3] = { totalRows, dims[1], dims[2] };
+    hsize_t maxSize[3] = { H5S_UNLIMITED, dims[1], dims[2] };
+    const hid_t virtualSpace = H5Screate_simple (rank, size, maxSize);
+    const hid_t dcpl = H5Pcreate (H5P_DATASET_CREATE);
+
+    // each finished segment maps to a fixed block of rows, in order
+    hsize_t firstRow = 0;
+
+    for (auto& segment : segments)
+    {
+        auto rows = segment.rows.find (path);
+
+        if (rows == segment.rows.end() || rows->second == 0)
+            continue;
+
+        hsize_t start[3] = { firstRow, 0, 0 };
+        hsize_t count[3] = { rows->second, dims[1], dims[2] };
+        H5Sselect_hyperslab (virtualSpace, H5S_SELECT_SET, start, nullptr, count, nullptr);
+
+        const hid_t sourceSpace = H5Screate_simple (rank, count, nullptr);
+        H5Pset_virtual (dcpl, virtualSpace, segment.fileName.toRawUTF8(), path.toRawUTF8(), sourceSpace);
+        H5Sclose (sourceSpace);
+
+        firstRow += rows->second;
+    }
+
+    // the current segment is still being written, so all of its rows are mapped after the finished ones
+    if (currentSegment.isNotEmpty())
+    {
+        hsize_t start[3] = { firstRow, 0, 0 };
+        hsize_t origin[3] = { 0, 0, 0 };
+        hsize_t stride[3] = { 1, 1, 1 };
+        hsize_t count[3] = { H5S_UNLIMITED, 1, 1 };
+        hsize_t block[3] = { 1, dims[1], dims[2] };
+        H5Sselect_hyperslab (virtualSpace, H5S_SELECT_SET, start, stride, count, block);
+
+        hsize_t sourceSize[3] = { 0, dims[1], dims[2] };
+        const hid_t sourceSpace = H5Screate_simple (rank, sourceSize, maxSize);
+        H5Sselect_hyperslab (sourceSpace, H5S_SELECT_SET, origin, stride, count, block);
+        H5Pset_virtual (dcpl, virtualSpace, currentSegment.toRawUTF8(), path.toRawUTF8(), sourceSpace);
+        H5Sclose (sourceSpace);
+    }
+
+    // the virtual dataset is created next to the original, then takes its place
+    const String tempPath = path + ".virtual";
+    hid_t virtualSet = H5Dcreate2 (fileId, tempPath.toRawUTF8(), type, virtualSpace, H5P_DEFAULT, dcpl, H5P_DEFAULT);
+
+    H5Pclose (dcpl);
+    H5Sclose (virtualSpace);
+    H5Tclose (type);
+
+    bool ok = virtualSet >= 0
+              && H5Aiterate2 (dataSet, H5_INDEX_NAME, H5_ITER_NATIVE, nullptr, copyAttribute, &virtualSet) >= 0;
+
+    H5Dclose (dataSet);
+
+    if (virtualSet >= 0)
+        H5Dclose (virtualSet);
+
+    ok = ok
+         && H5Ldelete (fileId, path.toRawUTF8(), H5P_DEFAULT) >= 0
+         && H5Lmove (fileId, tempPath.toRawUTF8(), fileId, path.toRawUTF8(), H5P_DEFAULT, H5P_DEFAULT) >= 0;
+
+    // a failed replacement leaves the previous mapping in place
+    if (! ok && H5Lexists (fileId, tempPath.toRawUTF8(), H5P_DEFAULT) > 0)
+        H5Ldelete (fileId, tempPath.toRawUTF8(), H5P_DEFAULT);
+
+    return ok;
+}
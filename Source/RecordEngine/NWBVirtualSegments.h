@@ -0,0 +1,69 @@
+/*
+    ------------------------------------------------------------------
+
+    This file is part of the Open Ephys GUI
+    Copyright (C) 2024 Open Ephys
+
+    ------------------------------------------------------------------
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef NWBVIRTUALSEGMENTS_H
+#define NWBVIRTUALSEGMENTS_H
+
+#include <RecordingLib.h>
+
+#include <hdf5.h>
+
+#include <map>
+
+namespace NWBRecording
+{
+
+/**
+        Rows written to the continuous and TTL series of one segment of a
+        recording, used to map the segment into the virtual datasets of a
+        master file
+     */
+struct VirtualSegment
+{
+    /** Name of the segment file, relative to the master file, or its full path on another disk */
+    String fileName;
+
+    /** Number of rows written to each dataset, keyed by dataset path */
+    std::map<String, uint64> rows;
+};
+
+/**
+        Maps the datasets of a master file to the same datasets in the segments
+        of a recording, with virtual datasets that concatenate their rows
+     */
+class VirtualSegments
+{
+public:
+    /** Replaces the dataset at path in a file by a virtual dataset with the same type and attributes, mapping the
+        finished segments in order, then all the rows of currentSegment (if not empty) as it grows */
+    static bool map (hid_t fileId, const String& path, const Array<VirtualSegment>& segments, const String& currentSegment);
+
+    /** Maps the virtual datasets of the closed master file at path (see NWBFile::makeVirtual) to a new list of segments,
+        in place, and sets the num_samples of its series to the samples of the finished segments. An empty currentSegment
+        maps only the finished segments, once the last one is closed. */
+    static bool remap (const String& path, const Array<VirtualSegment>& segments, const String& currentSegment);
+};
+
+} // namespace NWBRecording
+
+#endif
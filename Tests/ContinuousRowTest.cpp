@@ -0,0 +1,236 @@
+/*
+    ------------------------------------------------------------------
+
+    This file is part of the Open Ephys GUI
+    Copyright (C) 2024 Open Ephys
+
+    ------------------------------------------------------------------
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+/*
+        Aligns events with the rows of a continuous series
+
+        ContinuousRowMap is checked on its own first. A recording is then written
+        the way the record engine writes it: continuous blocks in two runs of sample
+        numbers, with the continuous_row of each event written once the block holding
+        it is, and the rows of the events left pending forced out at the end. The
+        windows IndexReader reads around each continuous_row must hold the samples
+        of the events, and stay zero for events without a row.
+
+        Usage: ContinuousRowTest <work directory>
+     */
+
+#include "NWBTestUtils.h"
+
+#include <NWBContinuousRows.h>
+#include <NWBIndexReader.h>
+
+using namespace NWBRecording;
+
+namespace
+{
+
+const int numChannels = 2;
+const int blockRows = 64;
+const int samplesBefore = 4;
+const int samplesAfter = 4;
+const double sampleRate = 1000.0;
+
+/** Value of a sample of the continuous data */
+int16_t valueOf (int64_t sampleNumber, int channel)
+{
+    return int16_t (channel == 0 ? sampleNumber : -sampleNumber);
+}
+
+void checkRowMap()
+{
+    ContinuousRowMap rows;
+
+    CHECK (rows.getNumRows() == 0);
+    CHECK (! rows.covers (0));
+    CHECK (rows.getRow (0) == -1);
+    CHECK (rows.extrapolateRow (int64_t (0)) == -1);
+    CHECK (rows.extrapolateRow (1.0, sampleRate) == -1);
+
+    rows.addRows (100, 50, 1.0);
+
+    CHECK (rows.covers (149) && ! rows.covers (150));
+    CHECK (rows.getRow (99) == -1 && rows.getRow (100) == 0 && rows.getRow (149) == 49 && rows.getRow (150) == -1);
+    CHECK (rows.extrapolateRow (int64_t (99)) == -1 && rows.extrapolateRow (int64_t (160)) == 60);
+    CHECK (rows.extrapolateRow (1.010, sampleRate) == 10 && rows.extrapolateRow (0.5, sampleRate) == -1);
+
+    // contiguous sample numbers extend the run, and empty blocks are ignored
+    rows.addRows (150, 50, 1.05);
+    rows.addRows (500, 0, 9.0);
+
+    CHECK (rows.getNumRows() == 100);
+    CHECK (rows.getRow (120) == 20 && rows.getRow (199) == 99);
+
+    // a jump in sample numbers starts a new run, before which events have no row
+    rows.addRows (1000, 30, 5.0);
+
+    CHECK (rows.getNumRows() == 130);
+    CHECK (rows.covers (120) && rows.getRow (120) == -1);
+    CHECK (rows.getRow (1000) == 100 && rows.getRow (1029) == 129 && rows.getRow (1030) == -1);
+    CHECK (rows.extrapolateRow (int64_t (1040)) == 140);
+    CHECK (rows.extrapolateRow (5.020, sampleRate) == 120 && rows.extrapolateRow (4.9, sampleRate) == -1);
+}
+
+/** Writes the object reference to the continuous series that continuous_row refers to */
+bool writeSeriesReference (hid_t file, const std::string& path, const std::string& seriesPath)
+{
+    hobj_ref_t reference;
+
+    if (H5Rcreate (&reference, file, seriesPath.c_str(), H5R_OBJECT, -1) < 0)
+        return false;
+
+    const hid_t space = H5Screate (H5S_SCALAR);
+    const hid_t attribute = H5Acreate_by_name (file, path.c_str(), "series", H5T_STD_REF_OBJ, space, H5P_DEFAULT, H5P_DEFAULT, H5P_DEFAULT);
+    const bool ok = attribute >= 0 && H5Awrite (attribute, H5T_STD_REF_OBJ, &reference) >= 0;
+
+    if (attribute >= 0)
+        H5Aclose (attribute);
+
+    H5Sclose (space);
+
+    return ok;
+}
+
+void checkAlignedWindows (const std::string& path)
+{
+    // two runs of sample numbers, as two recordings in the same file
+    const std::vector<std::pair<int64_t, int>> runs = { { 10, 4 }, { 1000, 3 } };
+
+    // in order of arrival: before the first run, at its start, overlapping windows, between the runs,
+    // across the end of the first run, and after the last row
+    const std::vector<int64_t> events = { 5, 11, 40, 200, 202, 300, 1002, 1100, 5000 };
+    const std::vector<bool> hasRow = { false, true, true, true, true, false, true, true, false };
+
+    const hid_t file = H5Fcreate (path.c_str(), H5F_ACC_TRUNC, H5P_DEFAULT, H5P_DEFAULT);
+    CHECK (file >= 0);
+
+    if (file < 0)
+        return;
+
+    const hid_t data = NWBTest::createDataSet (file, "/acquisition/continuous/data", H5T_STD_I16LE, numChannels);
+    const hid_t continuousRows = NWBTest::createDataSet (file, "/acquisition/events/continuous_row", H5T_STD_I64LE, 0);
+
+    ContinuousRowMap rows;
+    std::vector<int64_t> sampleNumbers;
+    size_t pending = 0;
+
+    /* the row of an event is written once the block holding it is, or when forced */
+    auto flushRows = [&] (bool force)
+    {
+        while (pending < events.size() && (force || rows.covers (events[pending])))
+        {
+            const int64_t row = rows.getRow (events[pending++]);
+            CHECK (NWBTest::appendRows (continuousRows, H5T_NATIVE_INT64, 1, &row));
+        }
+    };
+
+    for (auto& run : runs)
+    {
+        for (int block = 0; block < run.second; block++)
+        {
+            const int64_t first = run.first + int64_t (block) * blockRows;
+            std::vector<int16_t> values (blockRows * numChannels);
+
+            for (int i = 0; i < blockRows; i++)
+            {
+                sampleNumbers.push_back (first + i);
+
+                for (int channel = 0; channel < numChannels; channel++)
+                    values[i * numChannels + channel] = valueOf (first + i, channel);
+            }
+
+            CHECK (NWBTest::appendRows (data, H5T_NATIVE_INT16, blockRows, values.data()));
+
+            rows.addRows (first, blockRows, double (first) / sampleRate);
+            flushRows (false);
+        }
+    }
+
+    // the last event was still pending when the recording stopped
+    CHECK (pending == events.size() - 1);
+    flushRows (true);
+
+    H5Dclose (continuousRows);
+    H5Dclose (data);
+
+    CHECK (writeSeriesReference (file, "/acquisition/events/continuous_row", "/acquisition/continuous"));
+
+    IndexReader reader (file);
+    std::vector<int64_t> eventRows;
+    std::string seriesPath;
+
+    CHECK (reader.readContinuousRows ("/acquisition/events", eventRows, seriesPath));
+    CHECK (seriesPath == "/acquisition/continuous");
+    CHECK (eventRows.size() == events.size());
+
+    if (eventRows.size() != events.size())
+    {
+        H5Fclose (file);
+        return;
+    }
+
+    const size_t windowSize = size_t (samplesBefore + samplesAfter) * numChannels;
+    std::vector<int16_t> windows (windowSize * events.size(), -1);
+
+    CHECK (reader.readAlignedWindows (seriesPath, eventRows, samplesBefore, samplesAfter, windows.data()));
+
+    for (size_t i = 0; i < events.size(); i++)
+    {
+        const int64_t row = eventRows[i];
+
+        CHECK ((row >= 0) == hasRow[i]);
+        CHECK (row < 0 || sampleNumbers[size_t (row)] == events[i]);
+
+        const bool fits = row - samplesBefore >= 0 && row + samplesAfter <= int64_t (sampleNumbers.size());
+
+        for (int sample = 0; sample < samplesBefore + samplesAfter; sample++)
+        {
+            for (int channel = 0; channel < numChannels; channel++)
+            {
+                const int16_t value = windows[i * windowSize + size_t (sample) * numChannels + channel];
+
+                if (fits)
+                    CHECK (value == valueOf (sampleNumbers[size_t (row - samplesBefore + sample)], channel));
+                else
+                    CHECK (value == 0);
+            }
+        }
+    }
+
+    H5Fclose (file);
+}
+
+} // namespace
+
+int main (int argc, char** argv)
+{
+    if (argc != 2)
+    {
+        std::cerr << "Usage: " << argv[0] << " <work directory>" << std::endl;
+        return 1;
+    }
+
+    checkRowMap();
+    checkAlignedWindows (std::string (argv[1]) + "/continuous_row.nwb");
+
+    return NWBTest::result ("ContinuousRowTest");
+}
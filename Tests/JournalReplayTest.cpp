@@ -0,0 +1,270 @@
+/*
+    ------------------------------------------------------------------
+
+    This file is part of the Open Ephys GUI
+    Copyright (C) 2024 Open Ephys
+
+    ------------------------------------------------------------------
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+/*
+        Replays a recovery journal with nwb-recover and checks the recovered file
+
+        A file with a continuous series and a Units table is created and copied to
+        its base image, as the record engine does once the structure of a file is
+        written. Rows are then only written to its journal, as if the recording had
+        crashed before any of them reached the file, and the journal is cut short in
+        the middle of a record. The rows recovered must be the ones journaled, and
+        the spike times of the Units table grouped by unit.
+
+        Usage: JournalReplayTest <nwb-recover> <work directory>
+     */
+
+#include "NWBTestUtils.h"
+
+#include <NWBJournal.h>
+#include <NWBSpikeTimes.h>
+
+#include <cstring>
+
+using namespace NWBRecording;
+
+namespace
+{
+
+const int numChannels = 4;
+const int numBlocks = 3;
+const int blockRows = 10;
+const int numUnits = 3;
+const int numSpikes = 20;
+
+/** Unit of the nth spike to arrive, the spikes of unit 1 arriving after all others */
+int32_t unitOf (int spike)
+{
+    return spike < 14 ? (spike % 2 == 0 ? 0 : 2) : 1;
+}
+
+/** Creates the file as it is once its structure is written, and returns it open */
+hid_t createFile (const std::string& path, bool latest)
+{
+    const hid_t fapl = H5Pcreate (H5P_FILE_ACCESS);
+
+    if (latest)
+        H5Pset_libver_bounds (fapl, H5F_LIBVER_LATEST, H5F_LIBVER_LATEST);
+
+    const hid_t file = H5Fcreate (path.c_str(), H5F_ACC_TRUNC, H5P_DEFAULT, fapl);
+    H5Pclose (fapl);
+
+    if (file < 0)
+        return -1;
+
+    H5Dclose (NWBTest::createDataSet (file, "/acquisition/series/data", H5T_STD_I16LE, numChannels));
+    H5Dclose (NWBTest::createDataSet (file, "/acquisition/series/timestamps", H5T_IEEE_F64LE, 0));
+
+    const hid_t ids = NWBTest::createDataSet (file, "/units/id", H5T_STD_I64LE, 0);
+    const int64_t idValues[numUnits] = { 0, 1, 2 };
+    NWBTest::appendRows (ids, H5T_NATIVE_INT64, numUnits, idValues);
+    H5Dclose (ids);
+
+    H5Dclose (NWBTest::createDataSet (file, "/units/spike_times", H5T_IEEE_F64LE, 0));
+    H5Dclose (NWBTest::createDataSet (file, "/units/spike_times_index", H5T_STD_U64LE, 0));
+    H5Dclose (NWBTest::createDataSet (file, std::string ("/units/") + SpikeTimeGrouper::arrivalTimesName, H5T_IEEE_F64LE, 0));
+    H5Dclose (NWBTest::createDataSet (file, std::string ("/units/") + SpikeTimeGrouper::arrivalUnitsName, H5T_STD_I32LE, 0));
+
+    return file;
+}
+
+/** Writes a ROWS record */
+void writeRows (JournalWriter& journal, uint32_t dataSet, int32_t column, int64_t firstRow, uint32_t numRows,
+                JournalRecord::ElementType type, uint32_t elementSize, const void* data)
+{
+    JournalRecord record;
+    record.kind = JournalRecord::ROWS;
+    record.dataSet = dataSet;
+    record.column = column;
+    record.firstRow = firstRow;
+    record.numRows = numRows;
+    record.elementType = type;
+    record.elementSize = elementSize;
+    record.payloadSize = numRows * elementSize;
+
+    CHECK (journal.write (record, data));
+}
+
+/** Journals the rows of a recording, in the order the record engine writes them */
+void writeJournal (const std::string& path)
+{
+    JournalWriter journal;
+    CHECK (journal.open (JournalWriter::journalPath (path)));
+
+    const char* paths[] = { "/acquisition/series/data", "/acquisition/series/timestamps",
+                            "/units/spike_times_in_arrival_order", "/units/spike_units_in_arrival_order" };
+
+    for (uint32_t i = 0; i < 4; i++)
+    {
+        JournalRecord record;
+        record.dataSet = i;
+        record.payloadSize = uint32_t (strlen (paths[i]));
+
+        CHECK (journal.write (record, paths[i]));
+    }
+
+    for (int block = 0; block < numBlocks; block++)
+    {
+        const int64_t firstRow = int64_t (block) * blockRows;
+
+        // continuous data is written one channel at a time
+        for (int channel = 0; channel < numChannels; channel++)
+        {
+            int16_t samples[blockRows];
+
+            for (int i = 0; i < blockRows; i++)
+                samples[i] = int16_t ((firstRow + i) * 10 + channel);
+
+            writeRows (journal, 0, channel, firstRow, blockRows, JournalRecord::I16, sizeof (int16_t), samples);
+        }
+
+        double timestamps[blockRows];
+
+        for (int i = 0; i < blockRows; i++)
+            timestamps[i] = double (firstRow + i) / 1000.0;
+
+        writeRows (journal, 1, -1, firstRow, blockRows, JournalRecord::F64, sizeof (double), timestamps);
+        CHECK (journal.flush());
+    }
+
+    for (int spike = 0; spike < numSpikes; spike++)
+    {
+        const double time = spike * 0.5;
+        const int32_t unit = unitOf (spike);
+
+        writeRows (journal, 2, -1, spike, 1, JournalRecord::F64, sizeof (double), &time);
+        writeRows (journal, 3, -1, spike, 1, JournalRecord::I32, sizeof (int32_t), &unit);
+    }
+
+    // a crash in the middle of a record leaves part of its header behind
+    JournalRecord torn;
+    torn.kind = JournalRecord::ROWS;
+    torn.numRows = 1000;
+
+    journal.close (false);
+
+    std::ofstream tail (JournalWriter::journalPath (path), std::ios::binary | std::ios::app);
+    tail.write (reinterpret_cast<const char*> (&torn), sizeof (torn) / 2);
+}
+
+/** Checks the rows and Units table of the recovered file */
+void checkRecovered (const std::string& path)
+{
+    const hid_t file = H5Fopen (path.c_str(), H5F_ACC_RDONLY, H5P_DEFAULT);
+    CHECK (file >= 0);
+
+    if (file < 0)
+        return;
+
+    std::vector<int16_t> samples;
+    CHECK (NWBTest::readAll (file, "/acquisition/series/data", H5T_NATIVE_INT16, samples) == numBlocks * blockRows);
+
+    for (size_t i = 0; i < samples.size(); i++)
+        CHECK (samples[i] == int16_t ((i / numChannels) * 10 + i % numChannels));
+
+    std::vector<double> timestamps;
+    CHECK (NWBTest::readAll (file, "/acquisition/series/timestamps", H5T_NATIVE_DOUBLE, timestamps) == numBlocks * blockRows);
+
+    for (size_t i = 0; i < timestamps.size(); i++)
+        CHECK (timestamps[i] == double (i) / 1000.0);
+
+    // the spike times of each unit end at its value of spike_times_index, in the order they arrived
+    std::vector<double> spikeTimes;
+    std::vector<uint64_t> index;
+
+    CHECK (NWBTest::readAll (file, "/units/spike_times", H5T_NATIVE_DOUBLE, spikeTimes) == numSpikes);
+    CHECK (NWBTest::readAll (file, "/units/spike_times_index", H5T_NATIVE_UINT64, index) == numUnits);
+
+    std::vector<double> expected;
+
+    for (int32_t unit = 0; unit < numUnits; unit++)
+    {
+        for (int spike = 0; spike < numSpikes; spike++)
+        {
+            if (unitOf (spike) == unit)
+                expected.push_back (spike * 0.5);
+        }
+
+        CHECK (index.size() == numUnits && index[unit] == expected.size());
+    }
+
+    CHECK (spikeTimes == expected);
+
+    CHECK (H5Lexists (file, (std::string ("/units/") + SpikeTimeGrouper::arrivalTimesName).c_str(), H5P_DEFAULT) == 0);
+    CHECK (H5Lexists (file, (std::string ("/units/") + SpikeTimeGrouper::arrivalUnitsName).c_str(), H5P_DEFAULT) == 0);
+
+    H5Fclose (file);
+}
+
+/** Runs a recording that crashes and its recovery, with the file in the format of the given profile */
+void runCase (const std::string& recover, const std::string& directory, bool latest)
+{
+    const std::string name = latest ? "journal_latest" : "journal_compatible";
+    const std::string path = directory + "/" + name + ".nwb";
+    const std::string output = directory + "/" + name + "_recovered.nwb";
+
+    std::remove (output.c_str());
+
+    const hid_t file = createFile (path, latest);
+    CHECK (file >= 0);
+
+    if (file < 0)
+        return;
+
+    // files of the latest format are copied while still open for writing, and keep the marks of their writer
+    if (latest)
+    {
+        CHECK (H5Fstart_swmr_write (file) >= 0);
+        H5Fflush (file, H5F_SCOPE_GLOBAL);
+    }
+    else
+        H5Fclose (file);
+
+    const std::vector<char> image = NWBTest::readFile (path);
+    CHECK (NWBTest::writeFile (JournalWriter::basePath (path), image.data(), image.size()));
+
+    if (latest)
+        H5Fclose (file);
+
+    writeJournal (path);
+
+    CHECK (NWBTest::run ("\"" + recover + "\" \"" + path + "\" \"" + output + "\"") == 0);
+
+    checkRecovered (output);
+}
+
+} // namespace
+
+int main (int argc, char** argv)
+{
+    if (argc != 3)
+    {
+        std::cerr << "Usage: " << argv[0] << " <nwb-recover> <work directory>" << std::endl;
+        return 1;
+    }
+
+    runCase (argv[1], argv[2], false);
+    runCase (argv[1], argv[2], true);
+
+    return NWBTest::result ("JournalReplayTest");
+}
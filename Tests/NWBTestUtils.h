@@ -0,0 +1,175 @@
+/*
+    ------------------------------------------------------------------
+
+    This file is part of the Open Ephys GUI
+    Copyright (C) 2024 Open Ephys
+
+    ------------------------------------------------------------------
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef NWBTESTUTILS_H
+#define NWBTESTUTILS_H
+
+#include <hdf5.h>
+
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <string>
+#include <vector>
+
+/** Reports a failed condition and counts it, so that a test goes on to report the others */
+#define CHECK(condition)                                                                   \
+    do                                                                                     \
+    {                                                                                      \
+        if (! (condition))                                                                 \
+        {                                                                                  \
+            std::cerr << __FILE__ << ":" << __LINE__ << ": " << #condition << std::endl; \
+            NWBTest::failures()++;                                                         \
+        }                                                                                  \
+    } while (false)
+
+namespace NWBTest
+{
+
+/** Number of failed checks */
+inline int& failures()
+{
+    static int count = 0;
+    return count;
+}
+
+/** Returns the exit code of a test */
+inline int result (const char* name)
+{
+    if (failures() == 0)
+        std::cout << name << " passed" << std::endl;
+    else
+        std::cerr << name << " failed " << failures() << " checks" << std::endl;
+
+    return failures() == 0 ? 0 : 1;
+}
+
+/** Runs a command, returning its exit code */
+inline int run (const std::string& command)
+{
+    const int status = std::system (command.c_str());
+
+#ifdef _WIN32
+    return status;
+#else
+    return WIFEXITED (status) ? WEXITSTATUS (status) : -1;
+#endif
+}
+
+/** Reads a whole file */
+inline std::vector<char> readFile (const std::string& path)
+{
+    std::ifstream in (path, std::ios::binary);
+    return std::vector<char> (std::istreambuf_iterator<char> (in), std::istreambuf_iterator<char>());
+}
+
+/** Writes a whole file */
+inline bool writeFile (const std::string& path, const char* data, size_t size)
+{
+    std::ofstream out (path, std::ios::binary | std::ios::trunc);
+    out.write (data, (std::streamsize) size);
+    return bool (out.flush());
+}
+
+/** Creates an empty dataset extendable along its rows, of columns elements per row (0 for a 1-D dataset),
+    as the record engine does. Returns its identifier. */
+inline hid_t createDataSet (hid_t location, const std::string& path, hid_t type, hsize_t columns, hsize_t chunkRows = 16)
+{
+    const int rank = columns > 0 ? 2 : 1;
+    hsize_t dims[2] = { 0, columns };
+    hsize_t maxDims[2] = { H5S_UNLIMITED, columns };
+    hsize_t chunk[2] = { chunkRows, columns };
+
+    const hid_t space = H5Screate_simple (rank, dims, maxDims);
+    const hid_t dcpl = H5Pcreate (H5P_DATASET_CREATE);
+    H5Pset_chunk (dcpl, rank, chunk);
+
+    const hid_t lcpl = H5Pcreate (H5P_LINK_CREATE);
+    H5Pset_create_intermediate_group (lcpl, 1);
+
+    const hid_t dataSet = H5Dcreate2 (location, path.c_str(), type, space, lcpl, dcpl, H5P_DEFAULT);
+
+    H5Pclose (lcpl);
+    H5Pclose (dcpl);
+    H5Sclose (space);
+
+    return dataSet;
+}
+
+/** Appends rows to a dataset created by createDataSet */
+inline bool appendRows (hid_t dataSet, hid_t memType, hsize_t numRows, const void* data)
+{
+    hid_t space = H5Dget_space (dataSet);
+    const int rank = H5Sget_simple_extent_ndims (space);
+    hsize_t dims[2] = { 0, 1 };
+    H5Sget_simple_extent_dims (space, dims, nullptr);
+    H5Sclose (space);
+
+    hsize_t start[2] = { dims[0], 0 };
+    hsize_t count[2] = { numRows, dims[1] };
+    dims[0] += numRows;
+
+    if (H5Dset_extent (dataSet, dims) < 0)
+        return false;
+
+    space = H5Dget_space (dataSet);
+    H5Sselect_hyperslab (space, H5S_SELECT_SET, start, nullptr, count, nullptr);
+    const hid_t memSpace = H5Screate_simple (rank, count, nullptr);
+
+    const bool ok = H5Dwrite (dataSet, memType, memSpace, space, H5P_DEFAULT, data) >= 0;
+
+    H5Sclose (memSpace);
+    H5Sclose (space);
+
+    return ok;
+}
+
+/** Reads a whole dataset, returning the number of rows read (-1 on failure) */
+template <typename T>
+inline int64_t readAll (hid_t file, const std::string& path, hid_t memType, std::vector<T>& values)
+{
+    const hid_t dataSet = H5Dopen2 (file, path.c_str(), H5P_DEFAULT);
+
+    if (dataSet < 0)
+        return -1;
+
+    const hid_t space = H5Dget_space (dataSet);
+    const hssize_t numElements = H5Sget_simple_extent_npoints (space);
+    hsize_t dims[2] = { 0, 1 };
+    H5Sget_simple_extent_dims (space, dims, nullptr);
+    H5Sclose (space);
+
+    values.resize ((size_t) numElements);
+
+    const bool ok = numElements == 0 || H5Dread (dataSet, memType, H5S_ALL, H5S_ALL, H5P_DEFAULT, values.data()) >= 0;
+
+    H5Dclose (dataSet);
+
+    return ok ? int64_t (dims[0]) : -1;
+}
+
+} // namespace NWBTest
+
+#endif
@@ -0,0 +1,166 @@
+/*
+    ------------------------------------------------------------------
+
+    This file is part of the Open Ephys GUI
+    Copyright (C) 2024 Open Ephys
+
+    ------------------------------------------------------------------
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+/*
+        Groups the spike times of a Units table written in arrival order
+
+        The table has a unit without spikes, spikes of rows that are not units of
+        the table, and one more unit row than spike time, as a crash between the two
+        writes leaves it. Each unit must end up with its spike times, in the order
+        they arrived, ending at its value of spike_times_index.
+
+        Usage: SpikeTimeGroupingTest <work directory>
+     */
+
+#include "NWBTestUtils.h"
+
+#include <NWBSpikeTimes.h>
+
+using namespace NWBRecording;
+
+namespace
+{
+
+const int numUnits = 5;
+const int numSpikes = 1000;
+
+/** Row of the unit of the nth spike to arrive: unit 3 has no spikes, and a few spikes belong to no unit */
+int32_t unitOf (int spike)
+{
+    if (spike % 97 == 0)
+        return spike % 2 == 0 ? -1 : numUnits;
+
+    const int32_t unit = (spike * 7) % numUnits;
+    return unit == 3 ? 4 : unit;
+}
+
+double timeOf (int spike)
+{
+    return 0.001 * spike;
+}
+
+/** Writes a Units table with its spike times in arrival order */
+bool createFile (const std::string& path)
+{
+    const hid_t file = H5Fcreate (path.c_str(), H5F_ACC_TRUNC, H5P_DEFAULT, H5P_DEFAULT);
+
+    if (file < 0)
+        return false;
+
+    std::vector<int64_t> ids (numUnits);
+    std::vector<double> times (numSpikes);
+    std::vector<int32_t> units (numSpikes + 1);
+
+    for (int i = 0; i < numUnits; i++)
+        ids[i] = i;
+
+    for (int i = 0; i < numSpikes; i++)
+    {
+        times[i] = timeOf (i);
+        units[i] = unitOf (i);
+    }
+
+    units[numSpikes] = 0;
+
+    const hid_t id = NWBTest::createDataSet (file, "/units/id", H5T_STD_I64LE, 0);
+    const hid_t arrivalTimes = NWBTest::createDataSet (file, std::string ("/units/") + SpikeTimeGrouper::arrivalTimesName, H5T_IEEE_F64LE, 0, 64);
+    const hid_t arrivalUnits = NWBTest::createDataSet (file, std::string ("/units/") + SpikeTimeGrouper::arrivalUnitsName, H5T_STD_I32LE, 0, 64);
+
+    bool ok = NWBTest::appendRows (id, H5T_NATIVE_INT64, numUnits, ids.data())
+              && NWBTest::appendRows (arrivalTimes, H5T_NATIVE_DOUBLE, numSpikes, times.data())
+              && NWBTest::appendRows (arrivalUnits, H5T_NATIVE_INT32, numSpikes + 1, units.data());
+
+    H5Dclose (id);
+    H5Dclose (arrivalTimes);
+    H5Dclose (arrivalUnits);
+
+    H5Dclose (NWBTest::createDataSet (file, "/units/spike_times", H5T_IEEE_F64LE, 0));
+    H5Dclose (NWBTest::createDataSet (file, "/units/spike_times_index", H5T_STD_U64LE, 0));
+
+    return H5Fclose (file) >= 0 && ok;
+}
+
+} // namespace
+
+int main (int argc, char** argv)
+{
+    if (argc != 2)
+    {
+        std::cerr << "Usage: " << argv[0] << " <work directory>" << std::endl;
+        return 1;
+    }
+
+    const std::string path = std::string (argv[1]) + "/spike_times.nwb";
+
+    CHECK (createFile (path));
+
+    hid_t file = H5Fopen (path.c_str(), H5F_ACC_RDWR, H5P_DEFAULT);
+    CHECK (file >= 0);
+
+    SpikeTimeGrouper grouper;
+    bool ok = grouper.open (file, "/units");
+    CHECK (ok);
+
+    CHECK (grouper.getNumUnits() == numUnits);
+    CHECK (grouper.getNumSpikes() == numSpikes);
+
+    while (ok && ! grouper.isDone())
+        ok = grouper.writeNextUnits();
+
+    CHECK (ok);
+    CHECK (grouper.close (true));
+
+    H5Fclose (file);
+
+    file = H5Fopen (path.c_str(), H5F_ACC_RDONLY, H5P_DEFAULT);
+    CHECK (file >= 0);
+
+    std::vector<double> spikeTimes;
+    std::vector<uint64_t> index;
+
+    CHECK (NWBTest::readAll (file, "/units/spike_times", H5T_NATIVE_DOUBLE, spikeTimes) >= 0);
+    CHECK (NWBTest::readAll (file, "/units/spike_times_index", H5T_NATIVE_UINT64, index) == numUnits);
+
+    std::vector<double> expected;
+
+    for (int32_t unit = 0; unit < numUnits; unit++)
+    {
+        for (int spike = 0; spike < numSpikes; spike++)
+        {
+            if (unitOf (spike) == unit)
+                expected.push_back (timeOf (spike));
+        }
+
+        CHECK (index.size() == numUnits && index[unit] == expected.size());
+    }
+
+    CHECK (index.size() == numUnits && index[3] == index[2]);
+    CHECK (spikeTimes == expected);
+
+    CHECK (H5Lexists (file, (std::string ("/units/") + SpikeTimeGrouper::arrivalTimesName).c_str(), H5P_DEFAULT) == 0);
+    CHECK (H5Lexists (file, (std::string ("/units/") + SpikeTimeGrouper::arrivalUnitsName).c_str(), H5P_DEFAULT) == 0);
+
+    H5Fclose (file);
+
+    return NWBTest::result ("SpikeTimeGroupingTest");
+}
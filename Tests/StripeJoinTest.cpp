@@ -0,0 +1,202 @@
+/*
+    ------------------------------------------------------------------
+
+    This file is part of the Open Ephys GUI
+    Copyright (C) 2024 Open Ephys
+
+    ------------------------------------------------------------------
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+/*
+        Stripes an NWB file over several members and joins them with nwb-join-stripes
+
+        The members are written the way the striping driver writes them: each region
+        at its offset within its member, with regions of zeros never written, so that
+        they are holes in the middle of a member or missing at its end. The joined
+        file must be the original, byte for byte, and open with HDF5.
+
+        Usage: StripeJoinTest <nwb-join-stripes> <work directory>
+     */
+
+#include "NWBTestUtils.h"
+
+#include <NWBStripeSet.h>
+
+#include <algorithm>
+#include <filesystem>
+
+using namespace NWBRecording;
+
+namespace
+{
+
+const uint64_t stripeSize = 16 * 1024;
+const int numMembers = 3;
+const int numRows = 20000;
+
+/** Writes a file whose data is followed by a dataset of zeros at its end */
+bool createFile (const std::string& path)
+{
+    const hid_t file = H5Fcreate (path.c_str(), H5F_ACC_TRUNC, H5P_DEFAULT, H5P_DEFAULT);
+
+    if (file < 0)
+        return false;
+
+    std::vector<int32_t> values (numRows);
+
+    for (int i = 0; i < numRows; i++)
+        values[i] = i * 7 + 1;
+
+    const hid_t dataSet = NWBTest::createDataSet (file, "/acquisition/series/data", H5T_STD_I32LE, 0, 1024);
+    bool ok = NWBTest::appendRows (dataSet, H5T_NATIVE_INT32, numRows, values.data());
+    H5Dclose (dataSet);
+
+    // space allocated but never written
+    const hsize_t zeroRows = 10 * stripeSize;
+    const hid_t space = H5Screate_simple (1, &zeroRows, nullptr);
+    const hid_t dcpl = H5Pcreate (H5P_DATASET_CREATE);
+    H5Pset_alloc_time (dcpl, H5D_ALLOC_TIME_EARLY);
+
+    const hid_t zeros = H5Dcreate2 (file, "/zeros", H5T_STD_U8LE, space, H5P_DEFAULT, dcpl, H5P_DEFAULT);
+    ok = ok && zeros >= 0;
+
+    if (zeros >= 0)
+        H5Dclose (zeros);
+
+    H5Pclose (dcpl);
+    H5Sclose (space);
+
+    return H5Fclose (file) >= 0 && ok;
+}
+
+/** Writes the regions of a file to the members of a stripe set, skipping the regions of zeros */
+bool writeMembers (const StripeSet& stripes, const std::vector<char>& image)
+{
+    std::vector<std::fstream> members;
+
+    for (const std::string& path : stripes.members)
+    {
+        std::ofstream (path, std::ios::binary | std::ios::trunc);
+        members.emplace_back (path, std::ios::binary | std::ios::in | std::ios::out);
+    }
+
+    for (uint64_t addr = 0; addr < image.size(); addr += stripeSize)
+    {
+        const uint64_t length = std::min<uint64_t> (stripeSize, image.size() - addr);
+        const auto begin = image.begin() + std::ptrdiff_t (addr);
+
+        CHECK (stripes.memberOffset (addr) % stripeSize == 0);
+        CHECK (stripes.stripeEnd (addr) == addr + stripeSize);
+
+        if (std::all_of (begin, begin + std::ptrdiff_t (length), [] (char c)
+                         { return c == 0; }))
+            continue;
+
+        std::fstream& member = members[stripes.memberOf (addr)];
+        member.seekp (std::streamoff (stripes.memberOffset (addr)));
+        member.write (image.data() + addr, std::streamsize (length));
+    }
+
+    bool ok = true;
+
+    for (std::fstream& member : members)
+        ok = bool (member.flush()) && ok;
+
+    return ok;
+}
+
+} // namespace
+
+int main (int argc, char** argv)
+{
+    if (argc != 3)
+    {
+        std::cerr << "Usage: " << argv[0] << " <nwb-join-stripes> <work directory>" << std::endl;
+        return 1;
+    }
+
+    const std::string join = argv[1];
+    const std::string directory = argv[2];
+    const std::string source = directory + "/stripes_source.nwb";
+    const std::string path = directory + "/stripes.nwb";
+    const std::string output = directory + "/stripes_joined.nwb";
+
+    CHECK (createFile (source));
+
+    const std::vector<char> image = NWBTest::readFile (source);
+
+    StripeSet stripes;
+    stripes.stripeSize = stripeSize;
+    stripes.size = image.size();
+
+    // each member in a directory of its own, as on separate disks
+    for (int i = 0; i < numMembers; i++)
+    {
+        const std::string memberDirectory = directory + "/stripes_" + std::to_string (i);
+        std::filesystem::create_directories (memberDirectory);
+
+        stripes.members.push_back (memberDirectory + "/stripes.nwb." + std::to_string (i));
+    }
+
+    // the members hold the whole file, and the last byte of the file is in the member that ends furthest
+    uint64_t total = 0;
+    uint64_t end = 0;
+
+    for (int i = 0; i < numMembers; i++)
+    {
+        const uint64_t size = stripes.memberSize (i, stripes.size);
+        total += size;
+        end = std::max (end, stripes.fileEnd (i, size));
+    }
+
+    CHECK (total == stripes.size);
+    CHECK (end == stripes.size);
+
+    CHECK (writeMembers (stripes, image));
+    CHECK (stripes.write (StripeSet::descriptorPath (path)));
+
+    // the regions of zeros at the end of the file were never written
+    uint64_t written = 0;
+
+    for (const std::string& member : stripes.members)
+        written += NWBTest::readFile (member).size();
+
+    CHECK (written < stripes.size);
+
+    StripeSet descriptor;
+    CHECK (descriptor.read (StripeSet::descriptorPath (path)));
+    CHECK (descriptor.stripeSize == stripes.stripeSize && descriptor.size == stripes.size && descriptor.members == stripes.members);
+
+    CHECK (NWBTest::run ("\"" + join + "\" \"" + path + "\" \"" + output + "\"") == 0);
+    CHECK (NWBTest::readFile (output) == image);
+
+    const hid_t file = H5Fopen (output.c_str(), H5F_ACC_RDONLY, H5P_DEFAULT);
+    CHECK (file >= 0);
+
+    if (file >= 0)
+    {
+        std::vector<int32_t> values;
+        CHECK (NWBTest::readAll (file, "/acquisition/series/data", H5T_NATIVE_INT32, values) == numRows);
+
+        for (int i = 0; i < int (values.size()); i++)
+            CHECK (values[i] == i * 7 + 1);
+
+        H5Fclose (file);
+    }
+
+    return NWBTest::result ("StripeJoinTest");
+}
@@ -0,0 +1,388 @@
+/*
+    ------------------------------------------------------------------
+
+    This file is part of the Open Ephys GUI
+    Copyright (C) 2024 Open Ephys
+
+    ------------------------------------------------------------------
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+/*
+    Compares the write rate and open time of files written with the compatible
+    and the latest paged file format profiles (see FileSettings::FormatProfile), and
+    the write rate of the compatible profile with a recovery journal.
+
+    Usage: nwb-format-benchmark <directory> [streams] [channels] [seconds] [pageSizeKB]
+
+    Each stream is written like an ElectricalSeries: an int16 data dataset of
+    <channels> columns written one channel at a time, with timestamps and sample
+    numbers, in blocks of 1024 samples at 30 kHz. The files are then opened as a
+    reader would (every series and its attributes), with the page buffer for
+    the paged file. On Linux, the files are evicted from the page cache before
+    each open. With the journal, every column written is also appended to it as
+    the record engine does, and the journal is flushed after each block.
+ */
+
+#include "NWBJournal.h"
+
+#include <hdf5.h>
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#ifdef __linux__
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+using namespace NWBRecording;
+
+namespace
+{
+
+const hsize_t chunkSize = 2048;
+const hsize_t blockSize = 1024;
+const double sampleRate = 30000.0;
+const int numOpens = 20;
+
+struct Series
+{
+    hid_t data;
+    hid_t timestamps;
+    hid_t sync;
+};
+
+double secondsSince (std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration<double> (std::chrono::steady_clock::now() - start).count();
+}
+
+void writeStringAttribute (hid_t object, const char* name, const std::string& value)
+{
+    const hid_t type = H5Tcopy (H5T_C_S1);
+    H5Tset_size (type, value.size() + 1);
+
+    const hid_t space = H5Screate (H5S_SCALAR);
+    const hid_t attribute = H5Acreate2 (object, name, type, space, H5P_DEFAULT, H5P_DEFAULT);
+    H5Awrite (attribute, type, value.c_str());
+
+    H5Aclose (attribute);
+    H5Sclose (space);
+    H5Tclose (type);
+}
+
+hid_t createAppendDataSet (hid_t group, const char* name, hid_t type, hsize_t columns)
+{
+    const hsize_t dims[2] = { 0, columns };
+    const hsize_t maxDims[2] = { H5S_UNLIMITED, columns };
+    const hsize_t chunkDims[2] = { chunkSize, columns };
+    const int rank = columns > 1 ? 2 : 1;
+
+    const hid_t space = H5Screate_simple (rank, dims, maxDims);
+    const hid_t dcpl = H5Pcreate (H5P_DATASET_CREATE);
+    H5Pset_chunk (dcpl, rank, chunkDims);
+
+    const hid_t dataSet = H5Dcreate2 (group, name, type, space, H5P_DEFAULT, dcpl, H5P_DEFAULT);
+    writeStringAttribute (dataSet, "unit", "volts");
+
+    H5Pclose (dcpl);
+    H5Sclose (space);
+
+    return dataSet;
+}
+
+/* Appends rows to a dataset, columns one at a time like HDF5RecordingData::writeDataRow, and to the journal if there is one */
+void append (hid_t dataSet, hid_t type, hsize_t offset, hsize_t rows, hsize_t columns, const void* column, JournalWriter* journal, uint32_t journalId)
+{
+    if (journal != nullptr)
+    {
+        const uint32_t elementSize = (uint32_t) H5Tget_size (type);
+
+        JournalRecord record;
+        record.kind = JournalRecord::ROWS;
+        record.dataSet = journalId;
+        record.firstRow = (int64_t) offset;
+        record.numRows = (uint32_t) rows;
+        record.elementSize = elementSize;
+        record.payloadSize = elementSize * (uint32_t) rows;
+        record.elementType = elementSize == 2 ? JournalRecord::I16 : (H5Tget_class (type) == H5T_FLOAT ? JournalRecord::F64 : JournalRecord::I64);
+
+        for (hsize_t c = 0; c < columns; c++)
+        {
+            record.column = columns > 1 ? (int32_t) c : -1;
+            journal->write (record, column);
+        }
+    }
+
+    const hsize_t size[2] = { offset + rows, columns };
+    H5Dset_extent (dataSet, size);
+
+    const hid_t fileSpace = H5Dget_space (dataSet);
+    const hsize_t count[2] = { rows, 1 };
+    const hid_t memSpace = H5Screate_simple (1, count, nullptr);
+
+    for (hsize_t c = 0; c < columns; c++)
+    {
+        const hsize_t start[2] = { offset, c };
+        H5Sselect_hyperslab (fileSpace, H5S_SELECT_SET, start, nullptr, count, nullptr);
+        H5Dwrite (dataSet, type, memSpace, fileSpace, H5P_DEFAULT, column);
+    }
+
+    H5Sclose (memSpace);
+    H5Sclose (fileSpace);
+}
+
+/* Writes the file and returns the data rate in MB/s */
+double writeFile (const std::string& path, bool paged, bool journaled, hsize_t pageSize, int numStreams, int numChannels, double seconds)
+{
+    const hid_t fapl = H5Pcreate (H5P_FILE_ACCESS);
+    const hid_t fcpl = H5Pcreate (H5P_FILE_CREATE);
+
+    // same chunk cache as HDF5FileBase::open
+    H5Pset_cache (fapl, 0, 1667, 2 * 8 * 2 * chunkSize * numStreams * (numChannels + 2), 1);
+
+    if (paged)
+    {
+        H5Pset_libver_bounds (fapl, H5F_LIBVER_LATEST, H5F_LIBVER_LATEST);
+        H5Pset_meta_block_size (fapl, pageSize);
+        H5Pset_file_space_strategy (fcpl, H5F_FSPACE_STRATEGY_PAGE, false, 1);
+        H5Pset_file_space_page_size (fcpl, pageSize);
+    }
+
+    const auto start = std::chrono::steady_clock::now();
+
+    const hid_t file = H5Fcreate (path.c_str(), H5F_ACC_TRUNC, fcpl, fapl);
+
+    if (file < 0)
+        return 0;
+
+    JournalWriter journal;
+
+    if (journaled && ! journal.open (JournalWriter::journalPath (path)))
+        return 0;
+
+    JournalWriter* journalWriter = journaled ? &journal : nullptr;
+
+    const hid_t acquisition = H5Gcreate2 (file, "acquisition", H5P_DEFAULT, H5P_DEFAULT, H5P_DEFAULT);
+    std::vector<Series> series;
+
+    for (int s = 0; s < numStreams; s++)
+    {
+        const hid_t group = H5Gcreate2 (acquisition, ("stream" + std::to_string (s)).c_str(), H5P_DEFAULT, H5P_DEFAULT, H5P_DEFAULT);
+        writeStringAttribute (group, "neurodata_type", "ElectricalSeries");
+        writeStringAttribute (group, "namespace", "core");
+        writeStringAttribute (group, "description", "Benchmark stream " + std::to_string (s));
+        writeStringAttribute (group, "comments", "no comments");
+
+        series.push_back ({ createAppendDataSet (group, "data", H5T_STD_I16LE, numChannels),
+                            createAppendDataSet (group, "timestamps", H5T_IEEE_F64LE, 1),
+                            createAppendDataSet (group, "sync", H5T_STD_I64LE, 1) });
+
+        H5Gclose (group);
+
+        for (const char* name : { "data", "timestamps", "sync" })
+        {
+            const std::string dataSetPath = "/acquisition/stream" + std::to_string (s) + "/" + name;
+
+            JournalRecord record;
+            record.kind = JournalRecord::DATASET;
+            record.dataSet = uint32_t (s * 3 + (name[0] == 'd' ? 0 : name[0] == 't' ? 1 : 2));
+            record.payloadSize = (uint32_t) dataSetPath.size();
+
+            if (journaled)
+                journal.write (record, dataSetPath.c_str());
+        }
+    }
+
+    const hsize_t numBlocks = hsize_t (seconds * sampleRate / blockSize);
+
+    std::vector<int16_t> samples (blockSize);
+    std::vector<double> timestamps (blockSize);
+    std::vector<int64_t> sampleNumbers (blockSize);
+
+    for (hsize_t b = 0; b < numBlocks; b++)
+    {
+        for (hsize_t i = 0; i < blockSize; i++)
+        {
+            samples[i] = int16_t ((b * blockSize + i) % 4096);
+            sampleNumbers[i] = int64_t (b * blockSize + i);
+            timestamps[i] = sampleNumbers[i] / sampleRate;
+        }
+
+        for (size_t s = 0; s < series.size(); s++)
+        {
+            append (series[s].data, H5T_NATIVE_INT16, b * blockSize, blockSize, numChannels, samples.data(), journalWriter, uint32_t (s * 3));
+            append (series[s].timestamps, H5T_NATIVE_DOUBLE, b * blockSize, blockSize, 1, timestamps.data(), journalWriter, uint32_t (s * 3 + 1));
+            append (series[s].sync, H5T_NATIVE_INT64, b * blockSize, blockSize, 1, sampleNumbers.data(), journalWriter, uint32_t (s * 3 + 2));
+        }
+
+        // as NWBRecordEngine::endChannelBlock does
+        if (journaled && ! journal.flush())
+            return 0;
+    }
+
+    for (const Series& s : series)
+    {
+        H5Dclose (s.data);
+        H5Dclose (s.timestamps);
+        H5Dclose (s.sync);
+    }
+
+    H5Gclose (acquisition);
+    H5Fclose (file);
+
+    // the record engine deletes the journal once the file is closed
+    if (journaled)
+    {
+        journal.close (true);
+        remove (JournalWriter::journalPath (path).c_str());
+    }
+
+    const double elapsed = secondsSince (start);
+
+    H5Pclose (fcpl);
+    H5Pclose (fapl);
+
+    const double bytes = double (numBlocks * blockSize) * numStreams * (numChannels * 2 + 16);
+    return bytes / elapsed / (1 << 20);
+}
+
+/* Drops the file from the page cache, so the next open reads it from the disk */
+void evict (const std::string& path)
+{
+#ifdef __linux__
+    const int fd = ::open (path.c_str(), O_RDONLY);
+
+    if (fd >= 0)
+    {
+        fdatasync (fd);
+        posix_fadvise (fd, 0, 0, POSIX_FADV_DONTNEED);
+        close (fd);
+    }
+#endif
+}
+
+/* Opens the file and the attributes and dimensions of every series, and returns the mean time in milliseconds */
+double openFile (const std::string& path, hsize_t pageBufferSize, int numStreams)
+{
+    const hid_t fapl = H5Pcreate (H5P_FILE_ACCESS);
+
+    if (pageBufferSize > 0)
+        H5Pset_page_buffer_size (fapl, pageBufferSize, 0, 0);
+
+    double total = 0;
+
+    for (int n = 0; n < numOpens; n++)
+    {
+        evict (path);
+
+        const auto start = std::chrono::steady_clock::now();
+        const hid_t file = H5Fopen (path.c_str(), H5F_ACC_RDONLY, fapl);
+
+        if (file < 0)
+            return -1;
+
+        for (int s = 0; s < numStreams; s++)
+        {
+            const std::string group = "/acquisition/stream" + std::to_string (s);
+
+            for (const char* name : { "neurodata_type", "description" })
+            {
+                const hid_t attribute = H5Aopen_by_name (file, group.c_str(), name, H5P_DEFAULT, H5P_DEFAULT);
+                H5Aclose (attribute);
+            }
+
+            for (const char* name : { "/data", "/timestamps", "/sync" })
+            {
+                const hid_t dataSet = H5Dopen2 (file, (group + name).c_str(), H5P_DEFAULT);
+                const hid_t space = H5Dget_space (dataSet);
+
+                hsize_t dims[2];
+                H5Sget_simple_extent_dims (space, dims, nullptr);
+
+                H5Sclose (space);
+                H5Dclose (dataSet);
+            }
+        }
+
+        H5Fclose (file);
+        total += secondsSince (start);
+    }
+
+    H5Pclose (fapl);
+
+    return total / numOpens * 1000;
+}
+
+} // namespace
+
+int main (int argc, char** argv)
+{
+    if (argc < 2 || argc > 6)
+    {
+        std::cerr << "Usage: " << argv[0] << " <directory> [streams] [channels] [seconds] [pageSizeKB]" << std::endl;
+        return 1;
+    }
+
+    const std::string directory = argv[1];
+    const int numStreams = argc > 2 ? std::max (1, atoi (argv[2])) : 4;
+    const int numChannels = argc > 3 ? std::max (1, atoi (argv[3])) : 64;
+    const double seconds = argc > 4 ? std::max (1.0, atof (argv[4])) : 60;
+    const hsize_t pageSize = hsize_t (argc > 5 ? std::max (4, atoi (argv[5])) : 64) << 10;
+
+    const std::string compatiblePath = directory + "/benchmark-compatible.nwb";
+    const std::string pagedPath = directory + "/benchmark-latest-paged.nwb";
+    const std::string journaledPath = directory + "/benchmark-journaled.nwb";
+
+    // results depend on the HDF5 version, which may differ from the one the plugin is built against
+    unsigned majorVersion, minorVersion, releaseNumber;
+    H5get_libversion (&majorVersion, &minorVersion, &releaseNumber);
+
+    std::cout << "HDF5 " << majorVersion << "." << minorVersion << "." << releaseNumber << ", "
+              << numStreams << " streams of " << numChannels << " channels, " << seconds << " s at 30 kHz, "
+              << (pageSize >> 10) << " KB pages" << std::endl;
+
+    const double compatibleRate = writeFile (compatiblePath, false, false, pageSize, numStreams, numChannels, seconds);
+    const double pagedRate = writeFile (pagedPath, true, false, pageSize, numStreams, numChannels, seconds);
+    const double journaledRate = writeFile (journaledPath, false, true, pageSize, numStreams, numChannels, seconds);
+
+    if (compatibleRate <= 0 || pagedRate <= 0 || journaledRate <= 0)
+    {
+        std::cerr << "Could not create the benchmark files in " << directory << std::endl;
+        return 1;
+    }
+
+    const double compatibleOpen = openFile (compatiblePath, 0, numStreams);
+    const double pagedOpen = openFile (pagedPath, 0, numStreams);
+    const double pagedBufferedOpen = openFile (pagedPath, pageSize * 64, numStreams);
+
+    printf ("%-24s %10s %12s\n", "profile", "MB/s", "open (ms)");
+    printf ("%-24s %10.1f %12.3f\n", "compatible", compatibleRate, compatibleOpen);
+    printf ("%-24s %10.1f %12.3f\n", "latest paged", pagedRate, pagedOpen);
+    printf ("%-24s %10s %12.3f\n", "latest paged, buffered", "", pagedBufferedOpen);
+    printf ("%-24s %10.1f\n", "compatible, journal", journaledRate);
+
+    remove (compatiblePath.c_str());
+    remove (pagedPath.c_str());
+    remove (journaledPath.c_str());
+
+    return 0;
+}
@@ -0,0 +1,114 @@
+/*
+    ------------------------------------------------------------------
+
+    This file is part of the Open Ephys GUI
+    Copyright (C) 2024 Open Ephys
+
+    ------------------------------------------------------------------
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+/*
+    Concatenates an NWB file written across several stripe directories back into
+    a single file that any HDF5 reader can open.
+
+    Usage: nwb-join-stripes <file.nwb> [output.nwb]
+
+    <file.nwb>.stripes must exist; the output defaults to <file.nwb>.
+ */
+
+#include "NWBStripeSet.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <iostream>
+
+using namespace NWBRecording;
+
+int main (int argc, char** argv)
+{
+    if (argc < 2 || argc > 3)
+    {
+        std::cerr << "Usage: " << argv[0] << " <file.nwb> [output.nwb]" << std::endl;
+        return 1;
+    }
+
+    const std::string filePath = argv[1];
+    const std::string outputPath = argc > 2 ? argv[2] : filePath;
+
+    StripeSet stripes;
+
+    if (! stripes.read (StripeSet::descriptorPath (filePath)))
+    {
+        std::cerr << "Could not read " << StripeSet::descriptorPath (filePath) << std::endl;
+        return 1;
+    }
+
+    std::vector<FILE*> members;
+
+    for (const std::string& path : stripes.members)
+    {
+        FILE* member = fopen (path.c_str(), "rb");
+
+        if (member == nullptr)
+        {
+            std::cerr << "Could not open " << path << std::endl;
+            return 1;
+        }
+
+        members.push_back (member);
+    }
+
+    FILE* output = fopen (outputPath.c_str(), "wb");
+
+    if (output == nullptr)
+    {
+        std::cerr << "Could not create " << outputPath << std::endl;
+        return 1;
+    }
+
+    // members are read sequentially, one stripe at a time
+    std::vector<char> buffer (stripes.stripeSize);
+
+    for (uint64_t addr = 0; addr < stripes.size; addr += stripes.stripeSize)
+    {
+        const size_t length = (size_t) std::min (stripes.stripeSize, stripes.size - addr);
+        FILE* member = members[stripes.memberOf (addr)];
+
+        // regions never written are holes at the end of a member, and read as zeros
+        const size_t numRead = fread (buffer.data(), 1, length, member);
+        std::fill (buffer.begin() + numRead, buffer.begin() + length, 0);
+
+        if (fwrite (buffer.data(), 1, length, output) != length)
+        {
+            std::cerr << "Error writing " << outputPath << std::endl;
+            return 1;
+        }
+    }
+
+    for (FILE* member : members)
+        fclose (member);
+
+    if (fclose (output) != 0)
+    {
+        std::cerr << "Error writing " << outputPath << std::endl;
+        return 1;
+    }
+
+    std::cout << "Joined " << stripes.members.size() << " stripes (" << stripes.size << " bytes) into " << outputPath << std::endl;
+
+    return 0;
+}
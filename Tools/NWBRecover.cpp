@@ -0,0 +1,417 @@
+/*
+    ------------------------------------------------------------------
+
+    This file is part of the Open Ephys GUI
+    Copyright (C) 2024 Open Ephys
+
+    ------------------------------------------------------------------
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+/*
+    Rebuilds an NWB file whose recording was interrupted, from the base image of
+    the file (<file.nwb>.base) and the journal written next to it (<file.nwb>.journal).
+
+    Usage: nwb-recover <file.nwb> [output.nwb]
+
+    The base image, a copy of the file taken once its structure was written, is
+    copied to the output (<file>_recovered.nwb by default) and every row in the
+    journal is written again into its dataset, extending it as needed. Without a
+    base image, the file itself is copied, which a crash may have left
+    inconsistent. Reading the journal stops at the first record whose checksum
+    does not match.
+    Raw continuous data files are already complete, and the datasets declaring
+    them are extended to their size. The spike times of the units table, written
+    in the order they arrived, are grouped by unit as they would have been when
+    recording stopped. num_samples attributes, only written when recording stops,
+    are not restored. The datasets of shard files are reached through their
+    links, so shards are restored from their own base images and rebuilt in place.
+
+    Files written with the latest file format (SWMR or the paged profile) are
+    marked as open in their superblock while they are written, and so are their
+    base images, copied during recording. The output and the restored shards
+    are opened with these marks cleared, as "h5clear -s" does.
+ */
+
+#include "NWBJournal.h"
+#include "NWBSpikeTimes.h"
+
+#include <hdf5.h>
+
+#include <fstream>
+#include <iostream>
+#include <map>
+
+using namespace NWBRecording;
+
+namespace
+{
+
+/** Returns the memory type of the elements of a journal record, to be closed by the caller */
+hid_t getMemoryType (const JournalRecord& record)
+{
+    switch (record.elementType)
+    {
+        case JournalRecord::U8: return H5Tcopy (H5T_NATIVE_UINT8);
+        case JournalRecord::U16: return H5Tcopy (H5T_NATIVE_UINT16);
+        case JournalRecord::U32: return H5Tcopy (H5T_NATIVE_UINT32);
+        case JournalRecord::U64: return H5Tcopy (H5T_NATIVE_UINT64);
+        case JournalRecord::I8: return H5Tcopy (H5T_NATIVE_INT8);
+        case JournalRecord::I16: return H5Tcopy (H5T_NATIVE_INT16);
+        case JournalRecord::I32: return H5Tcopy (H5T_NATIVE_INT32);
+        case JournalRecord::I64: return H5Tcopy (H5T_NATIVE_INT64);
+        case JournalRecord::F32: return H5Tcopy (H5T_NATIVE_FLOAT);
+        case JournalRecord::F64: return H5Tcopy (H5T_NATIVE_DOUBLE);
+        default:
+        {
+            const hid_t type = H5Tcopy (H5T_C_S1);
+            H5Tset_size (type, record.elementSize);
+            return type;
+        }
+    }
+}
+
+/** Writes the rows of a record into its dataset, extending the dataset if needed */
+bool writeRows (hid_t dataSet, const JournalRecord& record, const std::vector<char>& payload)
+{
+    hid_t space = H5Dget_space (dataSet);
+    const int rank = H5Sget_simple_extent_ndims (space);
+
+    if (rank < 1 || rank > 3 || (record.column >= 0 && rank != 2))
+    {
+        H5Sclose (space);
+        return false;
+    }
+
+    hsize_t dims[3];
+    H5Sget_simple_extent_dims (space, dims, nullptr);
+
+    if (dims[0] < hsize_t (record.firstRow) + record.numRows)
+    {
+        dims[0] = hsize_t (record.firstRow) + record.numRows;
+        H5Sclose (space);
+
+        if (H5Dset_extent (dataSet, dims) < 0)
+            return false;
+
+        space = H5Dget_space (dataSet);
+    }
+
+    hsize_t start[3] = { hsize_t (record.firstRow), 0, 0 };
+    hsize_t count[3] = { record.numRows, 1, 1 };
+    hsize_t numElements = record.numRows;
+
+    for (int i = 1; i < rank; i++)
+    {
+        start[i] = record.column >= 0 ? hsize_t (record.column) : 0;
+        count[i] = record.column >= 0 ? 1 : dims[i];
+        numElements *= count[i];
+    }
+
+    // a record of another shape than its dataset means the journal does not match the file
+    if (numElements * record.elementSize != payload.size())
+    {
+        H5Sclose (space);
+        return false;
+    }
+
+    H5Sselect_hyperslab (space, H5S_SELECT_SET, start, nullptr, count, nullptr);
+
+    const hid_t memSpace = H5Screate_simple (1, &numElements, nullptr);
+    const hid_t memType = getMemoryType (record);
+
+    const bool ok = H5Dwrite (dataSet, memType, memSpace, space, H5P_DEFAULT, payload.data()) >= 0;
+
+    H5Tclose (memType);
+    H5Sclose (memSpace);
+    H5Sclose (space);
+
+    return ok;
+}
+
+/** Copies a file, replacing the target */
+bool copyFile (const std::string& source, const std::string& target)
+{
+    std::ifstream input (source, std::ios::binary);
+    std::ofstream output (target, std::ios::binary | std::ios::trunc);
+
+    return input && (output << input.rdbuf()) && output.flush();
+}
+
+/** Returns a file access property list that clears the marks a writer leaves in the superblock of a file
+    of the latest format (the property h5clear sets), or -1 if this HDF5 version does not have it */
+hid_t createClearingAccessList()
+{
+    const hid_t fapl = H5Pcreate (H5P_FILE_ACCESS);
+    hbool_t clear = true;
+
+    if (H5Pexist (fapl, "clear_status_flags") <= 0 || H5Pset (fapl, "clear_status_flags", &clear) < 0)
+    {
+        H5Pclose (fapl);
+        return -1;
+    }
+
+    return fapl;
+}
+
+/** Opens and closes a file with the marks of its writer cleared, so that it can be opened through links */
+bool clearStatusFlags (const std::string& path)
+{
+    const hid_t fapl = createClearingAccessList();
+    const hid_t file = H5Fopen (path.c_str(), H5F_ACC_RDWR, fapl >= 0 ? fapl : H5P_DEFAULT);
+
+    if (fapl >= 0)
+        H5Pclose (fapl);
+
+    return file >= 0 && H5Fclose (file) >= 0;
+}
+
+/** Restores the shard an external link points to from its base image, once per shard */
+herr_t restoreShard (hid_t root, const char* name, const H5L_info_t* info, void* data)
+{
+    if (info->type != H5L_TYPE_EXTERNAL)
+        return 0;
+
+    auto& state = *static_cast<std::pair<std::string, std::map<std::string, bool>>*> (data);
+
+    std::vector<char> value (info->u.val_size);
+    const char* fileName = nullptr;
+    const char* objectName = nullptr;
+
+    if (H5Lget_val (root, name, value.data(), value.size(), H5P_DEFAULT) < 0
+        || H5Lunpack_elink_val (value.data(), value.size(), nullptr, &fileName, &objectName) < 0)
+        return 0;
+
+    // shards are named relative to the NWB file
+    const std::string shard = fileName[0] == '/' ? std::string (fileName) : state.first + fileName;
+
+    if (state.second.count (shard) > 0)
+        return 0;
+
+    const std::string base = JournalWriter::basePath (shard);
+    const bool restored = std::ifstream (base).good() && copyFile (base, shard);
+
+    if (! restored)
+        std::cerr << "No base image of " << shard << ", its rows are replayed into it as it is" << std::endl;
+
+    if (! clearStatusFlags (shard))
+        std::cerr << "Could not open " << shard << " with HDF5" << std::endl;
+
+    state.second[shard] = restored;
+
+    return 0;
+}
+
+/** Extends the datasets stored in raw data files to the rows held by the files */
+herr_t extendRawDataSet (hid_t root, const char* name, const H5O_info_t* info, void* data)
+{
+    if (info->type != H5O_TYPE_DATASET)
+        return 0;
+
+    const std::string& directory = *static_cast<const std::string*> (data);
+
+    const hid_t dataSet = H5Dopen2 (root, name, H5P_DEFAULT);
+    const hid_t dcpl = H5Dget_create_plist (dataSet);
+    const hid_t space = H5Dget_space (dataSet);
+
+    hsize_t dims[2];
+
+    if (H5Pget_external_count (dcpl) == 1 && H5Sget_simple_extent_ndims (space) == 2 && H5Sget_simple_extent_dims (space, dims, nullptr) == 2 && dims[1] > 0)
+    {
+        char fileName[4096];
+        off_t offset;
+        hsize_t size;
+        H5Pget_external (dcpl, 0, sizeof (fileName), fileName, &offset, &size);
+
+        const hid_t type = H5Dget_type (dataSet);
+        const hsize_t rowSize = H5Tget_size (type) * dims[1];
+        H5Tclose (type);
+
+        // raw data files are named relative to the NWB file
+        std::ifstream raw (fileName[0] == '/' ? std::string (fileName) : directory + fileName, std::ios::binary | std::ios::ate);
+        const hsize_t rows = raw ? hsize_t (raw.tellg()) / rowSize : 0;
+
+        if (rows > dims[0])
+        {
+            std::cout << "Extending " << name << " from " << dims[0] << " to " << rows << " rows of " << fileName << std::endl;
+
+            dims[0] = rows;
+            H5Dset_extent (dataSet, dims);
+        }
+    }
+
+    H5Sclose (space);
+    H5Pclose (dcpl);
+    H5Dclose (dataSet);
+
+    return 0;
+}
+
+} // namespace
+
+int main (int argc, char** argv)
+{
+    if (argc < 2 || argc > 3)
+    {
+        std::cerr << "Usage: " << argv[0] << " <file.nwb> [output.nwb]" << std::endl;
+        return 1;
+    }
+
+    const std::string filePath = argv[1];
+    const std::string stem = filePath.size() > 4 && filePath.compare (filePath.size() - 4, 4, ".nwb") == 0 ? filePath.substr (0, filePath.size() - 4) : filePath;
+    const std::string outputPath = argc > 2 ? argv[2] : stem + "_recovered.nwb";
+
+    JournalReader journal;
+
+    if (! journal.open (JournalWriter::journalPath (filePath)))
+    {
+        std::cerr << "Could not read " << JournalWriter::journalPath (filePath) << std::endl;
+        return 1;
+    }
+
+    // the damaged file is left as it is, and the rows are replayed into a copy of the file as it was before any of them
+    std::string sourcePath = JournalWriter::basePath (filePath);
+
+    if (! std::ifstream (sourcePath).good())
+    {
+        std::cerr << "No base image " << sourcePath << ", replaying the journal into a copy of the file itself" << std::endl;
+        sourcePath = filePath;
+    }
+
+    if (! copyFile (sourcePath, outputPath))
+    {
+        std::cerr << "Could not copy " << sourcePath << " to " << outputPath << std::endl;
+        return 1;
+    }
+
+    H5Eset_auto2 (H5E_DEFAULT, nullptr, nullptr);
+
+    const size_t separator = filePath.find_last_of ("/\\");
+    const std::string directory = separator == std::string::npos ? std::string() : filePath.substr (0, separator + 1);
+
+    // a copy taken while the file was written with the latest format is still marked as open
+    const hid_t fapl = createClearingAccessList();
+    const hid_t file = H5Fopen (outputPath.c_str(), H5F_ACC_RDWR, fapl >= 0 ? fapl : H5P_DEFAULT);
+
+    if (fapl >= 0)
+        H5Pclose (fapl);
+
+    if (file < 0)
+    {
+        std::cerr << "Could not open " << outputPath << " with HDF5" << std::endl;
+        return 1;
+    }
+
+    // shards are restored before any of their datasets is opened through the links
+    std::pair<std::string, std::map<std::string, bool>> shards (directory, {});
+
+    H5Lvisit (file, H5_INDEX_NAME, H5_ITER_NATIVE, restoreShard, &shards);
+
+    std::map<uint32_t, std::string> paths;
+    std::map<uint32_t, hid_t> dataSets;
+    std::map<std::string, uint64_t> lostRows;
+
+    JournalRecord record;
+    std::vector<char> payload;
+    uint64_t numRecords = 0;
+    uint64_t numRows = 0;
+    bool ok = true;
+
+    while (journal.next (record, payload))
+    {
+        numRecords++;
+
+        if (record.kind == JournalRecord::DATASET)
+        {
+            paths[record.dataSet] = std::string (payload.begin(), payload.end());
+            continue;
+        }
+
+        if (record.kind != JournalRecord::ROWS || paths.count (record.dataSet) == 0)
+            continue;
+
+        const std::string& path = paths[record.dataSet];
+
+        if (dataSets.count (record.dataSet) == 0)
+            dataSets[record.dataSet] = H5Dopen2 (file, path.c_str(), H5P_DEFAULT);
+
+        // datasets created after the file was last flushed cannot be rebuilt
+        const hid_t dataSet = dataSets[record.dataSet];
+
+        if (dataSet < 0)
+        {
+            lostRows[path] += record.numRows;
+            continue;
+        }
+
+        if (! writeRows (dataSet, record, payload))
+        {
+            std::cerr << "Error writing rows " << record.firstRow << " to " << record.firstRow + record.numRows << " of " << path << std::endl;
+            ok = false;
+            continue;
+        }
+
+        numRows += record.numRows;
+    }
+
+    for (auto& entry : dataSets)
+    {
+        if (entry.second >= 0)
+            H5Dclose (entry.second);
+    }
+
+    if (journal.stoppedAtCorruptRecord())
+        std::cerr << "The journal is damaged after " << journal.getOffset() << " bytes, the records after that are ignored" << std::endl;
+
+#if H5_VERSION_GE(1, 12, 0)
+    H5Ovisit (file, H5_INDEX_NAME, H5_ITER_NATIVE, extendRawDataSet, (void*) &directory, H5O_INFO_BASIC);
+#else
+    H5Ovisit (file, H5_INDEX_NAME, H5_ITER_NATIVE, extendRawDataSet, (void*) &directory);
+#endif
+
+    // files without spike channels have no units table
+    if (H5Lexists (file, "/units", H5P_DEFAULT) > 0 && H5Lexists (file, (std::string ("/units/") + SpikeTimeGrouper::arrivalTimesName).c_str(), H5P_DEFAULT) > 0)
+    {
+        SpikeTimeGrouper grouper;
+        bool grouped = grouper.open (file, "/units");
+
+        while (grouped && ! grouper.isDone())
+            grouped = grouper.writeNextUnits();
+
+        grouped = grouper.close (grouped) && grouped;
+
+        if (grouped)
+            std::cout << "Grouped " << grouper.getNumSpikes() << " spike times of " << grouper.getNumUnits() << " units" << std::endl;
+        else
+            std::cerr << "Error grouping the spike times of the units table" << std::endl;
+
+        ok = grouped && ok;
+    }
+
+    if (H5Fclose (file) < 0)
+    {
+        std::cerr << "Error writing " << outputPath << std::endl;
+        return 1;
+    }
+
+    for (auto& entry : lostRows)
+        std::cerr << entry.second << " rows of " << entry.first << " could not be recovered, the dataset is not in the file" << std::endl;
+
+    std::cout << "Replayed " << numRecords << " journal records (" << journal.getOffset() << " bytes, "
+              << numRows << " rows) into " << outputPath << std::endl;
+
+    return ok && lostRows.empty() ? 0 : 2;
+}